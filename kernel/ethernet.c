@@ -14,25 +14,209 @@
  *    nibbles to be swapped.
  *    Transmit data is read from 0x13fe0000.  Write length/4+1 to
  *    ETHERNET_REG to start transfer.
+ *    Build with ETHERNET_DESC for an eth_dma that writes whole frames
+ *    through the receive descriptors in plasma.h directly into IPFrame
+ *    buffers (modelled by "mlite -ethrx capture.pcap").
  *--------------------------------------------------------------------*/
+#ifndef ETHERNET_CRC_ONLY
 #include "plasma.h"
 #include "rtos.h"
 #include "tcpip.h"
+#endif
+
+#define POLYNOMIAL  0xEDB88320   //CRC32 bit reversed
+#ifndef CRC_SLICE
+#define CRC_SLICE   4            //Bytes per CRC step: 4 or 8
+#endif
+#define SWAP(B)     ((((B) << 4) | ((B) >> 4)) & 0xff)
+
+static uint32 CrcTable[CRC_SLICE][256];
+
+
+/******************* CRC32 calculations **********************
+ * Slicing-by-4/8 CRC32 (Intel, Kounavis & Berry 2005) computed directly
+ * on the nibble swapped bytes the PHY sends and receives.  The tables
+ * are indexed by a swapped byte and the CRC is kept with the nibbles of
+ * each byte swapped, so the data never needs reflecting or swapping
+ * back and the four FCS bytes on the wire are the complemented CRC.
+ * tools/crcbench.c builds this section alone with ETHERNET_CRC_ONLY
+ * and compares it with the old byte at a time CRC. */
+static void CrcInit(void)
+{
+   uint32 crc;
+   int i, bit, k;
+
+   for(i = 0; i < 256; ++i)
+   {
+      crc = i;
+      for(bit = 0; bit < 8; ++bit)
+         crc = (crc >> 1) ^ ((crc & 1) ? POLYNOMIAL : 0);
+      crc = ((crc << 4) & 0xf0f0f0f0) | ((crc >> 4) & 0x0f0f0f0f);
+      CrcTable[0][SWAP(i)] = crc;
+   }
+   for(k = 1; k < CRC_SLICE; ++k)
+   {
+      for(i = 0; i < 256; ++i)
+      {
+         crc = CrcTable[k - 1][i];
+         CrcTable[k][i] = (crc >> 8) ^ CrcTable[0][crc & 0xff];
+      }
+   }
+}
+
+
+#define CRC_BYTE(CRC, B) (((CRC) >> 8) ^ CrcTable[0][((CRC) ^ (B)) & 0xff])
 
-#define POLYNOMIAL  0x04C11DB7   //CRC bit 33 is truncated
-#define TOPBIT      (1<<31)
+//Four bytes with the first byte in the low bits
+static uint32 CrcWord(uint32 crc, uint32 word)
+{
+   crc ^= word;
+   return CrcTable[3][crc & 0xff] ^ CrcTable[2][(crc >> 8) & 0xff] ^ 
+      CrcTable[1][(crc >> 16) & 0xff] ^ CrcTable[0][crc >> 24];
+}
+
+
+#if CRC_SLICE == 8
+static uint32 CrcWord2(uint32 crc, uint32 word, uint32 word2)
+{
+   crc ^= word;
+   return CrcTable[7][crc & 0xff] ^ CrcTable[6][(crc >> 8) & 0xff] ^ 
+      CrcTable[5][(crc >> 16) & 0xff] ^ CrcTable[4][crc >> 24] ^
+      CrcTable[3][word2 & 0xff] ^ CrcTable[2][(word2 >> 8) & 0xff] ^ 
+      CrcTable[1][(word2 >> 16) & 0xff] ^ CrcTable[0][word2 >> 24];
+}
+#endif
+
+
+//Swap nibbles into the transmit buffer a word at a time and update the CRC32
+static uint32 EthernetSwapCopy(volatile unsigned char *buf, 
+                               const unsigned char *buffer, int length, uint32 crc)
+{
+   int i;
+   uint32 b0, b1, b2, b3;
+
+   for(i = 0; i < length; i += 4)
+   {
+      b0 = SWAP(buffer[i]); b1 = SWAP(buffer[i+1]); 
+      b2 = SWAP(buffer[i+2]); b3 = SWAP(buffer[i+3]);
+      buf[i] = (unsigned char)b0; buf[i + 1] = (unsigned char)b1;
+      buf[i + 2] = (unsigned char)b2; buf[i + 3] = (unsigned char)b3;
+      crc = CrcWord(crc, b0 | b1 << 8 | b2 << 16 | b3 << 24);
+   }
+   return crc;
+}
+
+
+//Copy length bytes in a row swapping the nibbles and update the CRC32
+static uint32 EthernetSwapRead(unsigned char *buffer, 
+                               const volatile unsigned char *ptr, int length, uint32 crc)
+{
+   uint32 b0, b1, b2, b3;
+   int i = 0;
+
+#if CRC_SLICE == 8
+   uint32 b4, b5, b6, b7;
+   for(; i + 8 <= length; i += 8)
+   {
+      b0 = ptr[i]; b1 = ptr[i+1]; b2 = ptr[i+2]; b3 = ptr[i+3];
+      b4 = ptr[i+4]; b5 = ptr[i+5]; b6 = ptr[i+6]; b7 = ptr[i+7];
+      buffer[i] = SWAP(b0); buffer[i+1] = SWAP(b1); 
+      buffer[i+2] = SWAP(b2); buffer[i+3] = SWAP(b3);
+      buffer[i+4] = SWAP(b4); buffer[i+5] = SWAP(b5); 
+      buffer[i+6] = SWAP(b6); buffer[i+7] = SWAP(b7);
+      crc = CrcWord2(crc, b0 | b1 << 8 | b2 << 16 | b3 << 24,
+                     b4 | b5 << 8 | b6 << 16 | b7 << 24);
+   }
+#endif
+   for(; i + 4 <= length; i += 4)
+   {
+      b0 = ptr[i]; b1 = ptr[i+1]; b2 = ptr[i+2]; b3 = ptr[i+3];
+      buffer[i] = SWAP(b0); buffer[i+1] = SWAP(b1); 
+      buffer[i+2] = SWAP(b2); buffer[i+3] = SWAP(b3);
+      crc = CrcWord(crc, b0 | b1 << 8 | b2 << 16 | b3 << 24);
+   }
+   for(; i < length; ++i)
+   {
+      b0 = ptr[i];
+      buffer[i] = SWAP(b0);
+      crc = CRC_BYTE(crc, b0);
+   }
+   return crc;
+}
+
+
+#ifndef ETHERNET_CRC_ONLY
 #define BYTE_EMPTY  0xde         //Data copied into receive buffer
 #define COUNT_EMPTY 16           //Count to decide there isn't data
 #define INDEX_MASK  0xffff       //Size of receive buffer
 
 static unsigned char gDestMac[]={0x5d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
-static unsigned int CrcTable[256];
-static unsigned char reflect[256];
-static unsigned char reflectNibble[256];
 static OS_Semaphore_t *SemEthernet, *SemEthTransmit;
 static int gIndex;          //byte index into 0x13ff0000 receive buffer
 static int gCrcChecked;
 static volatile int ethTxBusy;
+#ifdef ETHERNET_DESC
+static volatile uint32 RxDesc[ETHERNET_DESC_COUNT][2];
+static IPFrame *RxFrame[ETHERNET_DESC_COUNT];
+static int RxNext;
+#endif
+
+
+//Copy length bytes from the receive buffer starting at index to buffer
+//swapping the nibbles and return the CRC32.  Slicing needs the bytes in
+//a row so a frame that wraps around the receive buffer goes bytewise.
+static uint32 EthernetCopy(unsigned char *buffer, int index, int length)
+{
+   volatile unsigned char *buf = (unsigned char*)ETHERNET_RECEIVE;
+   uint32 crc = 0xffffffff, byte;
+   int i;
+
+   if(index + length <= INDEX_MASK + 1)
+      return EthernetSwapRead(buffer, buf + index, length, crc);
+   for(i = 0; i < length; ++i)
+   {
+      byte = buf[(index + i) & INDEX_MASK];
+      buffer[i] = SWAP(byte);
+      crc = CRC_BYTE(crc, byte);
+   }
+   return crc;
+}
+
+
+//Mark the frame and its CRC as read and move gIndex past them
+static void EthernetRelease(int start, int count)
+{
+   volatile unsigned char *buf = (unsigned char*)ETHERNET_RECEIVE;
+   int i;
+
+   for(i = 0; i < count+5; ++i)
+      buf[(start + i) & INDEX_MASK] = BYTE_EMPTY;
+   gIndex = (start + count + 5) & INDEX_MASK;
+   while(gIndex & 3)
+   {
+      buf[gIndex] = BYTE_EMPTY;
+      gIndex = (gIndex + 1) & INDEX_MASK;
+   }
+   gCrcChecked = 0;
+}
+
+
+//Frame length from the IPv4 or ARP header or 0 if unknown
+static int EthernetLength(int index)
+{
+   volatile unsigned char *buf = (unsigned char*)ETHERNET_RECEIVE;
+   int type, length;
+
+   type = SWAP(buf[(index + 12) & INDEX_MASK]) << 8 | 
+      SWAP(buf[(index + 13) & INDEX_MASK]);
+   if(type == 0x0806)
+      return 60;
+   if(type != 0x0800)
+      return 0;
+   length = 14 + (SWAP(buf[(index + 16) & INDEX_MASK]) << 8 | 
+      SWAP(buf[(index + 17) & INDEX_MASK]));
+   return length < 60 ? 60 : length;
+}
 
 
 //Read received data from 0x13ff0000.  Data starts with 0x5d+MACaddress.
@@ -42,10 +226,9 @@ static volatile int ethTxBusy;
 int EthernetReceive(unsigned char *buffer, int length)
 {
    int count;
-   int start, i, j, shift, offset, index, emptyCount;
-   int byte, byteNext;
-   unsigned long crc;
-   int byteCrc;
+   int start, i, j, offset, index, emptyCount;
+   int byte;
+   uint32 crc, fcs;
    volatile unsigned char *buf = (unsigned char*)ETHERNET_RECEIVE;
    int packetExpected;
    
@@ -91,52 +274,45 @@ int EthernetReceive(unsigned char *buffer, int length)
       gIndex = (gIndex + 1) & INDEX_MASK;
    }
 
-   //Found start of frame.  Now find end of frame and check CRC.
+   //Found start of frame.  Most frames give their length in the header
+   //so check the CRC there first.
    start = gIndex;
-   gIndex = (gIndex + 1) & INDEX_MASK;           //skip 0x5d byte
+   index = (start + 1) & INDEX_MASK;             //skip 0x5d byte
+   count = EthernetLength(index);
+   if(count && count <= length)
+   {
+      crc = EthernetCopy(buffer, index, count);
+      fcs = 0;
+      for(i = 3; i >= 0; --i)
+         fcs = fcs << 8 | buf[(index + count + i) & INDEX_MASK];
+      if((crc ^ fcs) == 0xffffffff)
+      {
+         EthernetRelease(start, count);
+         return count;
+      }
+   }
+
+   //Find end of frame by checking if the CRC matches after each byte
+   gIndex = index;
    crc = 0xffffffff;
    for(count = 0; count < length; )
    {
       byte = buf[gIndex];
       gIndex = (gIndex + 1) & INDEX_MASK;
-
-      byte = ((byte << 4) & 0xf0) | (byte >> 4); //swap nibbles
-      buffer[count++] = (unsigned char)byte;
-      byte = reflect[byte] ^ (crc >> 24);        //calculate CRC32
-      crc = CrcTable[byte] ^ (crc << 8);
-      if(count >= 40)
+      buffer[count++] = (unsigned char)SWAP(byte);
+      crc = CRC_BYTE(crc, byte);
+      if(count >= 40 && buf[gIndex] == (~crc & 0xff))
       {
-         //Check if CRC matches to detect end of frame
-         byteCrc = reflectNibble[crc >> 24];
-         byteNext = buf[gIndex];
-         if(byteCrc == byteNext)
+         for(i = 1; i < 4; ++i)
          {
-            for(i = 1; i < 4; ++i)
-            {
-               shift = 24 - (i << 3);
-               byteCrc = reflectNibble[(crc >> shift) & 0xff];
-               byteNext = buf[(gIndex + i) & 0xffff];
-               if(byteCrc != byteNext)
-               {
-                  //printf("nope %d %d 0x%x 0x%x\n", count, i, byteCrc, byteNext);
-                  i = 99;
-               }
-            }
-            if(i == 4)
-            {
-               //Found end of frame -- set used bytes to BYTE_EMPTY
-               //printf("Found it! %d\n", count);
-               gIndex = (gIndex + 4) & INDEX_MASK;
-               for(i = 0; i < count+5; ++i)
-                  buf[(start + i) & INDEX_MASK] = BYTE_EMPTY;
-               while(gIndex & 3)
-               {
-                  buf[gIndex] = BYTE_EMPTY;
-                  gIndex = (gIndex + 1) & INDEX_MASK;
-               }
-               gCrcChecked = 0;
-               return count;
-            }
+            if(buf[(gIndex + i) & INDEX_MASK] != ((~crc >> (i << 3)) & 0xff))
+               break;
+         }
+         if(i == 4)
+         {
+            //Found end of frame -- set used bytes to BYTE_EMPTY
+            EthernetRelease(start, count);
+            return count;
          }
       }
    }
@@ -150,11 +326,15 @@ int EthernetReceive(unsigned char *buffer, int length)
 }
 
 
-//Copy transmit data to 0x13fe0000 with preamble and CRC32
-void EthernetTransmit(unsigned char *buffer, int length)
+//Copy transmit data to 0x13fe0000 with preamble and CRC32.  The frame
+//is the headers in buffer followed by dataLength bytes at data, which
+//are read in place (see IPWriteConst()).
+void EthernetTransmitGather(unsigned char *buffer, int length, 
+                            const unsigned char *data, int dataLength)
 {
-   int i, byte, shift;
-   unsigned long crc;
+   int i, tailLength=0;
+   uint32 crc;
+   unsigned char tail[4];
    volatile unsigned char *buf = (unsigned char*)ETHERNET_TRANSMIT;
 
    OS_SemaphorePend(SemEthTransmit, OS_WAIT_FOREVER);
@@ -168,31 +348,50 @@ void EthernetTransmit(unsigned char *buffer, int length)
    }
 
    Led(2, 2);
-   while(length < 60 || (length & 3) != 0)
-      buffer[length++] = 0;
+   if(length + dataLength < 64 || dataLength < 4)
+   {
+      memcpy(buffer + length, data, dataLength);
+      length += dataLength;
+      dataLength = 0;
+   }
+   if(dataLength == 0)
+   {
+      while(length < 60 || (length & 3) != 0)
+         buffer[length++] = 0;
+   }
+   else
+   {
+      //Word align the headers with the first data bytes and pad the rest
+      while(length & 3)
+      {
+         buffer[length++] = *data++;
+         --dataLength;
+      }
+      tailLength = dataLength & 3;
+      dataLength -= tailLength;
+      memset(tail, 0, sizeof(tail));
+      memcpy(tail, data + dataLength, tailLength);
+   }
 
    //Start of Ethernet frame
    for(i = 0; i < 7; ++i)
       buf[i] = 0x55;
    buf[7] = 0x5d;
 
-   //Calculate CRC32
-   crc = 0xffffffff;
-   for(i = 0; i < length; ++i)
+   //Swap nibbles and calculate CRC32
+   crc = EthernetSwapCopy(buf + 8, buffer, length, 0xffffffff);
+   crc = EthernetSwapCopy(buf + 8 + length, data, dataLength, crc);
+   length += dataLength;
+   if(tailLength)
    {
-      byte = buffer[i];
-      buf[i + 8] = (unsigned char)((byte << 4) | (byte >> 4)); //swap nibbles
-      byte = reflect[byte] ^ (crc >> 24);        //calculate CRC32
-      crc = CrcTable[byte] ^ (crc << 8);
+      crc = EthernetSwapCopy(buf + 8 + length, tail, 4, crc);
+      length += 4;
    }
 
    //Output CRC32
+   crc = ~crc;
    for(i = 0; i < 4; ++i)
-   {
-      shift = 24 - (i << 3);
-      byte = reflectNibble[(crc >> shift) & 0xff];
-      buf[length + 8 + i] = (unsigned char)byte;
-   }
+      buf[length + 8 + i] = (unsigned char)(crc >> (i << 3));
 
    //Start transfer
    length = (length + 12 + 4) >> 2;
@@ -211,10 +410,85 @@ void EthernetTransmit(unsigned char *buffer, int length)
 }
 
 
+void EthernetTransmit(unsigned char *buffer, int length)
+{
+   EthernetTransmitGather(buffer, length, NULL, 0);
+}
+
+
+#ifdef ETHERNET_DESC
+//Give a frame buffer to the receive DMA
+static void EthernetDescArm(int index, IPFrame *frame)
+{
+   RxFrame[index] = frame;
+   RxDesc[index][0] = (uint32)frame->packet;
+   RxDesc[index][1] = PACKET_SIZE;
+}
+
+
+//Pass the frames the DMA wrote to the IP stack without copying them.
+//A frame kept by the stack is replaced in the ring with ethFrame.
+static void EthernetDescReceive(IPFrame **ethFrame)
+{
+   int length, rc;
+   uint32 status;
+
+   if(RxFrame[ETHERNET_DESC_COUNT - 1] == NULL)
+   {
+      //Fill the ring once the IP stack has frames
+      for(RxNext = 0; RxNext < ETHERNET_DESC_COUNT; ++RxNext)
+      {
+         if(RxFrame[RxNext] == NULL)
+         {
+            if(*ethFrame == NULL)
+               *ethFrame = IPFrameGet(FRAME_COUNT_RCV);
+            if(*ethFrame == NULL)
+               return;
+            EthernetDescArm(RxNext, *ethFrame);
+            *ethFrame = NULL;
+         }
+      }
+      RxNext = 0;
+      MemoryWrite(ETHERNET_DESC_REG, (uint32)RxDesc);
+   }
+
+   MemoryRead(ETHERNET_DESC_REG);        //clear receive interrupt
+   for(;;)
+   {
+      status = RxDesc[RxNext][1];
+      if((status & ETHERNET_DESC_DONE) == 0)
+         break;                          //no packet found
+      if(*ethFrame == NULL)
+         *ethFrame = IPFrameGet(FRAME_COUNT_RCV);
+      if(*ethFrame == NULL)
+         break;                          //leave the packet in the ring
+      rc = 0;
+      if((status & ETHERNET_DESC_ERROR) == 0)
+      {
+         length = status & ETHERNET_DESC_LENGTH;
+         Led(1, 1);
+         rc = IPProcessEthernetPacket(RxFrame[RxNext], length);
+         Led(1, 0);
+      }
+      if(rc)
+      {
+         EthernetDescArm(RxNext, *ethFrame);
+         *ethFrame = NULL;
+      }
+      else
+         RxDesc[RxNext][1] = PACKET_SIZE;
+      RxNext = (RxNext + 1) % ETHERNET_DESC_COUNT;
+   }
+}
+#endif
+
+
 void EthernetThread(void *arg)
 {
+#ifndef ETHERNET_DESC
    int length;
    int rc;
+#endif
    unsigned int ticks, ticksLast=0;
    IPFrame *ethFrame=NULL;
    (void)arg;
@@ -224,7 +498,11 @@ void EthernetThread(void *arg)
       OS_InterruptMaskSet(IRQ_ETHERNET_RECEIVE);    //enable interrupt
       OS_SemaphorePend(SemEthernet, 50);            //wait for interrupt
 
-      //Process all received packets
+      //Process all received packets, ACK'ing once for the batch
+      IPBatchBegin();
+#ifdef ETHERNET_DESC
+      EthernetDescReceive(&ethFrame);
+#else
       for(;;)
       {
          if(ethFrame == NULL)
@@ -242,6 +520,8 @@ void EthernetThread(void *arg)
          if(rc)
             ethFrame = NULL;
       }
+#endif
+      IPBatchEnd();
 
       ticks = OS_ThreadTime();
       if(ticks - ticksLast >= 50)
@@ -261,53 +541,6 @@ void EthernetIsr(void *arg)
 }
 
 
-/******************* CRC32 calculations **********************
- * The CRC32 code is modified from Michael Barr's article in 
- * Embedded Systems Programming January 2000.
- * A CRC is really modulo-2 binary division.  Substraction means XOR. */
-static unsigned int Reflect(unsigned int value, int bits)
-{
-   unsigned int num=0;
-   int i;
-   for(i = 0; i < bits; ++i)
-   {
-      num = (num << 1) | (value & 1);
-      value >>= 1;
-   }
-   return num;
-}
-
-
-static void CrcInit(void)
-{
-   unsigned int remainder;
-   int dividend, bit, i;
-
-   //Compute the remainder of each possible dividend
-   for(dividend = 0; dividend < 256; ++dividend)
-   {
-      //Start with the dividend followed by zeros
-      remainder = dividend << 24;
-      //Perform modulo-2 division, a bit at a time
-      for(bit = 8; bit > 0; --bit)
-      {
-         //Try to divide the current data bit
-         if(remainder & TOPBIT)
-            remainder = (remainder << 1) ^ POLYNOMIAL;
-         else
-            remainder = remainder << 1;
-      }
-      CrcTable[dividend] = remainder;
-   }
-   for(i = 0; i < 256; ++i)
-   {
-      reflect[i] = (unsigned char)Reflect(i, 8);
-      reflectNibble[i] = (unsigned char)((Reflect((i >> 4) ^ 0xf, 4) << 4) | 
-         Reflect(i ^ 0xf, 4));
-   }
-}
-
-
 static void SpinWait(int clocks)
 {
    int value = *(volatile int*)COUNTER_REG + clocks;
@@ -402,4 +635,4 @@ void EthernetInit(unsigned char MacAddress[6])
    //Start receive DMA
    MemoryWrite(GPIO0_SET, ETHERNET_ENABLE);
 }
-
+#endif  //ETHERNET_CRC_ONLY
@@ -18,60 +18,289 @@
 #define OS_ThreadCreate(A,B,C,D,E) 0
 #endif
 
+#define HTTP_BUFFER_SIZE 600            //longest request header
+#define HTTP_HASH_SIZE 32
+
+//Responses with a Content-Length can keep the connection open
 static const char pageGif[]=
 {
-   "HTTP/1.0 200 OK\r\n"
+   "HTTP/1.1 200 OK\r\n"
    "Content-Length: %d\r\n"
-   "Content-Type: binary/gif\r\n\r\n"
+   "Content-Type: binary/gif\r\n%s\r\n"
 };
 static const char pageGif2[]=
 {
-   "HTTP/1.0 200 OK\r\n"
+   "HTTP/1.1 200 OK\r\n"
+   "Connection: close\r\n"
    "Content-Type: binary/gif\r\n\r\n"
 };
 static const char pageBinary[]=
 {
-   "HTTP/1.0 200 OK\r\n"
+   "HTTP/1.1 200 OK\r\n"
    "Content-Length: %d\r\n"
-   "Content-Type: binary/binary\r\n\r\n"
+   "Content-Type: binary/binary\r\n%s\r\n"
 };
 static const char pageBinary2[]=
 {
-   "HTTP/1.0 200 OK\r\n"
+   "HTTP/1.1 200 OK\r\n"
+   "Connection: close\r\n"
    "Content-Type: binary/binary\r\n\r\n"
 };
 static const char pageHtml[]={
-   "HTTP/1.0 200 OK\r\n"
+   "HTTP/1.1 200 OK\r\n"
    "Content-Length: %d\r\n"
-   "Content-Type: text/html\r\n\r\n"
+   "Content-Type: text/html\r\n%s\r\n"
 };
 static const char pageHtml2[]={
-   "HTTP/1.0 200 OK\r\n"
+   "HTTP/1.1 200 OK\r\n"
+   "Connection: close\r\n"
    "Content-Type: text/html\r\n\r\n"
 };
 static const char pageText[]={
-   "HTTP/1.0 200 OK\r\n"
+   "HTTP/1.1 200 OK\r\n"
    "Content-Length: %d\r\n"
-   "Content-Type: text/text\r\n\r\n"
+   "Content-Type: text/text\r\n%s\r\n"
 };
 static const char pageEmpty[]=
 {
-   "HTTP/1.0 404 OK\r\n"
+   "HTTP/1.1 404 OK\r\n"
    "Content-Length: 0\r\n"
-   "Content-Type: text/html\r\n\r\n"
+   "Content-Type: text/html\r\n%s\r\n"
+};
+static const char *connection[]=
+{
+   "Connection: close\r\n",
+   "Connection: keep-alive\r\n"
 };
 
+//Request bytes kept in socket->userPtr until the rest arrives
+typedef struct {
+   int bytes;
+   char buf[HTTP_BUFFER_SIZE];
+} HttpConn_t;
+
 static const PageEntry_t *HtmlPages;
 static int HtmlFiles;
+static short HttpHash[HTTP_HASH_SIZE];  //pages named "/path " by path
+static short HttpPrefix;                //other pages match as a prefix
+static short *HttpNext;                 //chains in HtmlPages[] order
 
 
-void HttpServer(IPSocket *socket)
+static int HttpHashName(const char *name, int length)
+{
+   unsigned int hash = 0;
+   int i;
+
+   for(i = 0; i < length; ++i)
+      hash = hash * 31 + (uint8)name[i];
+   return hash & (HTTP_HASH_SIZE - 1);
+}
+
+
+//Return the first page in HtmlPages[] that the request at path matches
+//or -1.  A name ending in a space must equal the path, otherwise the
+//name only has to start the path.
+static int HttpFind(const char *path)
 {
-   uint8 buf[600];
+   int i, length, found=-1;
+   const char *name;
+
+   if(HttpNext == NULL)
+   {
+      for(i = 0; HtmlPages[i].length != HTML_LENGTH_LIST_END; ++i)
+      {
+         name = HtmlPages[i].name;
+         if(strncmp(path, name, (int)strlen(name)) == 0)
+            return i;
+      }
+      return -1;
+   }
+   for(length = 0; path[length] && path[length] != ' '; ++length)
+      ;
+   for(i = HttpHash[HttpHashName(path, length)]; i >= 0; i = HttpNext[i])
+   {
+      name = HtmlPages[i].name;
+      if(strncmp(path, name, length + 1) == 0 && name[length + 1] == 0)
+      {
+         found = i;
+         break;
+      }
+   }
+   for(i = HttpPrefix; i >= 0 && (found < 0 || i < found); i = HttpNext[i])
+   {
+      name = HtmlPages[i].name;
+      if(strncmp(path, name, (int)strlen(name)) == 0)
+         return i;
+   }
+   return found;
+}
+
+
+//Case insensitive search for the value of a header line; name is lower case
+static const char *HttpHeader(const char *request, const char *name)
+{
+   const char *line;
+   int i;
+
+   for(line = strstr(request, "\r\n"); line; line = strstr(line, "\r\n"))
+   {
+      line += 2;
+      for(i = 0; name[i] && (line[i] | 0x20) == name[i]; ++i)
+         ;
+      if(name[i] == 0)
+      {
+         for(line += i; *line == ' '; ++line)
+            ;
+         return line;
+      }
+   }
+   return NULL;
+}
+
+
+//Answer one request.  Returns 1 if the connection stays open for the
+//next request and 0 if it was closed or given to a page callback.
+static int HttpRequest(IPSocket *socket, char *request, int bytes, int complete)
+{
+   uint8 buf[HTTP_BUFFER_SIZE];
    char filename[80];
-   int bytes, i, length, len, needFooter;
-   char *name=NULL, *page=NULL;
-   const char *header, *header2;
+   int i, length, len, needFooter, keepAlive;
+   char *name=NULL, *page=NULL, *ptr;
+   const char *header, *header2, *value;
+
+   //HTTP/1.1 keeps the connection unless told to close and HTTP/1.0
+   //only when asked to
+   ptr = strstr(request, "\r\n");
+   keepAlive = ptr && ptr - request > 9 && strncmp(ptr - 9, " HTTP/1.1", 9) == 0;
+   value = HttpHeader(request, "connection:");
+   if(value && (*value | 0x20) == 'c')
+      keepAlive = 0;
+   else if(value && (*value | 0x20) == 'k')
+      keepAlive = 1;
+   if(complete == 0)
+      keepAlive = 0;                    //can't find the next request
+
+   if(strncmp(request, "GET /", 5))
+   {
+      //Only GET is served; the body of anything else can't be skipped
+      sprintf((char*)buf, pageEmpty, connection[0]);
+      IPWrite(socket, buf, (int)strlen((char*)buf));
+      IPClose(socket);
+      return 0;
+   }
+
+   i = HttpFind(request + 4);
+   length = i >= 0 ? HtmlPages[i].length : HTML_LENGTH_LIST_END;
+   if(i >= 0)
+   {
+      name = (char*)HtmlPages[i].name;
+      page = (char*)HtmlPages[i].page;
+   }
+#ifndef EXCLUDE_FILESYS
+   if(length == HTML_LENGTH_LIST_END && HtmlFiles)
+   {
+      FILE *file;
+
+      //Files are sent without a length so the connection closes
+      name = request + 5;
+      ptr = strstr(name, " ");
+      if(ptr)
+         *ptr = 0;
+      strcpy(filename, "/web/");
+      strncat(filename, name, 60);
+      file = fopen(filename, "rb");
+      if(file == NULL)
+      {
+         strcpy(filename, "/flash/web/");
+         strncat(filename, name, 60);
+         file = fopen(filename, "rb");
+      }
+      if(file)
+      {
+         if(strstr(name, ".htm"))
+            IPWrite(socket, (uint8*)pageHtml2, sizeof(pageHtml2)-1);
+         else if(strstr(name, ".gif"))
+            IPWrite(socket, (uint8*)pageGif2, sizeof(pageGif2)-1);
+         else
+            IPWrite(socket, (uint8*)pageBinary2, sizeof(pageBinary2)-1);
+         for(;;)
+         {
+            len = fread(buf, 1, sizeof(buf), file);
+            if(len == 0)
+               break;
+            IPWrite(socket, (uint8*)buf, len);
+         }
+         fclose(file);
+         IPWriteFlush(socket);
+         IPClose(socket);
+         return 0;
+      }
+   }
+#endif //!EXCLUDE_FILESYS
+   if(length != HTML_LENGTH_LIST_END)
+   {
+      if(length == HTML_LENGTH_CALLBACK)
+      {
+         IPCallbackPtr funcPtr = (IPCallbackPtr)(uint32)page;
+         funcPtr(socket, (uint8*)request, bytes);
+         return 0;
+      }
+      if(length == 0)
+         length = (int)strlen(page);
+      needFooter = 0;
+      header2 = NULL;
+      if(strstr(name, ".html"))
+         header = pageHtml;
+      else if(strstr(name, ".htm") || strcmp(name, "/ ") == 0)
+      {
+         header = pageHtml;
+         header2 = HtmlPages[0].page;
+         needFooter = 1;
+      }
+      else if(strstr(name, ".gif"))
+         header = pageGif;
+      else
+         header = pageBinary;
+      len = 0;
+      if(header2)
+         len += (int)strlen(header2) + (int)strlen(HtmlPages[1].page);
+      sprintf((char*)buf, header, length + len, connection[keepAlive]);
+      IPWrite(socket, buf, (int)strlen((char*)buf));
+      //The pages are constant so send them without copying
+      if(header2)
+         IPWriteConst(socket, (uint8*)header2, (int)strlen(header2));
+      IPWriteConst(socket, (uint8*)page, length);
+      if(needFooter)
+         IPWriteConst(socket, (uint8*)HtmlPages[1].page, (int)strlen(HtmlPages[1].page));
+   }
+   else
+   {
+      sprintf((char*)buf, pageEmpty, connection[keepAlive]);
+      IPWrite(socket, buf, (int)strlen((char*)buf));
+   }
+   if(keepAlive == 0)
+      IPClose(socket);
+   return keepAlive;
+}
+
+
+//Called by IPTick() when a socket with a saved partial request is freed
+static void HttpConnFree(IPSocket *socket)
+{
+   free(socket->userPtr);
+   socket->userPtr = NULL;
+}
+
+
+//Answers every complete request read so far in order, so pipelined
+//requests and requests split across segments both work.  The responses
+//are flushed together.
+void HttpServer(IPSocket *socket)
+{
+   char buf[HTTP_BUFFER_SIZE];
+   HttpConn_t *conn;
+   int bytes, count, room, end, complete, keepAlive;
+   char *ptr, ch;
 
    if(socket == NULL)
       return;
@@ -81,113 +310,99 @@ void HttpServer(IPSocket *socket)
       return;
    }
    socket->dontFlush = 2;
-   bytes = IPRead(socket, buf, sizeof(buf)-1);
-   if(bytes)
+   conn = (HttpConn_t*)socket->userPtr;
+   socket->userPtr = NULL;              //a page callback may use it
+   socket->freeFunc = NULL;
+   bytes = 0;
+   if(conn)
    {
+      bytes = conn->bytes;
+      memcpy(buf, conn->buf, bytes);
+   }
+   buf[bytes] = 0;
+   for(;;)
+   {
+      room = sizeof(buf) - 1 - bytes;
+      count = IPRead(socket, (uint8*)buf + bytes, room);
+      bytes += count;
       buf[bytes] = 0;
-      if(strncmp((char*)buf, "GET /", 5) == 0)
+      while(bytes)
       {
-         for(i = 0; ; ++i)
-         {
-            length = HtmlPages[i].length;
-            if(length == -1)
-               break;
-            name = (char*)HtmlPages[i].name;
-            page = (char*)HtmlPages[i].page;
-            len = (int)strlen(name);
-            if(strncmp((char*)buf+4, name, len) == 0)
-               break;
-         }
-#ifndef EXCLUDE_FILESYS
-         if(length == HTML_LENGTH_LIST_END && HtmlFiles)
-         {
-            FILE *file;
-            char *ptr;
-
-            name = (char*)buf + 5;
-            ptr = strstr(name, " ");
-            if(ptr)
-               *ptr = 0;
-            strcpy(filename, "/web/");
-            strncat(filename, name, 60);
-            file = fopen(filename, "rb");
-            if(file == NULL)
-            {
-               strcpy(filename, "/flash/web/");
-               strncat(filename, name, 60);
-               file = fopen(filename, "rb");
-            }
-            if(file)
-            {
-               if(strstr(name, ".htm"))
-                  IPWrite(socket, (uint8*)pageHtml2, sizeof(pageHtml2)-1);
-               else if(strstr(name, ".gif"))
-                  IPWrite(socket, (uint8*)pageGif2, sizeof(pageGif2)-1);
-               else
-                  IPWrite(socket, (uint8*)pageBinary2, sizeof(pageBinary2)-1);
-               for(;;)
-               {
-                  len = fread(buf, 1, sizeof(buf), file);
-                  if(len == 0)
-                     break;
-                  IPWrite(socket, (uint8*)buf, len);
-               }
-               fclose(file);
-               IPWriteFlush(socket);
-               IPClose(socket);
-               return;
-            }
-         }
-#endif //!EXCLUDE_FILESYS
-         if(length != HTML_LENGTH_LIST_END)
-         {
-            if(length == HTML_LENGTH_CALLBACK)
-            {
-               IPCallbackPtr funcPtr = (IPCallbackPtr)(uint32)page;
-               funcPtr(socket, buf, bytes);
-               return;
-            }
-            if(length == 0)
-               length = (int)strlen(page);
-            needFooter = 0;
-            header2 = NULL;
-            if(strstr(name, ".html"))
-               header = pageHtml;
-            else if(strstr(name, ".htm") || strcmp(name, "/ ") == 0)
-            {
-               header = pageHtml;
-               header2 = HtmlPages[0].page;
-               needFooter = 1;
-            }
-            else if(strstr(HtmlPages[i].name, ".gif"))
-               header = pageGif;
-            else
-               header = pageBinary;
-            len = 0;
-            if(header2)
-               len += (int)strlen(header2) + (int)strlen(HtmlPages[1].page);
-            sprintf((char*)buf, header, length + len);
-            IPWrite(socket, buf, (int)strlen((char*)buf));
-            if(header2)
-               IPWrite(socket, (uint8*)header2, (int)strlen(header2));
-            IPWrite(socket, (uint8*)page, length);
-            if(needFooter)
-               IPWrite(socket, (uint8*)HtmlPages[1].page, (int)strlen(HtmlPages[1].page));
-         }
+         ptr = strstr(buf, "\r\n\r\n");
+         complete = ptr != NULL;
+         if(ptr)
+            end = ptr + 4 - buf;
+         else if(bytes >= (int)sizeof(buf) - 1)
+            end = bytes;                 //too long; answer and close
          else
+            break;
+         ch = buf[end];
+         buf[end] = 0;
+         keepAlive = HttpRequest(socket, buf, end, complete);
+         if(keepAlive == 0)
          {
-            IPWrite(socket, (uint8*)pageEmpty, (int)strlen(pageEmpty));
+            if(conn)
+               free(conn);
+            return;
          }
-         IPClose(socket);
+         buf[end] = ch;
+         bytes -= end;
+         memmove(buf, buf + end, bytes + 1);
       }
+      if(count == 0 && room)
+         break;
    }
+   IPWriteFlush(socket);
+
+   //Keep a partial request for the next call
+   if(bytes && socket->state <= IP_TCP)
+   {
+      if(conn == NULL)
+         conn = (HttpConn_t*)malloc(sizeof(HttpConn_t));
+      if(conn)
+      {
+         conn->bytes = bytes;
+         memcpy(conn->buf, buf, bytes);
+      }
+   }
+   else if(conn)
+   {
+      free(conn);
+      conn = NULL;
+   }
+   socket->userPtr = conn;
+   socket->freeFunc = conn ? HttpConnFree : NULL;
+   if(socket->state == IP_FIN_CLIENT)
+      IPClose(socket);
 }
 
 
 void HttpInit(const PageEntry_t *Pages, int UseFiles)
 {
+   int i, count, length;
+   short *head;
+
    HtmlPages = Pages;
    HtmlFiles = UseFiles;
+
+   //Hash the pages; chains are built backwards to stay in table order
+   for(count = 0; Pages[count].length != HTML_LENGTH_LIST_END; ++count)
+      ;
+   HttpNext = (short*)malloc(sizeof(short) * (count + 1));
+   for(i = 0; i < HTTP_HASH_SIZE; ++i)
+      HttpHash[i] = -1;
+   HttpPrefix = -1;
+   for(i = count - 1; HttpNext && i >= 0; --i)
+   {
+      length = (int)strlen(Pages[i].name);
+      if(length && Pages[i].name[length - 1] == ' ')
+         head = &HttpHash[HttpHashName(Pages[i].name, length - 1)];
+      else
+         head = &HttpPrefix;
+      HttpNext[i] = *head;
+      *head = (short)i;
+   }
+
    IPOpen(IP_MODE_TCP, 0, 80, HttpServer);
    IPOpen(IP_MODE_TCP, 0, 8080, HttpServer);
 }
@@ -316,6 +316,8 @@ int sprintf(char *s, const char *format,
          {
             fill = '0';
             f = *format++;
+            while('0' <= f && f <= '9')
+               f = *format++;           //precision zero fills to width
          }
          if(f == 0)
             return argc;
@@ -1163,6 +1163,101 @@ static void ConsoleUptime(IPSocket *socket, char *argv[])
 }
 
 
+#define HEAP_SITES 32
+typedef struct {
+   int count;
+   uint32 ticks;
+   struct {
+      uint32 caller, ticks;
+      int blocks, bytes;
+   } site[HEAP_SITES];
+} HeapSites_t;
+
+//Called with the heap locked so only record the block
+static void ConsoleHeapSite(void *arg, void *block, int bytes, 
+                            uint32 caller, uint32 ticks)
+{
+   HeapSites_t *sites = (HeapSites_t*)arg;
+   int i;
+   (void)block;
+
+   for(i = 0; i < sites->count; ++i)
+   {
+      if(sites->site[i].caller == caller)
+         break;
+   }
+   if(i == sites->count)
+   {
+      if(i == HEAP_SITES)
+         return;
+      ++sites->count;
+      sites->site[i].caller = caller;
+      sites->site[i].ticks = ticks;
+      sites->site[i].blocks = 0;
+      sites->site[i].bytes = 0;
+   }
+   ++sites->site[i].blocks;
+   sites->site[i].bytes += bytes;
+   if((int)(ticks - sites->site[i].ticks) < 0)
+      sites->site[i].ticks = ticks;
+}
+
+
+//heap: usage and fragmentation of each heap
+//heap sites: allocated blocks by caller (build rtos.c with HEAP_TRACK)
+static void ConsoleHeap(IPSocket *socket, char *argv[])
+{
+   OS_HeapStats_t stats;
+   OS_Heap_t *done[HEAP_COUNT];
+   const char *name[HEAP_COUNT];
+   HeapSites_t *sites;
+   int i, j;
+
+   IPPrintf(socket, "    Heap     Used     Peak     Free   Cached  Largest  Blocks FreeList Frag\n");
+   for(i = 0; i < HEAP_COUNT; ++i)
+   {
+      done[i] = NULL;
+      if(OS_HeapStats((OS_Heap_t*)i, &stats))
+         continue;
+      for(j = 0; j < i; ++j)
+      {
+         if(done[j] == stats.heap)
+            break;
+      }
+      if(j < i)
+         continue;             //Same heap registered at another index
+      done[i] = stats.heap;
+      name[i] = stats.name;
+      IPPrintf(socket, "%d %6s %8d %8d %8d %8d %8d ", i, stats.name, 
+         stats.bytesUsed, stats.bytesPeak, stats.bytesFree, 
+         stats.bytesCached, stats.largestFree);
+      IPPrintf(socket, "%7d %8d %4d\n", stats.blocksUsed, 
+         stats.freeListLength, stats.fragmentation);
+   }
+   if(argv[1] == NULL || strcmp(argv[1], "sites"))
+      return;
+
+   sites = (HeapSites_t*)malloc(sizeof(HeapSites_t));
+   if(sites == NULL)
+      return;
+   for(i = 0; i < HEAP_COUNT; ++i)
+   {
+      if(done[i] == NULL)
+         continue;
+      sites->count = 0;
+      OS_HeapWalk(done[i], ConsoleHeapSite, sites);
+      IPPrintf(socket, "%s:\n", name[i]);
+      for(j = 0; j < sites->count; ++j)
+      {
+         IPPrintf(socket, "  caller 0x%8.8x blocks %6d bytes %8d oldest %d\n",
+            sites->site[j].caller, sites->site[j].blocks, sites->site[j].bytes,
+            OS_ThreadTime() - sites->site[j].ticks);
+      }
+   }
+   free(sites);
+}
+
+
 static void ConsoleDump(IPSocket *socket, char *argv[])
 {
    FILE *fileIn;
@@ -1418,6 +1513,7 @@ static TelnetFunc_t MyFuncs[] = {
 #endif
    {"ftp", ConsoleFtp},
    {"grep", ConsoleGrep},
+   {"heap", ConsoleHeap},
    {"help", ConsoleHelp},
    {"ls", ConsoleLs},
    {"math", ConsoleMath},
@@ -97,4 +97,47 @@ int OS_MQueueGet(OS_MQueue_t *mQueue, void *message, int ticks)
 void OS_Job(JobFunc_t funcPtr, void *arg0, void *arg1, void *arg2)
 {funcPtr(arg0, arg1, arg2);}
 
+//Timer wheel as one unsorted list in slot[0][0]
+void OS_WheelInit(OS_Wheel_t *wheel, uint32 time)
+{memset(wheel, 0, sizeof(OS_Wheel_t)); wheel->time = time;}
+void OS_WheelStop(OS_Wheel_t *wheel, OS_WheelNode_t *node)
+{
+   if(node->pprev == NULL)
+      return;
+   *node->pprev = node->next;
+   if(node->next)
+      node->next->pprev = node->pprev;
+   node->pprev = NULL;
+   --wheel->count;
+}
+void OS_WheelStart(OS_Wheel_t *wheel, OS_WheelNode_t *node, 
+                   uint32 ticksTimeout, void *owner)
+{
+   OS_WheelStop(wheel, node);
+   node->ticksTimeout = ticksTimeout;
+   node->owner = owner;
+   node->next = wheel->slot[0][0];
+   if(node->next)
+      node->next->pprev = &node->next;
+   wheel->slot[0][0] = node;
+   node->pprev = &wheel->slot[0][0];
+   ++wheel->count;
+}
+void *OS_WheelExpired(OS_Wheel_t *wheel, uint32 timeNow)
+{
+   OS_WheelNode_t *node;
+   wheel->time = timeNow + 1;
+   for(node = wheel->slot[0][0]; node; node = node->next)
+   {
+      if((int)(node->ticksTimeout - timeNow) <= 0)
+      {
+         OS_WheelStop(wheel, node);
+         return node->owner;
+      }
+   }
+   return NULL;
+}
+int OS_WheelTicks(OS_Wheel_t *wheel)
+{return wheel->count ? 0 : -1;}
+
 
@@ -21,7 +21,13 @@
 #define THREAD_MAGIC 0x4321abcd
 #define SEM_RESERVED_COUNT 2
 #define INFO_COUNT 4
-#define HEAP_COUNT 8
+#define HEAP_SLAB_CLASSES 10      //Cached block sizes 16..512 bytes
+#ifdef HEAP_TRACK
+#define HEAP_CALLER() (uint32)__builtin_return_address(0)
+#else
+#define HEAP_CALLER() 0
+#endif
+#define PRIORITY_LEVELS 256
 
 #define PRINTF_DEBUG(STRING, A, B)
 //#define PRINTF_DEBUG(STRING, A, B) UartPrintfCritical(STRING, A, B)
@@ -50,6 +56,10 @@
 typedef struct HeapNode_s {
    struct HeapNode_s *next;
    int size;
+#ifdef HEAP_TRACK
+   uint32 caller;            //Return address of the OS_HeapMalloc() call
+   uint32 ticks;             //OS_ThreadTime() when allocated
+#endif
 } HeapNode_t;
 
 struct OS_Heap_s {
@@ -59,42 +69,53 @@ struct OS_Heap_s {
    HeapNode_t *available;
    HeapNode_t base;
    int count;
+   uint32 bytesUsed, bytesPeak;
+   HeapNode_t *end;
    struct OS_Heap_s *alternate;
+   HeapNode_t *slab[OS_CPU_COUNT][HEAP_SLAB_CLASSES];  //Freed small blocks
 };
 //typedef struct OS_Heap_s OS_Heap_t;
 
 typedef enum {
    THREAD_PEND    = 0,       //Thread in semaphore's linked list
-   THREAD_READY   = 1,       //Thread in ThreadHead linked list
+   THREAD_READY   = 1,       //Thread in ThreadReady[cpuIndex] linked list
    THREAD_RUNNING = 2        //Thread == ThreadCurrent[cpu]
 } OS_ThreadState_e;
 
 struct OS_Thread_s {
    const char *name;         //Name of thread
    OS_ThreadState_e state;   //Pending, ready, or running
-   int cpuIndex;             //Which CPU is running the thread
+   int cpuIndex;             //CPU running the thread or holding it ready
    int cpuLock;              //Lock the thread to a specific CPU
    jmp_buf env;              //Registers saved during context swap
    OS_FuncPtr_t funcPtr;     //First function called
    void *arg;                //Argument to first function called
    uint32 priority;          //Priority of thread (0=low, 255=high)
-   uint32 ticksTimeout;      //Tick value when semaphore pend times out
    void *info[INFO_COUNT];   //User storage
    OS_Semaphore_t *semaphorePending;  //Semaphore thread is blocked on
    int returnCode;           //Return value from semaphore pend
    uint32 processId;         //Process ID if using MMU
    OS_Heap_t *heap;          //Heap used if no heap specified
-   struct OS_Thread_s *next; //Linked list of threads by priority
+   struct OS_Thread_s *next; //Ready: circular list of same priority threads
+                             //Pending: semaphore's sorted wait list
    struct OS_Thread_s *prev;  
-   struct OS_Thread_s *nextTimeout; //Linked list of threads by timeout
-   struct OS_Thread_s *prevTimeout; 
+   OS_WheelNode_t timeoutNode;  //TimeoutWheel entry for semaphore pend
+   uint32 readyOrder;        //ThreadReadyOrder when last made ready
    uint32 magic[1];          //Bottom of stack to detect stack overflow
 };
 //typedef struct OS_Thread_s OS_Thread_t;
 
+//Threads ordered by priority then FIFO: a bitmap of the non-empty
+//priority levels plus a circular list for each level
+typedef struct {
+   uint32 group;                   //Bit set for each non-zero map[] byte
+   uint8 map[PRIORITY_LEVELS / 8]; //Bit set for each non-empty level
+   OS_Thread_t *level[PRIORITY_LEVELS];
+} OS_PriorityQueue_t;
+
 struct OS_Semaphore_s {
    const char *name;
-   struct OS_Thread_s *threadHead; //threads pending on semaphore
+   OS_Thread_t *threadHead;  //Pending threads by priority then FIFO
    int count;
 };
 //typedef struct OS_Semaphore_s OS_Semaphore_t;
@@ -116,8 +137,7 @@ struct OS_MQueue_s {
 
 struct OS_Timer_s {
    const char *name;
-   struct OS_Timer_s *next, *prev;
-   uint32 ticksTimeout;
+   OS_WheelNode_t node;
    uint32 ticksRestart;
    int active;
    OS_TimerFuncPtr_t callback;
@@ -132,8 +152,10 @@ static OS_Heap_t *HeapArray[HEAP_COUNT];
 static int InterruptInside[OS_CPU_COUNT];
 static int ThreadNeedReschedule[OS_CPU_COUNT];
 static OS_Thread_t *ThreadCurrent[OS_CPU_COUNT];  //Currently running thread(s)
-static OS_Thread_t *ThreadHead;   //Linked list of threads sorted by priority
-static OS_Thread_t *TimeoutHead;  //Linked list of threads sorted by timeout
+static OS_PriorityQueue_t ThreadReady[OS_CPU_COUNT];  //Per CPU ready threads
+static OS_PriorityQueue_t ThreadLocked[OS_CPU_COUNT]; //Threads locked to CPU
+static uint32 ThreadReadyOrder;    //Incremented as threads become ready
+static OS_Wheel_t TimeoutWheel;   //Threads with a semaphore pend timeout
 static int ThreadSwapEnabled;
 static uint32 ThreadTime;         //Number of ~10ms ticks since reboot
 static void *NeedToFree;          //Closed but not yet freed thread
@@ -142,7 +164,8 @@ static OS_Semaphore_t *SemaphoreSleep;
 static OS_Semaphore_t *SemaphoreRelease; //Protects NeedToFree
 static OS_Semaphore_t *SemaphoreLock;
 static OS_Semaphore_t *SemaphoreTimer;
-static OS_Timer_t *TimerHead;     //Linked list of timers sorted by timeout
+static OS_Wheel_t TimerWheel;     //Started timers
+static uint32 TimerWake;          //Tick OS_TimerThread will wake up
 static OS_FuncPtr_t Isr[32];      //Interrupt service routines
 #if defined(WIN32) && OS_CPU_COUNT > 1
 static unsigned int Registration[OS_CPU_COUNT];
@@ -158,6 +181,7 @@ OS_Heap_t *OS_HeapCreate(const char *name, void *memory, uint32 size)
    heap = (OS_Heap_t*)memory;
    heap->magic = HEAP_MAGIC;
    heap->name = name;
+   memset(heap->slab, 0, sizeof(heap->slab));
    heap->semaphore = OS_SemaphoreCreate(name, 1);
    heap->available = (HeapNode_t*)(heap + 1);
    heap->available->next = &heap->base;
@@ -165,6 +189,9 @@ OS_Heap_t *OS_HeapCreate(const char *name, void *memory, uint32 size)
    heap->base.next = heap->available;
    heap->base.size = 0;
    heap->count = 0;
+   heap->bytesUsed = 0;
+   heap->bytesPeak = 0;
+   heap->end = heap->available + heap->available->size;
    heap->alternate = NULL;
    return heap;
 }
@@ -177,17 +204,98 @@ void OS_HeapDestroy(OS_Heap_t *heap)
 }
 
 
+/******************************************/
+//Small blocks are rounded up to a size class: powers of two and the
+//midpoints between them, so at most a third of a block above 32 bytes
+//is wasted.  Freed blocks of a size class are kept on per CPU lists so
+//the next malloc of that size doesn't need to walk the free list.
+//Returns -1 for larger blocks, which go straight to the free list.
+static const short HeapSlabSize[HEAP_SLAB_CLASSES] = 
+   {16, 32, 48, 64, 96, 128, 192, 256, 384, 512};
+
+static int HeapSlabClass(int bytes)
+{
+   int index;
+
+   for(index = 0; index < HEAP_SLAB_CLASSES; ++index)
+   {
+      if(bytes <= HeapSlabSize[index])
+         return index;
+   }
+   return -1;
+}
+
+
+/******************************************/
+static int HeapSlabUnits(int index)
+{
+   return (HeapSlabSize[index] + sizeof(HeapNode_t) - 1) / 
+      sizeof(HeapNode_t) + 1;
+}
+
+
+/******************************************/
+static void HeapFreeNode(OS_Heap_t *heap, HeapNode_t *bp);
+
+//Return all cached blocks to the free list
+static int HeapSlabDrain(OS_Heap_t *heap)
+{
+   HeapNode_t *node, *next;
+   uint32 state;
+   int cpuIndex, index, count = 0;
+
+   for(cpuIndex = 0; cpuIndex < OS_CPU_COUNT; ++cpuIndex)
+   {
+      for(index = 0; index < HEAP_SLAB_CLASSES; ++index)
+      {
+         state = OS_CriticalBegin();
+         node = heap->slab[cpuIndex][index];
+         heap->slab[cpuIndex][index] = NULL;
+         OS_CriticalEnd(state);
+         for(; node; node = next)
+         {
+            next = node->next;
+            HeapFreeNode(heap, node);
+            ++count;
+         }
+      }
+   }
+   return count;
+}
+
+
 /******************************************/
 //Modified from Kernighan & Ritchie "The C Programming Language"
-void *OS_HeapMalloc(OS_Heap_t *heap, int bytes)
+static void *HeapMalloc(OS_Heap_t *heap, int bytes, uint32 caller)
 {
    HeapNode_t *node, *prevp;
-   int nunits;
+   int nunits, index;
+   uint32 state, cpuIndex;
 
    if(heap == NULL && OS_ThreadSelf())
       heap = OS_ThreadSelf()->heap;
    if((uint32)heap < HEAP_COUNT)
       heap = HeapArray[(int)heap];
+   index = HeapSlabClass(bytes);
+   if(index >= 0)
+   {
+      bytes = HeapSlabSize[index];
+      state = OS_CriticalBegin();
+      cpuIndex = OS_CpuIndex();
+      node = heap->slab[cpuIndex][index];
+      if(node)
+         heap->slab[cpuIndex][index] = node->next;
+      OS_CriticalEnd(state);
+      if(node)
+      {
+         node->next = (HeapNode_t*)heap;
+#ifdef HEAP_TRACK
+         node->caller = caller;
+         node->ticks = OS_ThreadTime();
+#endif
+         return (void*)(node + 1);
+      }
+   }
    nunits = (bytes + sizeof(HeapNode_t) - 1) / sizeof(HeapNode_t) + 1;
    OS_SemaphorePend(heap->semaphore, OS_WAIT_FOREVER);
    prevp = heap->available;
@@ -205,6 +313,13 @@ void *OS_HeapMalloc(OS_Heap_t *heap, int bytes)
          }
          heap->available = prevp;
          node->next = (HeapNode_t*)heap;
+#ifdef HEAP_TRACK
+         node->caller = caller;
+         node->ticks = OS_ThreadTime();
+#endif
+         heap->bytesUsed += nunits * sizeof(HeapNode_t);
+         if(heap->bytesUsed > heap->bytesPeak)
+            heap->bytesPeak = heap->bytesUsed;
          PRINTF_DEBUG("malloc(%d, %d)\n", node->size * sizeof(HeapNode_t), heap->count); 
          ++heap->count;
          OS_SemaphorePost(heap->semaphore);
@@ -214,8 +329,10 @@ void *OS_HeapMalloc(OS_Heap_t *heap, int bytes)
       if(node == heap->available)   //Wrapped around free list
       {
          OS_SemaphorePost(heap->semaphore);
+         if(HeapSlabDrain(heap))
+            return HeapMalloc(heap, bytes, caller);
          if(heap->alternate)
-            return OS_HeapMalloc(heap->alternate, bytes);
+            return HeapMalloc(heap->alternate, bytes, caller);
          printf("M%d ", heap->count);
          return NULL;
       }
@@ -224,11 +341,19 @@ void *OS_HeapMalloc(OS_Heap_t *heap, int bytes)
 
 
 /******************************************/
-//Modified from K&R
+void *OS_HeapMalloc(OS_Heap_t *heap, int bytes)
+{
+   return HeapMalloc(heap, bytes, HEAP_CALLER());
+}
+
+
+/******************************************/
 void OS_HeapFree(void *block)
 {
    OS_Heap_t *heap;
-   HeapNode_t *bp, *node;
+   HeapNode_t *bp;
+   int index;
+   uint32 state, cpuIndex;
 
    //UartPrintfCritical("OS_HeapFree(0x%x)\n", block);
    if(block == NULL)
@@ -238,8 +363,29 @@ void OS_HeapFree(void *block)
    assert(heap->magic == HEAP_MAGIC);
    if(heap->magic != HEAP_MAGIC)
       return;
+   index = HeapSlabClass((bp->size - 1) * sizeof(HeapNode_t));
+   if(index >= 0 && bp->size == HeapSlabUnits(index))
+   {
+      state = OS_CriticalBegin();
+      cpuIndex = OS_CpuIndex();
+      bp->next = heap->slab[cpuIndex][index];
+      heap->slab[cpuIndex][index] = bp;
+      OS_CriticalEnd(state);
+      return;
+   }
+   HeapFreeNode(heap, bp);
+}
+
+
+/******************************************/
+//Modified from K&R
+static void HeapFreeNode(OS_Heap_t *heap, HeapNode_t *bp)
+{
+   HeapNode_t *node;
+
    OS_SemaphorePend(heap->semaphore, OS_WAIT_FOREVER);
    --heap->count;
+   heap->bytesUsed -= bp->size * sizeof(HeapNode_t);
    PRINTF_DEBUG("free(%d, %d)\n", bp->size * sizeof(HeapNode_t), heap->count); 
    for(node = heap->available; !(node < bp && bp < node->next); node = node->next)
    {
@@ -284,123 +430,269 @@ void OS_HeapRegister(void *index, OS_Heap_t *heap)
 }
 
 
+/******************************************/
+//Returns -1 if there isn't a heap registered at that index
+int OS_HeapStats(OS_Heap_t *heap, OS_HeapStats_t *stats)
+{
+   HeapNode_t *node;
+   uint32 state;
+   int cpuIndex, index;
+
+   if((uint32)heap < HEAP_COUNT)
+      heap = HeapArray[(int)heap];
+   memset(stats, 0, sizeof(OS_HeapStats_t));
+   if(heap == NULL)
+      return -1;
+   stats->heap = heap;
+   stats->name = heap->name;
+   OS_SemaphorePend(heap->semaphore, OS_WAIT_FOREVER);
+   stats->bytesUsed = heap->bytesUsed;
+   stats->bytesPeak = heap->bytesPeak;
+   stats->blocksUsed = heap->count;
+   for(node = heap->base.next; node != &heap->base; node = node->next)
+   {
+      stats->bytesFree += node->size * sizeof(HeapNode_t);
+      if(node->size * sizeof(HeapNode_t) > stats->largestFree)
+         stats->largestFree = node->size * sizeof(HeapNode_t);
+      ++stats->freeListLength;
+   }
+   for(cpuIndex = 0; cpuIndex < OS_CPU_COUNT; ++cpuIndex)
+   {
+      for(index = 0; index < HEAP_SLAB_CLASSES; ++index)
+      {
+         state = OS_CriticalBegin();
+         for(node = heap->slab[cpuIndex][index]; node; node = node->next)
+         {
+            stats->bytesCached += node->size * sizeof(HeapNode_t);
+            --stats->blocksUsed;
+         }
+         OS_CriticalEnd(state);
+      }
+   }
+   OS_SemaphorePost(heap->semaphore);
+   stats->bytesUsed -= stats->bytesCached;
+   if(stats->bytesFree)
+      stats->fragmentation = 100 - (int)(stats->largestFree * 100 / stats->bytesFree);
+   return 0;
+}
+
 
-/***************** Thread *****************/
 /******************************************/
-//Linked list of threads sorted by priority
-//The linked list is either ThreadHead (ready to run threads not including
-//the currently running thread) or a list of threads waiting on a semaphore.
-//Must be called with interrupts disabled
-static void OS_ThreadPriorityInsert(OS_Thread_t **head, OS_Thread_t *thread)
+//Calls func for every allocated block with the heap locked
+//func must not call malloc() or free() on the same heap
+void OS_HeapWalk(OS_Heap_t *heap, OS_HeapWalkFunc_t func, void *arg)
 {
-   OS_Thread_t *node, *prev;
+   HeapNode_t *node;
+   uint32 caller = 0, ticks = 0;
 
-   prev = NULL;
-   for(node = *head; node; node = node->next)
+   if((uint32)heap < HEAP_COUNT)
+      heap = HeapArray[(int)heap];
+   if(heap == NULL)
+      return;
+   OS_SemaphorePend(heap->semaphore, OS_WAIT_FOREVER);
+   for(node = (HeapNode_t*)(heap + 1); node < heap->end; node += node->size)
    {
-      if(node->priority < thread->priority)
-         break;
-      prev = node;
+      //Free and cached blocks don't point back to the heap
+      if(node->next != (HeapNode_t*)heap)
+         continue;
+#ifdef HEAP_TRACK
+      caller = node->caller;
+      ticks = node->ticks;
+#endif
+      func(arg, node + 1, (node->size - 1) * sizeof(HeapNode_t), caller, ticks);
    }
+   OS_SemaphorePost(heap->semaphore);
+}
+
+
+
+/***************** Thread *****************/
+/******************************************/
+//Index of the highest set bit of a byte
+static const uint8 HighestBit[256] = {
+   0,0,1,1,2,2,2,2,3,3,3,3,3,3,3,3,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,
+   5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,
+   6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
+   6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
+   7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+   7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+   7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+   7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7
+};
+
+
+/******************************************/
+//Threads sorted by priority in constant time
+//The queue is either a ThreadReady[] or ThreadLocked[] queue (ready to run
+//threads not including the currently running threads).
+//Threads of equal priority are kept in FIFO order.
+//Must be called with interrupts disabled
+static void OS_ThreadPriorityInsert(OS_PriorityQueue_t *queue, OS_Thread_t *thread)
+{
+   uint32 priority = thread->priority;
+   OS_Thread_t *head = queue->level[priority];
 
-   if(prev == NULL)
+   if(head == NULL)
    {
-      thread->next = *head;
-      thread->prev = NULL;
-      if(*head)
-         (*head)->prev = thread;
-      *head = thread;
+      thread->next = thread;
+      thread->prev = thread;
+      queue->level[priority] = thread;
+      queue->map[priority >> 3] |= 1 << (priority & 7);
+      queue->group |= 1 << (priority >> 3);
    }
    else
    {
-      if(prev->next)
-         prev->next->prev = thread;
-      thread->next = prev->next;
-      thread->prev = prev;
-      prev->next = thread;
+      thread->next = head;            //Add to the tail of the level
+      thread->prev = head->prev;
+      head->prev->next = thread;
+      head->prev = thread;
    }
-   assert(ThreadHead);
    thread->state = THREAD_READY;
+   thread->readyOrder = ++ThreadReadyOrder;
 }
 
 
 /******************************************/
 //Must be called with interrupts disabled
-static void OS_ThreadPriorityRemove(OS_Thread_t **head, OS_Thread_t *thread)
+static void OS_ThreadPriorityRemove(OS_PriorityQueue_t *queue, OS_Thread_t *thread)
 {
+   uint32 priority = thread->priority;
+
    assert(thread->magic[0] == THREAD_MAGIC);  //check stack overflow
-   if(thread->prev == NULL)
-      *head = thread->next;
+   if(thread->next == thread)
+   {
+      queue->level[priority] = NULL;
+      queue->map[priority >> 3] &= ~(1 << (priority & 7));
+      if(queue->map[priority >> 3] == 0)
+         queue->group &= ~(1 << (priority >> 3));
+   }
    else
+   {
       thread->prev->next = thread->next;
-   if(thread->next)
       thread->next->prev = thread->prev;
+      if(queue->level[priority] == thread)
+         queue->level[priority] = thread->next;
+   }
    thread->next = NULL;
    thread->prev = NULL;
 }
 
 
 /******************************************/
-//Linked list of threads sorted by timeout value
+//Return the oldest thread with the highest priority
 //Must be called with interrupts disabled
-static void OS_ThreadTimeoutInsert(OS_Thread_t *thread)
+static OS_Thread_t *OS_ThreadPriorityHead(OS_PriorityQueue_t *queue)
 {
-   OS_Thread_t *node, *prev;
-   int diff;
+   uint32 group = queue->group;
+   int index;
+
+   if(group == 0)
+      return NULL;
+   if(group >> 16)
+      index = (group >> 24) ? 24 + HighestBit[group >> 24] :
+                              16 + HighestBit[group >> 16];
+   else
+      index = (group >> 8) ? 8 + HighestBit[group >> 8] :
+                             HighestBit[group];
+   return queue->level[(index << 3) + HighestBit[queue->map[index]]];
+}
+
 
-   prev = NULL;
-   for(node = TimeoutHead; node; node = node->nextTimeout)
+/******************************************/
+//Return true if thread should run before threadNext: higher priority or
+//equal priority and made ready earlier (FIFO across both ready queues)
+static int OS_ThreadBefore(OS_Thread_t *thread, OS_Thread_t *threadNext)
+{
+   if(threadNext == NULL || thread->priority > threadNext->priority)
+      return 1;
+   return thread->priority == threadNext->priority &&
+          (int)(thread->readyOrder - threadNext->readyOrder) < 0;
+}
+
+
+/******************************************/
+//A semaphore only has a few waiting threads so a short list sorted by
+//priority is used instead of a priority queue.
+//Threads of equal priority are kept in FIFO order.
+//Must be called with interrupts disabled
+static void OS_SemaphoreWaitInsert(OS_Semaphore_t *semaphore, OS_Thread_t *thread)
+{
+   OS_Thread_t *node, *prev = NULL;
+
+   for(node = semaphore->threadHead; node; node = node->next)
    {
-      diff = thread->ticksTimeout - node->ticksTimeout;
-      if(diff <= 0)
+      if(node->priority < thread->priority)
          break;
       prev = node;
    }
+   thread->next = node;
+   thread->prev = prev;
+   if(node)
+      node->prev = thread;
+   if(prev)
+      prev->next = thread;
+   else
+      semaphore->threadHead = thread;
+   thread->state = THREAD_PEND;
+}
 
-   if(prev == NULL)
+
+/******************************************/
+//Must be called with interrupts disabled
+static void OS_SemaphoreWaitRemove(OS_Semaphore_t *semaphore, OS_Thread_t *thread)
+{
+   if(thread->prev)
+      thread->prev->next = thread->next;
+   else
+      semaphore->threadHead = thread->next;
+   if(thread->next)
+      thread->next->prev = thread->prev;
+   thread->next = NULL;
+   thread->prev = NULL;
+}
+
+
+/******************************************/
+//Each CPU has its own ready queues so the scheduler doesn't look at every
+//thread in the system.  A thread locked to a CPU always goes on that CPU's
+//ThreadLocked queue; otherwise it returns to the CPU it last ran on.
+//Must be called with interrupts disabled
+static void OS_ThreadReadyInsert(OS_Thread_t *thread)
+{
+   if(thread->cpuLock >= 0)
    {
-      thread->nextTimeout = TimeoutHead;
-      thread->prevTimeout = NULL;
-      if(TimeoutHead)
-         TimeoutHead->prevTimeout = thread;
-      TimeoutHead = thread;
+      thread->cpuIndex = thread->cpuLock;
+      OS_ThreadPriorityInsert(&ThreadLocked[thread->cpuIndex], thread);
    }
    else
    {
-      if(prev->nextTimeout)
-         prev->nextTimeout->prevTimeout = thread;
-      thread->nextTimeout = prev->nextTimeout;
-      thread->prevTimeout = prev;
-      prev->nextTimeout = thread;
+      OS_ThreadPriorityInsert(&ThreadReady[thread->cpuIndex], thread);
    }
 }
 
 
 /******************************************/
 //Must be called with interrupts disabled
-static void OS_ThreadTimeoutRemove(OS_Thread_t *thread)
+static void OS_ThreadReadyRemove(OS_Thread_t *thread)
 {
-   if(thread->prevTimeout == NULL && TimeoutHead != thread)
-      return;         //not in list
-   if(thread->prevTimeout == NULL)
-      TimeoutHead = thread->nextTimeout;
+   if(thread->cpuLock >= 0)
+      OS_ThreadPriorityRemove(&ThreadLocked[thread->cpuIndex], thread);
    else
-      thread->prevTimeout->nextTimeout = thread->nextTimeout;
-   if(thread->nextTimeout)
-      thread->nextTimeout->prevTimeout = thread->prevTimeout;
-   thread->nextTimeout = NULL;
-   thread->prevTimeout = NULL;
+      OS_ThreadPriorityRemove(&ThreadReady[thread->cpuIndex], thread);
 }
 
 
 /******************************************/
-//Loads highest priority thread from the ThreadHead linked list
-//The currently running thread isn't in the ThreadHead list
+//Loads highest priority thread from the ready queues
+//The currently running thread isn't in a ready queue
 //Must be called with interrupts disabled
 static void OS_ThreadReschedule(int roundRobin)
 {
-   OS_Thread_t *threadNext, *threadCurrent;
+   OS_Thread_t *threadNext, *threadCurrent, *node;
    int rc, cpuIndex = OS_CpuIndex();
+#if OS_CPU_COUNT > 1
+   int i;
+#endif
 
    if(ThreadSwapEnabled == 0 || InterruptInside[cpuIndex])
    {
@@ -410,10 +702,19 @@ static void OS_ThreadReschedule(int roundRobin)
    ThreadNeedReschedule[cpuIndex] = 0;
 
    //Determine which thread should run
-   threadNext = ThreadHead;
-   while(threadNext && threadNext->cpuLock != -1 && 
-         threadNext->cpuLock != cpuIndex)
-      threadNext = threadNext->next;         //Skip CPU locked threads
+   threadNext = OS_ThreadPriorityHead(&ThreadReady[cpuIndex]);
+   node = OS_ThreadPriorityHead(&ThreadLocked[cpuIndex]);
+   if(node && OS_ThreadBefore(node, threadNext))
+      threadNext = node;
+#if OS_CPU_COUNT > 1
+   //Steal a higher priority thread waiting on another CPU
+   for(i = 1; i < OS_CPU_COUNT; ++i)
+   {
+      node = OS_ThreadPriorityHead(&ThreadReady[(cpuIndex + i) % OS_CPU_COUNT]);
+      if(node && (threadNext == NULL || threadNext->priority < node->priority))
+         threadNext = node;
+   }
+#endif
    if(threadNext == NULL)
       return;
    threadCurrent = ThreadCurrent[cpuIndex];
@@ -429,7 +730,7 @@ static void OS_ThreadReschedule(int roundRobin)
       {
          assert(threadCurrent->magic[0] == THREAD_MAGIC); //check stack overflow
          if(threadCurrent->state == THREAD_RUNNING)
-            OS_ThreadPriorityInsert(&ThreadHead, threadCurrent);
+            OS_ThreadReadyInsert(threadCurrent);
          //PRINTF_DEBUG("Pause(%d,%s) ", OS_CpuIndex(), threadCurrent->name);
          rc = setjmp(threadCurrent->env);  //ANSI C call to save registers
          if(rc)
@@ -440,10 +741,10 @@ static void OS_ThreadReschedule(int roundRobin)
          }
       }
 
-      //Remove the new running thread from the ThreadHead linked list
+      //Remove the new running thread from its ready queue
       threadNext = ThreadCurrent[OS_CpuIndex()]; //removed warning
       assert(threadNext->state == THREAD_READY);
-      OS_ThreadPriorityRemove(&ThreadHead, threadNext); 
+      OS_ThreadReadyRemove(threadNext); 
       threadNext->state = THREAD_RUNNING;               
       threadNext->cpuIndex = OS_CpuIndex();
 #if defined(WIN32) && OS_CPU_COUNT > 1
@@ -458,7 +759,20 @@ static void OS_ThreadReschedule(int roundRobin)
 /******************************************/
 void OS_ThreadCpuLock(OS_Thread_t *thread, int cpuIndex)
 {
-   thread->cpuLock = cpuIndex;
+   uint32 state;
+
+   state = OS_CriticalBegin();
+   if(thread->state == THREAD_READY)
+   {
+      OS_ThreadReadyRemove(thread);
+      thread->cpuLock = cpuIndex;
+      OS_ThreadReadyInsert(thread);
+   }
+   else
+   {
+      thread->cpuLock = cpuIndex;
+   }
+   OS_CriticalEnd(state);
    if(thread == OS_ThreadSelf() && cpuIndex != (int)OS_CpuIndex())
       OS_ThreadSleep(1);
 }
@@ -521,9 +835,10 @@ OS_Thread_t *OS_ThreadCreate(const char *name,
    thread->name = name;
    thread->state = THREAD_READY;
    thread->cpuLock = -1;
+   thread->cpuIndex = OS_CpuIndex();
    thread->funcPtr = funcPtr;
    thread->arg = arg;
-   thread->priority = priority;
+   thread->priority = priority < PRIORITY_LEVELS ? priority : PRIORITY_LEVELS - 1;
    thread->semaphorePending = NULL;
    thread->returnCode = 0;
    if(OS_ThreadSelf())
@@ -538,8 +853,6 @@ OS_Thread_t *OS_ThreadCreate(const char *name,
    }
    thread->next = NULL;
    thread->prev = NULL;
-   thread->nextTimeout = NULL;
-   thread->prevTimeout = NULL;
    thread->magic[0] = THREAD_MAGIC;
 
    OS_ThreadRegsInit(thread->env);
@@ -555,7 +868,7 @@ OS_Thread_t *OS_ThreadCreate(const char *name,
 
    //Add thread to linked list of ready to run threads
    state = OS_CriticalBegin();
-   OS_ThreadPriorityInsert(&ThreadHead, thread);
+   OS_ThreadReadyInsert(thread);
    OS_ThreadReschedule(0);                   //run highest priority thread
    OS_CriticalEnd(state);
    return thread;
@@ -643,14 +956,27 @@ uint32 OS_ThreadPriorityGet(OS_Thread_t *thread)
 void OS_ThreadPrioritySet(OS_Thread_t *thread, uint32 priority)
 {
    uint32 state;
+   if(priority >= PRIORITY_LEVELS)
+      priority = PRIORITY_LEVELS - 1;
    state = OS_CriticalBegin();
-   thread->priority = priority;
    if(thread->state == THREAD_READY)
    {
-      OS_ThreadPriorityRemove(&ThreadHead, thread);
-      OS_ThreadPriorityInsert(&ThreadHead, thread);
+      OS_ThreadReadyRemove(thread);
+      thread->priority = priority;
+      OS_ThreadReadyInsert(thread);
       OS_ThreadReschedule(0);
    }
+   else if(thread->state == THREAD_PEND && thread->semaphorePending)
+   {
+      //Requeue a blocked thread at its new priority
+      OS_SemaphoreWaitRemove(thread->semaphorePending, thread);
+      thread->priority = priority;
+      OS_SemaphoreWaitInsert(thread->semaphorePending, thread);
+   }
+   else
+   {
+      thread->priority = priority;
+   }
    OS_CriticalEnd(state);
 }
 
@@ -670,31 +996,119 @@ static void OS_ThreadTick(void *Arg)
 {
    OS_Thread_t *thread;
    OS_Semaphore_t *semaphore;
-   int diff;
    (void)Arg;
 
    ++ThreadTime;         //Number of ~10 msec ticks since reboot
-   while(TimeoutHead)
+   for(;;)
    {
-      thread = TimeoutHead;
-      diff = ThreadTime - thread->ticksTimeout;
-      if(diff < 0)
+      thread = (OS_Thread_t*)OS_WheelExpired(&TimeoutWheel, ThreadTime);
+      if(thread == NULL)
          break;
 
       //The thread has timed out waiting for a semaphore
-      OS_ThreadTimeoutRemove(thread);
       semaphore = thread->semaphorePending;
       ++semaphore->count;
       thread->semaphorePending = NULL;
       thread->returnCode = -1;
-      OS_ThreadPriorityRemove(&semaphore->threadHead, thread);
-      OS_ThreadPriorityInsert(&ThreadHead, thread);
+      OS_SemaphoreWaitRemove(semaphore, thread);
+      OS_ThreadReadyInsert(thread);
    }
    OS_ThreadReschedule(1);    //Run highest priority thread
 }
 
 
 
+/***************** Tickless ***************/
+/******************************************/
+//While every CPU is idle the tick interrupt is stopped until the next
+//semaphore timeout.  The counter has no compare register so on hardware
+//the tick interrupt is masked and ThreadTime is caught up from
+//COUNTER_REG when the idle thread sees the timeout is due or any
+//other interrupt arrives.
+#ifndef DISABLE_TICKLESS
+#define TICKLESS_MAX 1000         //Longest tickless period (~10 seconds)
+static void OS_IdleThread(void *arg);
+static int TicklessActive;        //Tick interrupt masked
+static uint32 TicklessCount;      //COUNTER_REG when the tick was masked
+static int TicklessTicks;         //Ticks until the next timeout
+
+
+/******************************************/
+//Returns the number of ticks until OS_ThreadTick() has work to do
+//or 0 if any CPU is running a thread other than an idle thread
+//Must be called with interrupts disabled
+static int OS_TicklessTicks(void)
+{
+   int i, ticks;
+
+   for(i = 0; i < OS_CPU_COUNT; ++i)
+   {
+      if(ThreadCurrent[i] == NULL || ThreadCurrent[i]->funcPtr != OS_IdleThread)
+         return 0;
+   }
+   ticks = OS_WheelTicks(&TimeoutWheel);
+   if(ticks < 0)
+      return TICKLESS_MAX;
+   ticks = (int)(TimeoutWheel.time + ticks - ThreadTime);
+   if(ticks < 0)
+      return 0;
+   return ticks < TICKLESS_MAX ? ticks : TICKLESS_MAX;
+}
+
+
+/******************************************/
+//Plasma hardware dependent
+//Returns the ticks counted by COUNTER_REG since OS_TicklessSuspend().
+//The tick count is only 14 bits wide so the difference is masked to
+//survive a counter wrap; TICKLESS_MAX is well below 2^14.
+static int OS_TicklessElapsed(uint32 count)
+{
+   return (int)(((count >> 18) - (TicklessCount >> 18)) & 0x3fff);
+}
+
+
+/******************************************/
+//Plasma hardware dependent
+//Must be called with interrupts disabled
+static void OS_TicklessSuspend(int ticks)
+{
+   TicklessActive = 1;
+   TicklessTicks = ticks;
+   TicklessCount = MemoryRead(COUNTER_REG);
+   MemoryWrite(IRQ_MASK, MemoryRead(IRQ_MASK) & 
+               ~(IRQ_COUNTER18 | IRQ_COUNTER18_NOT));
+}
+
+
+/******************************************/
+//Plasma hardware dependent
+//Restart the tick interrupt and count the ticks missed while stopped
+//Must be called with interrupts disabled
+static void OS_TicklessResume(void)
+{
+   uint32 count, mask;
+   int ticks;
+
+   if(TicklessActive == 0)
+      return;
+   TicklessActive = 0;
+   count = MemoryRead(COUNTER_REG);
+   mask = MemoryRead(IRQ_MASK);
+   if(count & (1 << 18))
+      mask |= IRQ_COUNTER18_NOT;
+   else
+      mask |= IRQ_COUNTER18;
+   MemoryWrite(IRQ_MASK, mask);
+   ticks = OS_TicklessElapsed(count);
+   if(ticks)
+   {
+      ThreadTime += ticks - 1;
+      OS_ThreadTick(NULL);
+   }
+}
+#endif
+
+
 /***************** Semaphore **************/
 /******************************************/
 //Create a counting semaphore
@@ -711,8 +1125,8 @@ OS_Semaphore_t *OS_SemaphoreCreate(const char *name, uint32 count)
    if(semaphore == NULL)
       return NULL;
 
+   memset(semaphore, 0, sizeof(OS_Semaphore_t));
    semaphore->name = name;
-   semaphore->threadHead = NULL;
    semaphore->count = count;
    return semaphore;
 }
@@ -754,15 +1168,19 @@ int OS_SemaphorePend(OS_Semaphore_t *semaphore, int ticks)
       thread = ThreadCurrent[cpuIndex];
       assert(thread);
       thread->semaphorePending = semaphore;
-      thread->ticksTimeout = ticks + OS_ThreadTime();
-
-      //FYI: The current thread isn't in the ThreadHead linked list
-      //Place the thread into a sorted linked list of pending threads
-      OS_ThreadPriorityInsert(&semaphore->threadHead, thread);
-      thread->state = THREAD_PEND;
-      if(ticks != OS_WAIT_FOREVER)
-         OS_ThreadTimeoutInsert(thread); //Check every ~10ms for timeouts
-      assert(ThreadHead);
+
+      //FYI: The current thread isn't in a ThreadReady linked list
+      //Place the thread into the sorted list of pending threads
+      OS_SemaphoreWaitInsert(semaphore, thread);
+      if(ticks != OS_WAIT_FOREVER)       //Check every ~10ms for timeouts
+      {
+         OS_WheelStart(&TimeoutWheel, &thread->timeoutNode, 
+                       ticks + OS_ThreadTime(), thread);
+#ifndef DISABLE_TICKLESS
+         if(TicklessActive)
+            TicklessTicks = 0;          //Idle CPU recounts with this timeout
+#endif
+      }
       OS_ThreadReschedule(0);           //Run highest priority thread
       returnCode = thread->returnCode;  //Will be -1 if timed out
    }
@@ -785,9 +1203,9 @@ void OS_SemaphorePost(OS_Semaphore_t *semaphore)
    {
       //Wake up a thread that was waiting for this semaphore
       thread = semaphore->threadHead;
-      OS_ThreadTimeoutRemove(thread);
-      OS_ThreadPriorityRemove(&semaphore->threadHead, thread);
-      OS_ThreadPriorityInsert(&ThreadHead, thread);
+      OS_WheelStop(&TimeoutWheel, &thread->timeoutNode);
+      OS_SemaphoreWaitRemove(semaphore, thread);
+      OS_ThreadReadyInsert(thread);
       thread->semaphorePending = NULL;
       thread->returnCode = 0;
       OS_ThreadReschedule(0);
@@ -1012,26 +1430,205 @@ void OS_Job(JobFunc_t funcPtr, void *arg0, void *arg1, void *arg2)
 }
 
 
+/***************** Timer wheel ************/
+/******************************************/
+//Timers are kept in OS_WHEEL_LEVELS wheels of OS_WHEEL_SIZE slots.
+//Level N slots cover OS_WHEEL_SIZE^N ticks each; when a lower level wraps
+//the next slot of the level above is cascaded down.  Timeouts beyond the
+//top level are parked in it and re-inserted until they are due.
+void OS_WheelInit(OS_Wheel_t *wheel, uint32 time)
+{
+   memset(wheel, 0, sizeof(OS_Wheel_t));
+   wheel->time = time;
+}
+
+
+/******************************************/
+static void OS_WheelLink(OS_WheelNode_t **head, OS_WheelNode_t *node)
+{
+   node->next = *head;
+   if(*head)
+      (*head)->pprev = &node->next;
+   *head = node;
+   node->pprev = head;
+}
+
+
+/******************************************/
+static void OS_WheelUnlink(OS_WheelNode_t *node)
+{
+   *node->pprev = node->next;
+   if(node->next)
+      node->next->pprev = node->pprev;
+   node->next = NULL;
+   node->pprev = NULL;
+}
+
+
+/******************************************/
+static void OS_WheelInsert(OS_Wheel_t *wheel, OS_WheelNode_t *node)
+{
+   uint32 diff = node->ticksTimeout - wheel->time;
+   int level = 0;
+
+   if((int)diff < 0)
+      diff = 0;                          //Late: handle on the next tick
+   while(level < OS_WHEEL_LEVELS - 1 && 
+         diff >= (uint32)1 << (OS_WHEEL_BITS * (level + 1)))
+      ++level;
+   if(level == OS_WHEEL_LEVELS - 1 && 
+      diff >> (OS_WHEEL_BITS * OS_WHEEL_LEVELS))
+      diff = ((uint32)1 << (OS_WHEEL_BITS * OS_WHEEL_LEVELS)) - 1;
+   diff = (wheel->time + diff) >> (OS_WHEEL_BITS * level);
+   OS_WheelLink(&wheel->slot[level][diff & (OS_WHEEL_SIZE - 1)], node);
+}
+
+
+/******************************************/
+void OS_WheelStart(OS_Wheel_t *wheel, OS_WheelNode_t *node, 
+                   uint32 ticksTimeout, void *owner)
+{
+   if(node->pprev)
+      OS_WheelStop(wheel, node);
+   node->ticksTimeout = ticksTimeout;
+   node->owner = owner;
+   OS_WheelInsert(wheel, node);
+   ++wheel->count;
+}
+
+
+/******************************************/
+void OS_WheelStop(OS_Wheel_t *wheel, OS_WheelNode_t *node)
+{
+   if(node->pprev == NULL)
+      return;                            //Not started
+   OS_WheelUnlink(node);
+   --wheel->count;
+}
+
+
+/******************************************/
+//Advance the wheel to timeNow and return the owner of a timed out node
+//or NULL.  Call until NULL is returned.
+void *OS_WheelExpired(OS_Wheel_t *wheel, uint32 timeNow)
+{
+   OS_WheelNode_t *node, *list;
+   uint32 time, ticks;
+   int level;
+
+   if(wheel->count == 0)
+      wheel->time = timeNow + 1;         //Nothing to cascade
+   while((int)(timeNow - wheel->time) >= 0)
+   {
+      time = wheel->time;
+      if(timeNow - time > OS_WHEEL_SIZE && wheel->expired == NULL)
+      {
+         //Catching up after a long gap: skip the ticks without work
+         ticks = (uint32)OS_WheelTicks(wheel);
+         if(ticks)
+         {
+            if(ticks > timeNow - time)
+               ticks = timeNow - time + 1;
+            wheel->time = time + ticks;
+            continue;
+         }
+      }
+      //Cascade the next slot of each level above a wrapped level
+      for(level = 1; level < OS_WHEEL_LEVELS; ++level)
+      {
+         if(time & (((uint32)1 << (OS_WHEEL_BITS * level)) - 1))
+            break;
+         list = wheel->slot[level][(time >> (OS_WHEEL_BITS * level)) & 
+                                   (OS_WHEEL_SIZE - 1)];
+         while(list)
+         {
+            node = list;
+            list = node->next;
+            OS_WheelUnlink(node);
+            OS_WheelInsert(wheel, node);
+         }
+      }
+      list = wheel->slot[0][time & (OS_WHEEL_SIZE - 1)];
+      while(list)
+      {
+         node = list;
+         list = node->next;
+         OS_WheelUnlink(node);
+         if((int)(node->ticksTimeout - time) > 0)
+            OS_WheelInsert(wheel, node);    //Parked beyond the top level
+         else
+            OS_WheelLink(&wheel->expired, node);
+      }
+      wheel->time = time + 1;
+   }
+   node = wheel->expired;
+   if(node == NULL)
+      return NULL;
+   OS_WheelUnlink(node);
+   --wheel->count;
+   return node->owner;
+}
+
+
+/******************************************/
+//Return the number of ticks after wheel->time until OS_WheelExpired() has
+//work to do (a timeout or a non-empty cascade) or -1 if no nodes are started
+int OS_WheelTicks(OS_Wheel_t *wheel)
+{
+   uint32 span, time, best;
+   int level, i;
+
+   if(wheel->count == 0)
+      return -1;
+   if(wheel->expired)
+      return 0;
+   best = 0xffffffff;
+   for(level = 0; level < OS_WHEEL_LEVELS; ++level)
+   {
+      //Slots of this level in the order they are reached
+      span = (uint32)1 << (OS_WHEEL_BITS * level);
+      time = (wheel->time + span - 1) & ~(span - 1);
+      for(i = 0; i < OS_WHEEL_SIZE && time - wheel->time < best; ++i)
+      {
+         if(wheel->slot[level][(time >> (OS_WHEEL_BITS * level)) & 
+                               (OS_WHEEL_SIZE - 1)])
+         {
+            best = time - wheel->time;
+            break;
+         }
+         time += span;
+      }
+   }
+   return best < 0x7fffffff ? (int)best : 0x7fffffff;
+}
+
+
 /***************** Timer ******************/
 /******************************************/
 //This thread polls the list of timers to see if any have timed out
 static void OS_TimerThread(void *arg)
 {
    uint32 timeNow;
-   int diff, ticks;
+   int ticks;
    uint32 message[8];
    OS_Timer_t *timer;
    (void)arg;
 
-   timeNow = OS_ThreadTime();  //Number of ~10 msec ticks since reboot
    for(;;)
    {
       //Determine how long to sleep
       OS_SemaphorePend(SemaphoreLock, OS_WAIT_FOREVER);
-      if(TimerHead)
-         ticks = TimerHead->ticksTimeout - timeNow;
+      timeNow = OS_ThreadTime();
+      ticks = OS_WheelTicks(&TimerWheel);
+      if(ticks >= 0)
+      {
+         TimerWake = TimerWheel.time + ticks;
+         ticks = TimerWake - timeNow;
+         if(ticks < 0)
+            ticks = 0;
+      }
       else
-         ticks = OS_WAIT_FOREVER;
+         TimerWake = timeNow + 0x7fffffff;
       OS_SemaphorePost(SemaphoreLock);
       OS_SemaphorePend(SemaphoreTimer, ticks);
 
@@ -1039,21 +1636,15 @@ static void OS_TimerThread(void *arg)
       timeNow = OS_ThreadTime();
       for(;;)
       {
-         timer = NULL;
          OS_SemaphorePend(SemaphoreLock, OS_WAIT_FOREVER);
-         if(TimerHead)
-         {
-            diff = timeNow - TimerHead->ticksTimeout;
-            if(diff >= 0)
-               timer = TimerHead;
-         }
+         timer = (OS_Timer_t*)OS_WheelExpired(&TimerWheel, timeNow);
+         if(timer)
+            timer->active = 0;
          OS_SemaphorePost(SemaphoreLock);
          if(timer == NULL)
             break;
          if(timer->ticksRestart)
             OS_TimerStart(timer, timer->ticksRestart, timer->ticksRestart);
-         else
-            OS_TimerStop(timer);
 
          if(timer->callback)
             timer->callback(timer, timer->info);
@@ -1090,8 +1681,7 @@ OS_Timer_t *OS_TimerCreate(const char *name, OS_MQueue_t *mQueue, uint32 info)
    timer->name = name;
    timer->callback = NULL;
    timer->mqueue = mQueue;
-   timer->next = NULL;
-   timer->prev = NULL;
+   memset(&timer->node, 0, sizeof(timer->node));
    timer->info = info;
    timer->active = 0;
    return timer;
@@ -1118,43 +1708,20 @@ void OS_TimerCallback(OS_Timer_t *timer, OS_TimerFuncPtr_t callback)
 //In ~10 msec ticks send a message (or callback)
 void OS_TimerStart(OS_Timer_t *timer, uint32 ticks, uint32 ticksRestart)
 {
-   OS_Timer_t *node, *prev;
-   int diff, check=0;
+   int check;
 
    assert(timer);
    assert(InterruptInside[OS_CpuIndex()] == 0);
    ticks += OS_ThreadTime();
-   if(timer->active)
-      OS_TimerStop(timer);
    OS_SemaphorePend(SemaphoreLock, OS_WAIT_FOREVER);
-   if(timer->active)
-   {
-      //Prevent race condition
-      OS_SemaphorePost(SemaphoreLock);
-      return;
-   }
-   timer->ticksTimeout = ticks;
+   if(TimerWheel.count == 0)
+      TimerWheel.time = OS_ThreadTime();   //Wheel idle while no timers
    timer->ticksRestart = ticksRestart;
    timer->active = 1;
-   prev = NULL;
-   for(node = TimerHead; node; node = node->next)
-   {
-      diff = ticks - node->ticksTimeout;
-      if(diff <= 0)
-         break;
-      prev = node;
-   }
-   timer->next = node;
-   timer->prev = prev;
-   if(node)
-      node->prev = timer;
-   if(prev == NULL)
-   {
-      TimerHead = timer;
-      check = 1;
-   }
-   else
-      prev->next = timer;
+   OS_WheelStart(&TimerWheel, &timer->node, ticks, timer);
+   check = (int)(ticks - TimerWake) < 0;
+   if(check)
+      TimerWake = ticks;
    OS_SemaphorePost(SemaphoreLock);
    if(check)
       OS_SemaphorePost(SemaphoreTimer);  //Wakeup OS_TimerThread
@@ -1171,12 +1738,7 @@ void OS_TimerStop(OS_Timer_t *timer)
    if(timer->active)
    {
       timer->active = 0;
-      if(timer->prev == NULL)
-         TimerHead = timer->next;
-      else
-         timer->prev->next = timer->next;
-      if(timer->next)
-         timer->next->prev = timer->prev;
+      OS_WheelStop(&TimerWheel, &timer->node);
    }
    OS_SemaphorePost(SemaphoreLock);
 }
@@ -1193,6 +1755,14 @@ void OS_InterruptServiceRoutine(uint32 status, uint32 *stack)
       Isr[31](stack);                   //SYSCALL or BREAK
 
    InterruptInside[cpuIndex] = 1;
+#ifndef DISABLE_TICKLESS
+   if(TicklessActive)
+   {
+      state = OS_SpinLock();
+      OS_TicklessResume();
+      OS_SpinUnlock(state);
+   }
+#endif
    i = 0;
    do
    {   
@@ -1269,17 +1839,55 @@ static int SimulateIsr;
 static void OS_IdleThread(void *arg)
 {
    uint32 IdleCount=0;
+#ifndef DISABLE_TICKLESS
+   uint32 state;
+   int ticks;
+#endif
    (void)arg;
+#ifndef DISABLE_TICKLESS
+   (void)state;  //OS_SpinUnlock() ignores it with OS_CPU_COUNT == 1
+#endif
 
    //Don't block in the idle thread!
    for(;;)
    {
       ++IdleCount;
+#ifndef DISABLE_TICKLESS
+      if(SimulateIsr == 0 && (int)arg == OS_CPU_COUNT-1)
+      {
+         state = OS_SpinLock();
+         if(TicklessActive == 0)
+         {
+            ticks = OS_TicklessTicks();
+            if(ticks > 1)
+               OS_TicklessSuspend(ticks);
+         }
+         else if(OS_TicklessElapsed(MemoryRead(COUNTER_REG)) >= TicklessTicks)
+         {
+            OS_TicklessResume();       //Next timeout is due
+         }
+         OS_SpinUnlock(state);
+      }
+#endif
 #ifndef DISABLE_IRQ_SIM
-      MemoryRead(IRQ_MASK + 4);  //will call Sleep
       if(SimulateIsr && (int)arg == OS_CPU_COUNT-1)
       {
          unsigned int value = IRQ_COUNTER18;   //tick interrupt
+#ifndef DISABLE_TICKLESS
+         //Ask the simulator to sleep until the next timeout
+         state = OS_SpinLock();
+         ticks = OS_TicklessTicks();
+         if(ticks > 1)
+         {
+            MemoryWrite(IRQ_MASK + 4, ticks - 1);
+            ThreadTime += MemoryRead(IRQ_MASK + 4);  //Ticks slept
+         }
+         else
+            MemoryRead(IRQ_MASK + 4);  //will call Sleep
+         OS_SpinUnlock(state);
+#else
+         MemoryRead(IRQ_MASK + 4);  //will call Sleep
+#endif
          for(;;)
          {
             value |= OS_InterruptStatus();
@@ -1289,6 +1897,8 @@ static void OS_IdleThread(void *arg)
             value = 0;
          }
       }
+      else
+         MemoryRead(IRQ_MASK + 4);  //will call Sleep
 #endif
 #if OS_CPU_COUNT > 1
       if((int)arg < OS_CPU_COUNT - 1)
@@ -1403,7 +2013,7 @@ int main(int programEnd, char *argv[])
 #endif
    UartInit();
    OS_ThreadCreate("Main", MainThread, NULL, 100, 4000);
-#if defined(WIN32) && OS_CPU_COUNT > 1
+#if OS_CPU_COUNT > 1
    OS_InitSimulation();
 #endif
    OS_Start();
@@ -15,7 +15,9 @@
 #define __RTOS_H__
 
 // Symmetric Multi-Processing
+#ifndef OS_CPU_COUNT
 #define OS_CPU_COUNT 1
+#endif
 
 // Typedefs
 typedef unsigned int   uint32;
@@ -167,12 +169,30 @@ typedef struct OS_Heap_s OS_Heap_t;
 #define HEAP_SYSTEM  (OS_Heap_t*)1
 #define HEAP_SMALL   (OS_Heap_t*)2
 #define HEAP_UI      (OS_Heap_t*)3
+#define HEAP_COUNT   8            //Heaps that can be selected by index
 OS_Heap_t *OS_HeapCreate(const char *name, void *memory, uint32 size);
 void OS_HeapDestroy(OS_Heap_t *heap);
 void *OS_HeapMalloc(OS_Heap_t *heap, int bytes);
 void OS_HeapFree(void *block);
 void OS_HeapAlternate(OS_Heap_t *heap, OS_Heap_t *alternate);
 void OS_HeapRegister(void *index, OS_Heap_t *heap);
+typedef struct {
+   OS_Heap_t *heap;
+   const char *name;
+   uint32 bytesUsed;          //Allocated bytes including block headers
+   uint32 bytesPeak;          //Most bytes ever taken from the free list
+   uint32 bytesFree;          //Bytes on the free list
+   uint32 bytesCached;        //Freed small blocks waiting for reuse
+   uint32 largestFree;        //Largest block on the free list
+   int blocksUsed;
+   int freeListLength;
+   int fragmentation;         //Percent of free bytes not in the largest block
+} OS_HeapStats_t;
+int OS_HeapStats(OS_Heap_t *heap, OS_HeapStats_t *stats);
+//Build with HEAP_TRACK to record the caller of each malloc
+typedef void (*OS_HeapWalkFunc_t)(void *arg, void *block, int bytes, 
+                                  uint32 caller, uint32 ticks);
+void OS_HeapWalk(OS_Heap_t *heap, OS_HeapWalkFunc_t func, void *arg);
 
 /***************** Critical Sections *****************/
 #if OS_CPU_COUNT <= 1
@@ -264,6 +284,30 @@ void OS_TimerCallback(OS_Timer_t *timer, OS_TimerFuncPtr_t callback);
 void OS_TimerStart(OS_Timer_t *timer, uint32 ticks, uint32 ticksRestart);
 void OS_TimerStop(OS_Timer_t *timer);
 
+/***************** Timer wheel ************/
+//Hierarchical timing wheel with O(1) start and stop (caller must lock)
+#define OS_WHEEL_BITS 6
+#define OS_WHEEL_SIZE (1 << OS_WHEEL_BITS)
+#define OS_WHEEL_LEVELS 4
+typedef struct OS_WheelNode_s {
+   struct OS_WheelNode_s *next;
+   struct OS_WheelNode_s **pprev;     //NULL when not started
+   uint32 ticksTimeout;
+   void *owner;
+} OS_WheelNode_t;
+typedef struct OS_Wheel_s {
+   uint32 time;                       //Next tick to process
+   int count;                         //Started nodes
+   OS_WheelNode_t *expired;           //Timed out but not yet returned
+   OS_WheelNode_t *slot[OS_WHEEL_LEVELS][OS_WHEEL_SIZE];
+} OS_Wheel_t;
+void OS_WheelInit(OS_Wheel_t *wheel, uint32 time);
+void OS_WheelStart(OS_Wheel_t *wheel, OS_WheelNode_t *node, 
+                   uint32 ticksTimeout, void *owner);
+void OS_WheelStop(OS_Wheel_t *wheel, OS_WheelNode_t *node);
+void *OS_WheelExpired(OS_Wheel_t *wheel, uint32 timeNow);
+int OS_WheelTicks(OS_Wheel_t *wheel);
+
 /***************** ISR ********************/
 #define STACK_EPC 88/4
 void OS_InterruptServiceRoutine(uint32 status, uint32 *stack);
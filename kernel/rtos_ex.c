@@ -9,6 +9,7 @@
  * DESCRIPTION:
  *    Support simulation under Windows.
  *    Support simulating multiple CPUs using symmetric multiprocessing.
+ *    Start the other CPUs when running on "mlite -smp N".
  *--------------------------------------------------------------------*/
 #include "plasma.h"
 #define NO_ELLIPSIS2
@@ -41,13 +42,6 @@ void OS_InitSimulation(void)
       CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)OS_Start, NULL, 0, &ThreadId[i]);
 }
 #endif  //OS_CPU_COUNT > 1
-#else   //NWIN32
-#include <unistd.h>
-#define kbhit() 1
-#define getch getchar
-#define putch putchar
-#define Sleep(X) usleep(X*1000)
-#endif  //WIN32
 
 
 static uint32 Memory[8];
@@ -117,6 +111,23 @@ void UartPrintf(const char *format,
       putchar(*ptr++);
 }
 
+#elif OS_CPU_COUNT > 1  //Plasma CPU
+
+//Release CPUs 1 to OS_CPU_COUNT-1 into OS_Start() each with its own stack
+void OS_InitSimulation(void)
+{
+   int i;
+   uint8 *stack;
+
+   for(i = 1; i < OS_CPU_COUNT; ++i)
+   {
+      stack = (uint8*)malloc(STACK_SIZE_DEFAULT);
+      MemoryWrite(CPU_STACK_REG, (uint32)stack + STACK_SIZE_DEFAULT - 24);
+      MemoryWrite(CPU_START_REG, (uint32)OS_Start);
+   }
+}
+#endif  //WIN32
+
 
 #if OS_CPU_COUNT > 1
 static volatile uint8 SpinLockArray[OS_CPU_COUNT];
@@ -131,9 +142,10 @@ uint32 OS_CpuIndex(void)
       if(threadId == ThreadId[i])
          return i;
    }
-#endif
-   //return MemoryRead(GPIO_CPU_INDEX);
    return 0; //0 to OS_CPU_COUNT-1
+#else
+   return MemoryRead(CPU_INDEX_REG);
+#endif
 }
 
 
@@ -423,6 +423,62 @@ void TestMath(void)
 }
 #endif
 
+//******************************************************************
+#if defined(INCLUDE_ETH) || defined(INCLUDE_UART_PACKETS)
+//Byte pair checksum that IPChecksum() replaced
+static int ChecksumBytes(int checksum, const unsigned char *data, int length)
+{
+   int i;
+   checksum = ~checksum & 0xffff;
+   for(i = 0; i < length-1; i += 2)
+      checksum += (data[i] << 8) | data[i+1];
+   if(i < length)
+      checksum += data[i] << 8;
+   while(checksum >> 16)
+      checksum = (checksum & 0xffff) + (checksum >> 16);
+   return ~checksum & 0xffff;
+}
+
+void TestChecksum(void)
+{
+   uint8 *data;
+   int i, offset, length, errors=0, loops=2000, sum=0;
+   uint32 timeStart, ticks[2];
+
+   printf("TestChecksum\n");
+   data = (uint8*)OS_HeapMalloc(NULL, 1600);
+   if(data == NULL)
+      return;
+   for(i = 0; i < 1600; ++i)
+      data[i] = (uint8)rand();
+
+   //Every alignment and length must match the old code
+   for(offset = 0; offset < 4; ++offset)
+   {
+      for(length = 0; length < 100; ++length)
+      {
+         if(IPChecksum(0xffff, data+offset, length) !=
+            ChecksumBytes(0xffff, data+offset, length))
+            ++errors;
+      }
+   }
+   printf("Errors = %d\n", errors);
+
+   //Full frame from the IP header on (packet offset 14)
+   timeStart = OS_ThreadTime();
+   for(i = 0; i < loops; ++i)
+      sum += ChecksumBytes(0xffff, data+2, 1500);
+   ticks[0] = OS_ThreadTime() - timeStart;
+   timeStart = OS_ThreadTime();
+   for(i = 0; i < loops; ++i)
+      sum += IPChecksum(0xffff, data+2, 1500);
+   ticks[1] = OS_ThreadTime() - timeStart;
+   printf("%d x 1500 bytes: bytes %d ticks, words %d ticks (%d)\n",
+      loops, ticks[0], ticks[1], sum & 1);
+   OS_HeapFree(data);
+}
+#endif
+
 //******************************************************************
 #if OS_CPU_COUNT > 1
 int SpinDone;
@@ -519,6 +575,7 @@ void MainThread(void *Arg)
 #ifdef INCLUDE_ETH
    EthernetInit(macAddress);
    IPInit(EthernetTransmit, macAddress, "plasma");
+   IPInitGather(EthernetTransmitGather);
    HtmlInit(1);
 #endif
 
@@ -545,6 +602,9 @@ void MainThread(void *Arg)
          printf("7 Timer\n");
          printf("8 Math\n");
          printf("9 Syscall\n");
+#if defined(INCLUDE_ETH) || defined(INCLUDE_UART_PACKETS)
+         printf("c Checksum\n");
+#endif
 #ifdef __MMU_ENUM_H__
          printf("p MMU Process\n");
 #endif
@@ -574,6 +634,9 @@ void MainThread(void *Arg)
 #endif
 #ifdef WIN32
       case 'm': TestMathFull(); break;
+#endif
+#if defined(INCLUDE_ETH) || defined(INCLUDE_UART_PACKETS)
+      case 'c': TestChecksum(); break;
 #endif
       case 'g': printf("Global=%d\n", ++Global); break;
 #if OS_CPU_COUNT > 1
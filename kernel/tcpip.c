@@ -52,13 +52,6 @@
 #define IP_SOURCE             26       //4
 #define IP_DEST               30       //4
 
-//PSEUDO FIELD                OFFSET   LENGTH   VALUE
-#define PSEUDO_IP_SOURCE      0        //4
-#define PSEUDO_IP_DEST        4        //4
-#define PSEUDO_ZERO           8        //1      0
-#define PSEUDO_IP_PROTOCOL    9        //1
-#define PSEUDO_LENGTH         10       //2
-
 //UDP   FIELD                 OFFSET   LENGTH   VALUE
 #define UDP_SOURCE_PORT       34       //2
 #define UDP_DEST_PORT         36       //2
@@ -134,6 +127,18 @@
 #define TCP_FLAGS_PSH         8
 #define TCP_FLAGS_ACK         16
 
+#define TCP_OPTION_END        0
+#define TCP_OPTION_NOP        1
+#define TCP_OPTION_MSS        2        //len=4
+#define TCP_OPTION_SCALE      3        //len=3  RFC 7323
+#define TCP_OPTION_SACK_OK    4        //len=2  RFC 2018
+#define TCP_OPTION_SACK       5        //len=2+8*blocks
+#define TCP_SCALE_MAX         14
+#define TCP_SACK_BLOCKS       3
+#define TCP_SYN_SCALE         1        //options seen in a SYN
+#define TCP_SYN_SACK          2
+#define TCP_OPTION_BYTES(P)   ((((P)[TCP_HEADER_LENGTH] & 0xf0) >> 2) - 20)
+
 //PING  FIELD                 OFFSET   LENGTH   VALUE
 #define PING_TYPE             34       //1      SEND=8;REPLY=0
 #define PING_CODE             35       //1      0
@@ -143,6 +148,11 @@
 #define PING_DATA             44
 
 enum {FRAME_FREE=0, FRAME_ACQUIRED=1, FRAME_IN_LIST};
+enum {FRAME_SACKED=1, FRAME_RESENT=2};
+enum {SOCKET_REMOTE=0, SOCKET_PORT=1};
+enum {BATCH_ACK=1, BATCH_NOTIFY=2};
+#define IP_BATCH_SIZE 16                 //frames per IPMainThread() wakeup
+#define IP_WRITE_COPY 64                 //shorter IPWriteConst() data is copied
 
 static void IPClose2(IPSocket *Socket);
 static void IPArp(unsigned char ipAddress[4]);
@@ -170,12 +180,19 @@ static int FrameFreeCount;
 static IPFrame *FrameFreeHead;
 static IPFrame *FrameSendHead;
 static IPFrame *FrameSendTail;
-static IPFrame *FrameResendHead;
-static IPFrame *FrameResendTail;
+static OS_Wheel_t FrameWheel;     //Socket retransmit timeouts in ticks
+static OS_Wheel_t SocketWheel;    //Socket timeouts in seconds
 static IPSocket *SocketHead;
+static IPSocket *SocketHash[2][SOCKET_HASH_SIZE]; //remote IP:port; local port
+static IPSocket *BatchHead;       //ACKs and callbacks waiting for IPBatchEnd()
+static int BatchDepth;
+static IPConfig_t Config = {PACKET_SIZE, FRAME_COUNT, TCP_MSS, SEND_WINDOW, RECEIVE_WINDOW};
+static int WindowShift;           //receive window scale from Config
+static int FrameCount;
 static uint32 Seconds;
 static int DhcpRetrySeconds;
 static IPSendFuncPtr FrameSendFunc;
+static IPGatherFuncPtr FrameGatherFunc;
 static OS_MQueue_t *IPMQueue;
 static OS_Thread_t *IPThread;
 int IPVerbose=1;
@@ -226,6 +243,8 @@ IPFrame *IPFrameGet(int freeCount)
    {
       assert(frame->state == FRAME_FREE);
       frame->state = FRAME_ACQUIRED;
+      frame->data = NULL;
+      frame->dataLength = 0;
    }
    return frame;
 }
@@ -283,27 +302,254 @@ static void FrameRemove(IPFrame **head, IPFrame **tail, IPFrame *frame)
 }
 
 
-static int IPChecksum(int checksum, const unsigned char *data, int length)
+//Put a sent frame on its socket's resend list until it is ACK'ed.
+//The list is kept in seq order so a cumulative ACK frees a prefix and
+//one timer per socket covers the oldest frame.
+static void FrameResendInsert(IPFrame *frame, uint32 ticks)
 {
-   int i;
-   checksum = ~checksum & 0xffff;
-   for(i = 0; i < length-1; i += 2)
+   IPSocket *socket = frame->socket;
+   IPFrame *prev;
+
+   assert(frame->state == FRAME_ACQUIRED);
+   OS_MutexPend(IPMutex);
+   frame->state = FRAME_IN_LIST;
+   //Usually newest so search from the tail
+   for(prev = socket->frameResendTail; prev; prev = prev->prev)
+   {
+      if((int)(frame->seqEnd - prev->seqEnd) >= 0)
+         break;
+   }
+   frame->prev = prev;
+   if(prev)
+   {
+      frame->next = prev->next;
+      prev->next = frame;
+   }
+   else
+   {
+      frame->next = socket->frameResendHead;
+      socket->frameResendHead = frame;
+   }
+   if(frame->next)
+      frame->next->prev = frame;
+   else
+      socket->frameResendTail = frame;
+   if(socket->resendNode.pprev == NULL)
+      OS_WheelStart(&FrameWheel, &socket->resendNode, FrameWheel.time + ticks, socket);
+   OS_MutexPost(IPMutex);
+}
+
+
+//Must be called with IPMutex
+static void FrameResendRemove(IPFrame *frame)
+{
+   IPSocket *socket = frame->socket;
+
+   FrameRemove(&socket->frameResendHead, &socket->frameResendTail, frame);
+   if(socket->frameResendHead == NULL)
+      OS_WheelStop(&FrameWheel, &socket->resendNode);
+}
+
+//Connected sockets are hashed by the remote IP address and port and
+//listening (plus UDP) sockets by the local port so incoming packets
+//don't have to walk SocketHead
+static int SocketHashIndex(const uint8 *header, int table)
+{
+   uint32 hash;
+   if(table == SOCKET_REMOTE)
    {
-      checksum += (data[i] << 8) | data[i+1];
+      hash = (header[IP_SOURCE] << 24) | (header[IP_SOURCE+1] << 16) |
+             (header[IP_SOURCE+2] << 8) | header[IP_SOURCE+3];
+      hash ^= (header[TCP_SOURCE_PORT] << 8) | header[TCP_SOURCE_PORT+1];
+      hash ^= hash >> 16;
+   }
+   else
+   {
+      hash = (header[TCP_DEST_PORT] << 8) | header[TCP_DEST_PORT+1];
+   }
+   hash ^= hash >> 5;
+   return hash & (SOCKET_HASH_SIZE - 1);
+}
+
+
+//Must be called with IPMutex
+static void SocketHashInsert(IPSocket *socket, int table)
+{
+   IPSocket **bucket = &SocketHash[table][SocketHashIndex(socket->headerRcv, table)];
+
+   //Newest first like SocketHead
+   socket->hashNext[table] = *bucket;
+   *bucket = socket;
+}
+
+
+//Must be called with IPMutex
+static void SocketHashRemove(IPSocket *socket, int table)
+{
+   IPSocket **ptr = &SocketHash[table][SocketHashIndex(socket->headerRcv, table)];
+
+   for(; *ptr; ptr = &(*ptr)->hashNext[table])
+   {
+      if(*ptr == socket)
+      {
+         *ptr = socket->hashNext[table];
+         break;
+      }
    }
-   if(i < length)
-      checksum += data[i] << 8;
-   while(checksum >> 16)
-      checksum = (checksum & 0xffff) + (checksum >> 16);
-   checksum = ~checksum & 0xffff;
-   return checksum;
+}
+
+
+//Find the connected socket for an incoming TCP or UDP packet
+static IPSocket *SocketHashFind(const uint8 *packet, int portBytes)
+{
+   IPSocket *socket;
+
+   socket = SocketHash[SOCKET_REMOTE][SocketHashIndex(packet, SOCKET_REMOTE)];
+   for(; socket; socket = socket->hashNext[SOCKET_REMOTE])
+   {
+      if(packet[IP_PROTOCOL] == socket->headerRcv[IP_PROTOCOL] &&
+         memcmp(packet+IP_SOURCE, socket->headerRcv+IP_SOURCE, 8) == 0 &&
+         memcmp(packet+TCP_SOURCE_PORT, socket->headerRcv+TCP_SOURCE_PORT, portBytes) == 0)
+      {
+         break;
+      }
+   }
+   return socket;
+}
+
+
+//Close the socket after seconds of inactivity (0 = never)
+static void IPSocketTimeout(IPSocket *socket, uint32 seconds)
+{
+   OS_MutexPend(IPMutex);
+   socket->timeout = seconds;
+   if(seconds)
+      OS_WheelStart(&SocketWheel, &socket->timeoutNode, Seconds + seconds, socket);
+   else
+      OS_WheelStop(&SocketWheel, &socket->timeoutNode);
+   OS_MutexPost(IPMutex);
+}
+
+
+//Ones' complement sum of the 16-bit words at data in CPU byte order.
+//The sum doesn't depend on byte order (RFC 1071) so aligned words are
+//added 32 bits at a time with the carries counted separately since
+//2^32 = 1 modulo 0xffff.  The result is folded by IPChecksum().
+typedef union {
+   uint16 half;
+   uint8 byte[2];
+} IPHalf_t;
+
+#define CHECKSUM_ADD(VALUE) word = VALUE; sum += word; carry += sum < word
+
+static uint32 IPChecksumSum(const unsigned char *data, int length)
+{
+   const uint32 *ptr;
+   uint32 sum = 0, carry = 0, word;
+   IPHalf_t half;
+
+   if((uint32)data & 1)
+   {
+      //Odd address: assemble each word from two byte loads
+      for(; length > 1; length -= 2, data += 2)
+      {
+         half.byte[0] = data[0];
+         half.byte[1] = data[1];
+         CHECKSUM_ADD(half.half);
+      }
+   }
+   else
+   {
+      if(((uint32)data & 2) && length > 1)
+      {
+         CHECKSUM_ADD(*(const uint16*)data);
+         data += 2;
+         length -= 2;
+      }
+      ptr = (const uint32*)data;
+      for(; length >= 16; length -= 16, ptr += 4)
+      {
+         CHECKSUM_ADD(ptr[0]);
+         CHECKSUM_ADD(ptr[1]);
+         CHECKSUM_ADD(ptr[2]);
+         CHECKSUM_ADD(ptr[3]);
+      }
+      for(; length >= 4; length -= 4)
+      {
+         CHECKSUM_ADD(*ptr++);
+      }
+      data = (const unsigned char*)ptr;
+      if(length > 1)
+      {
+         CHECKSUM_ADD(*(const uint16*)data);
+         data += 2;
+         length -= 2;
+      }
+   }
+   if(length > 0)
+   {
+      half.byte[0] = data[0];
+      half.byte[1] = 0;
+      CHECKSUM_ADD(half.half);
+   }
+   sum = (sum & 0xffff) + (sum >> 16) + carry;
+   return sum;
+}
+
+
+//Returns the complemented checksum of data in network byte order.
+//Start with 0xffff and pass the result back in to chain blocks;
+//a block that includes a valid checksum field gives 0.
+int IPChecksum(int checksum, const unsigned char *data, int length)
+{
+   static const IPHalf_t ByteOrder = {1};
+   uint32 sum;
+
+   sum = IPChecksumSum(data, length);
+   while(sum >> 16)
+      sum = (sum & 0xffff) + (sum >> 16);
+   if(ByteOrder.byte[0])  //little endian
+      sum = ((sum << 8) | (sum >> 8)) & 0xffff;
+   sum += ~checksum & 0xffff;
+   while(sum >> 16)
+      sum = (sum & 0xffff) + (sum >> 16);
+   return ~sum & 0xffff;
+}
+
+
+//Checksum of the TCP/UDP pseudo header read straight from the IP header
+static int IPChecksumPseudo(const unsigned char *packet, int length)
+{
+   uint32 sum;
+
+   sum = ~IPChecksum(0xffff, packet+IP_SOURCE, 8) & 0xffff;
+   sum += packet[IP_PROTOCOL] + (length & 0xffff);
+   while(sum >> 16)
+      sum = (sum & 0xffff) + (sum >> 16);
+   return ~sum & 0xffff;
+}
+
+
+//RFC 1624 incremental update: HC' = ~(~HC + ~m + m') when the 16-bit
+//word m at an even offset from the start of the checksummed data
+//becomes m'
+static void IPChecksumAdjust(unsigned char *checksumPtr, int oldValue, int newValue)
+{
+   uint32 sum;
+
+   sum = ~((checksumPtr[0] << 8) | checksumPtr[1]) & 0xffff;
+   sum += (~oldValue & 0xffff) + (newValue & 0xffff);
+   while(sum >> 16)
+      sum = (sum & 0xffff) + (sum >> 16);
+   sum = ~sum & 0xffff;
+   checksumPtr[0] = (unsigned char)(sum >> 8);
+   checksumPtr[1] = (unsigned char)sum;
 }
 
 
 static int EthernetVerifyChecksums(const unsigned char *packet, int length)
 {
    int checksum, length2;
-   unsigned char pseudo[12];
 
    //Calculate checksums
    if(packet[ETHERNET_FRAME_TYPE+1] == 0x00)  //IP
@@ -319,26 +565,15 @@ static int EthernetVerifyChecksums(const unsigned char *packet, int length)
       {
          if(packet[UDP_CHECKSUM] == 0 && packet[UDP_CHECKSUM+1] == 0)
             return 0;
-         memcpy(pseudo+PSEUDO_IP_SOURCE, packet+IP_SOURCE, 4);
-         memcpy(pseudo+PSEUDO_IP_DEST, packet+IP_DEST, 4);
-         pseudo[PSEUDO_ZERO] = 0;
-         pseudo[PSEUDO_IP_PROTOCOL] = packet[IP_PROTOCOL];
-         memcpy(pseudo+PSEUDO_LENGTH, packet+UDP_LENGTH, 2);
-         checksum = IPChecksum(0xffff, pseudo, 12);
          length2 = (packet[UDP_LENGTH] << 8) + packet[UDP_LENGTH+1];
+         checksum = IPChecksumPseudo(packet, length2);
          checksum = IPChecksum(checksum, packet+UDP_SOURCE_PORT, length2);
       }
       else if(packet[IP_PROTOCOL] == 0x06)    //TCP
       {
-         memcpy(pseudo+PSEUDO_IP_SOURCE, packet+IP_SOURCE, 4);
-         memcpy(pseudo+PSEUDO_IP_DEST, packet+IP_DEST, 4);
-         pseudo[PSEUDO_ZERO] = 0;
-         pseudo[PSEUDO_IP_PROTOCOL] = packet[IP_PROTOCOL];
          length = (packet[IP_LENGTH] << 8) + packet[IP_LENGTH+1];
          length2 = length - 20;
-         pseudo[PSEUDO_LENGTH] = (unsigned char)(length2 >> 8);
-         pseudo[PSEUDO_LENGTH+1] = (unsigned char)length2;
-         checksum = IPChecksum(0xffff, pseudo, 12);
+         checksum = IPChecksumPseudo(packet, length2);
          checksum = IPChecksum(checksum, packet+TCP_SOURCE_PORT, length2);
       }
       if(checksum)
@@ -350,12 +585,13 @@ static int EthernetVerifyChecksums(const unsigned char *packet, int length)
 
 static void IPFrameReschedule(IPFrame *frame)
 {
-   int length;
-   length = frame->length - TCP_DATA;
+   int length, ticks;
+   length = frame->length - TCP_DATA - TCP_OPTION_BYTES(frame->packet);
    if(frame->packet[TCP_FLAGS] & (TCP_FLAGS_FIN | TCP_FLAGS_SYN))
       ++length;
    if(frame->socket == NULL || frame->socket->state == IP_UDP || length == 0 ||
-      frame->socket->state == IP_PING || ++frame->retryCnt > 5)
+      frame->socket->state == IP_PING || frame->socket->state >= IP_CLOSED ||
+      ++frame->retryCnt > 5)
    {
       FrameFree(frame);     //can't be ACK'ed
    }
@@ -367,9 +603,25 @@ static void IPFrameReschedule(IPFrame *frame)
 #endif
    else
    {
-      //Put on resend list until TCP ACK'ed
-      frame->timeout = (short)(RETRANSMIT_TIME * frame->retryCnt);
-      FrameInsert(&FrameResendHead, &FrameResendTail, frame);
+      //Put on resend list until TCP ACK'ed doubling the timeout each try
+      ticks = frame->socket->rto << (frame->retryCnt - 1);
+      if(ticks > RETRANSMIT_MAX)
+         ticks = RETRANSMIT_MAX;
+      FrameResendInsert(frame, ticks);
+   }
+}
+
+
+//Copy an IPWriteConst() payload into the packet for senders that can't
+//gather it
+static void FrameFlatten(IPFrame *frame)
+{
+   if(frame->dataLength)
+   {
+      memcpy(frame->packet + frame->length - frame->dataLength, frame->data,
+         frame->dataLength);
+      frame->data = NULL;
+      frame->dataLength = 0;
    }
 }
 
@@ -401,12 +653,22 @@ static void IPSendFrame(IPFrame *frame)
    if(FrameSendFunc)
    {
       //Single threaded
-      FrameSendFunc(frame->packet, frame->length);
+      if(frame->dataLength && FrameGatherFunc)
+      {
+         FrameGatherFunc(frame->packet, frame->length - frame->dataLength,
+            frame->data, frame->dataLength);
+      }
+      else
+      {
+         FrameFlatten(frame);
+         FrameSendFunc(frame->packet, frame->length);
+      }
       IPFrameReschedule(frame);
    }
    else
    {
-      //Add Packet to send queue
+      //Add Packet to send queue; the UART sends from the packet
+      FrameFlatten(frame);
       FrameInsert(&FrameSendHead, &FrameSendTail, frame);
 
       //Wakeup sender thread
@@ -419,7 +681,7 @@ static void IPSendFrame(IPFrame *frame)
 static void IPSendPacket(IPSocket *socket, IPFrame *frame, int length)
 {
    int checksum, length2=length;
-   unsigned char pseudo[12], *packet=frame->packet;
+   unsigned char *packet=frame->packet;
 
    frame->length = (uint16)length;
 
@@ -445,49 +707,42 @@ static void IPSendPacket(IPSocket *socket, IPFrame *frame, int length)
          length2 = length - UDP_SOURCE_PORT;
          packet[UDP_LENGTH] = (uint8)(length2 >> 8);
          packet[UDP_LENGTH+1] = (uint8)length2;
-         memcpy(pseudo+PSEUDO_IP_SOURCE, packet+IP_SOURCE, 4);
-         memcpy(pseudo+PSEUDO_IP_DEST, packet+IP_DEST, 4);
-         pseudo[PSEUDO_ZERO] = 0;
-         pseudo[PSEUDO_IP_PROTOCOL] = packet[IP_PROTOCOL];
-         memcpy(pseudo+PSEUDO_LENGTH, packet+UDP_LENGTH, 2);
-         checksum = IPChecksum(0xffff, pseudo, 12);
+         checksum = IPChecksumPseudo(packet, length2);
          memset(packet+UDP_CHECKSUM, 0, 2);
-         length2 = (packet[UDP_LENGTH] << 8) + packet[UDP_LENGTH+1];
          checksum = IPChecksum(checksum, packet+UDP_SOURCE_PORT, length2);
          packet[UDP_CHECKSUM] = (unsigned char)(checksum >> 8);
          packet[UDP_CHECKSUM+1] = (unsigned char)checksum;
       }
       else if(packet[IP_PROTOCOL] == 0x06)    //TCP
       {
-         memcpy(pseudo+PSEUDO_IP_SOURCE, packet+IP_SOURCE, 4);
-         memcpy(pseudo+PSEUDO_IP_DEST, packet+IP_DEST, 4);
-         pseudo[PSEUDO_ZERO] = 0;
-         pseudo[PSEUDO_IP_PROTOCOL] = packet[IP_PROTOCOL];
          length2 = (packet[IP_LENGTH] << 8) + packet[IP_LENGTH+1];
          length2 = length2 - 20;
-         pseudo[PSEUDO_LENGTH] = (unsigned char)(length2 >> 8);
-         pseudo[PSEUDO_LENGTH+1] = (unsigned char)length2;
-         checksum = IPChecksum(0xffff, pseudo, 12);
+         checksum = IPChecksumPseudo(packet, length2);
          memset(packet+TCP_CHECKSUM, 0, 2);
-         checksum = IPChecksum(checksum, packet+TCP_SOURCE_PORT, length2);
+         checksum = IPChecksum(checksum, packet+TCP_SOURCE_PORT, 
+                               length2 - frame->dataLength);
+         if(frame->dataLength)   //starts on an even offset
+            checksum = IPChecksum(checksum, frame->data, frame->dataLength);
          packet[TCP_CHECKSUM] = (unsigned char)(checksum >> 8);
          packet[TCP_CHECKSUM+1] = (unsigned char)checksum;
       }
    }
 
-   length2 = length - TCP_DATA;
+   length2 = length - TCP_DATA - TCP_OPTION_BYTES(packet);
    if(socket && (packet[TCP_FLAGS] & (TCP_FLAGS_FIN | TCP_FLAGS_SYN)))
       length2 = 1;
    frame->socket = socket;
-   frame->timeout = 0;
    frame->retryCnt = 0;
+   frame->sack = 0;
+   frame->timeSent = OS_ThreadTime();
    if(socket)
       frame->seqEnd = socket->seq + length2;
    IPSendFrame(frame);
 }
 
 
-static void TCPSendPacket(IPSocket *socket, IPFrame *frame, int length)
+//The first options bytes after the TCP header are options
+static void TCPSendOptions(IPSocket *socket, IPFrame *frame, int length, int options)
 {
    uint8 *packet = frame->packet;
    int flags, count;
@@ -495,10 +750,7 @@ static void TCPSendPacket(IPSocket *socket, IPFrame *frame, int length)
    flags = packet[TCP_FLAGS];
    memcpy(packet, socket->headerSend, TCP_SEQ);
    packet[TCP_FLAGS] = (uint8)flags;
-   if(flags & TCP_FLAGS_SYN)
-      packet[TCP_HEADER_LENGTH] = 0x60;  //set maximum segment size
-   else
-      packet[TCP_HEADER_LENGTH] = 0x50;
+   packet[TCP_HEADER_LENGTH] = (uint8)((options + 20) << 2);
    packet[TCP_SEQ]   = (uint8)(socket->seq >> 24);
    packet[TCP_SEQ+1] = (uint8)(socket->seq >> 16);
    packet[TCP_SEQ+2] = (uint8)(socket->seq >> 8);
@@ -507,22 +759,348 @@ static void TCPSendPacket(IPSocket *socket, IPFrame *frame, int length)
    packet[TCP_ACK+1] = (uint8)(socket->ack >> 16);
    packet[TCP_ACK+2] = (uint8)(socket->ack >> 8);
    packet[TCP_ACK+3] = (uint8)socket->ack;
-   count = RECEIVE_WINDOW - (socket->ack - socket->ackProcessed);
+   count = Config.receiveWindow - (socket->ack - socket->ackProcessed);
    if(count < 0)
       count = 0;
+   if((flags & TCP_FLAGS_SYN) == 0)
+      count >>= socket->shiftRcv;       //the SYN window is never scaled
+   if(count > 0xffff)
+      count = 0xffff;
    packet[TCP_WINDOW_SIZE] = (uint8)(count >> 8);
    packet[TCP_WINDOW_SIZE+1] = (uint8)count;
    packet[TCP_URGENT_POINTER] = 0;
    packet[TCP_URGENT_POINTER+1] = 0;
+   socket->ackPending = 0;               //every segment carries the ACK
    IPSendPacket(socket, frame, length);
 }
 
 
+//A SYN carries only options
+static void TCPSendPacket(IPSocket *socket, IPFrame *frame, int length)
+{
+   int options = 0;
+   if(frame->packet[TCP_FLAGS] & TCP_FLAGS_SYN)
+      options = length - TCP_DATA;
+   TCPSendOptions(socket, frame, length, options);
+}
+
+
+//Write the MSS option and the window scale and SACK permitted options
+//selected by TCP_SYN_* flags to send with SYN and SYN/ACK.  Returns the
+//option bytes.
+static int TCPSynOptions(IPSocket *socket, uint8 *options, int flags)
+{
+   int length = 4;
+
+   options[0] = TCP_OPTION_MSS;
+   options[1] = 4;
+   options[2] = (uint8)(socket->mss >> 8);
+   options[3] = (uint8)socket->mss;
+   if(flags & TCP_SYN_SCALE)
+   {
+      options[length++] = TCP_OPTION_NOP;
+      options[length++] = TCP_OPTION_SCALE;
+      options[length++] = 3;
+      options[length++] = socket->shiftRcv;
+   }
+   if(flags & TCP_SYN_SACK)
+   {
+      options[length++] = TCP_OPTION_NOP;
+      options[length++] = TCP_OPTION_NOP;
+      options[length++] = TCP_OPTION_SACK_OK;
+      options[length++] = 2;
+   }
+   return length;
+}
+
+
+//Read the MSS, window scale and SACK permitted options of a received
+//SYN or SYN/ACK.  Returns the TCP_SYN_* flags the peer supports.
+static int TCPSynParse(IPSocket *socket, const uint8 *packet)
+{
+   const uint8 *options = packet + TCP_DATA;
+   int length, i, size, mss=536, flags=0;
+
+   length = TCP_OPTION_BYTES(packet);
+   socket->shiftSend = 0;
+   for(i = 0; i + 1 < length; i += size)
+   {
+      if(options[i] == TCP_OPTION_END)
+         break;
+      if(options[i] == TCP_OPTION_NOP)
+      {
+         size = 1;
+         continue;
+      }
+      size = options[i+1];
+      if(size < 2 || i + size > length)
+         break;
+      if(options[i] == TCP_OPTION_MSS && size == 4)
+         mss = (options[i+2] << 8) | options[i+3];
+      else if(options[i] == TCP_OPTION_SCALE && size == 3)
+      {
+         flags |= TCP_SYN_SCALE;
+         socket->shiftSend = options[i+2];
+         if(socket->shiftSend > TCP_SCALE_MAX)
+            socket->shiftSend = TCP_SCALE_MAX;
+      }
+      else if(options[i] == TCP_OPTION_SACK_OK && size == 2)
+         flags |= TCP_SYN_SACK;
+   }
+   if(mss < 64)
+      mss = 536;                        //a tiny MSS would stall IPWrite()
+   if(mss < Config.mss)
+      socket->mss = mss;
+   if((flags & TCP_SYN_SCALE) == 0)
+      socket->shiftRcv = 0;
+   socket->sackOk = (uint8)((flags & TCP_SYN_SACK) != 0);
+   socket->sackHigh = socket->seqReceived;  //nothing SACK'ed yet
+   return flags;
+}
+
+
+static uint32 TCPSeq(const uint8 *packet)
+{
+   return (packet[TCP_SEQ] << 24) | (packet[TCP_SEQ+1] << 16) |
+          (packet[TCP_SEQ+2] << 8) | packet[TCP_SEQ+3];
+}
+
+
+static uint32 TCPOptionWord(const uint8 *ptr)
+{
+   return (ptr[0] << 24) | (ptr[1] << 16) | (ptr[2] << 8) | ptr[3];
+}
+
+
+//Describe the out of order data in frameFuture with up to
+//TCP_SACK_BLOCKS SACK blocks, the one holding seqLast first (RFC 2018)
+static int TCPSackOptions(IPSocket *socket, uint8 *options, uint32 seqLast)
+{
+   uint32 left[TCP_SACK_BLOCKS], right[TCP_SACK_BLOCKS], seq, seqEnd;
+   int count=0, i, j, length;
+   IPFrame *frame;
+   uint8 *packet;
+
+   OS_MutexPend(IPMutex);
+   for(frame = socket->frameFutureHead; frame; frame = frame->next)
+   {
+      packet = frame->packet;
+      seq = TCPSeq(packet);
+      seqEnd = seq + ((packet[IP_LENGTH] << 8) | packet[IP_LENGTH+1]) -
+         (TCP_DATA - IP_VERSION_LENGTH);
+      for(i = 0; i < count; ++i)
+      {
+         if((int)(seq - right[i]) <= 0 && (int)(seqEnd - left[i]) >= 0)
+            break;
+      }
+      if(i == count)
+      {
+         if(count == TCP_SACK_BLOCKS)
+            continue;
+         left[count] = seq;
+         right[count++] = seqEnd;
+         continue;
+      }
+      if((int)(seq - left[i]) < 0)
+         left[i] = seq;
+      if((int)(seqEnd - right[i]) > 0)
+         right[i] = seqEnd;
+      for(j = 0; j < count; ++j)
+      {
+         //Join blocks the segment bridged
+         if(j != i && (int)(left[j] - right[i]) <= 0 && (int)(right[j] - left[i]) >= 0)
+         {
+            if((int)(left[j] - left[i]) < 0)
+               left[i] = left[j];
+            if((int)(right[j] - right[i]) > 0)
+               right[i] = right[j];
+            left[j] = left[--count];
+            right[j] = right[count];
+            if(i == count)
+               i = j;
+            break;
+         }
+      }
+   }
+   OS_MutexPost(IPMutex);
+
+   for(i = 1; i < count; ++i)
+   {
+      if((int)(seqLast - left[i]) >= 0 && (int)(seqLast - right[i]) < 0)
+      {
+         seq = left[0]; left[0] = left[i]; left[i] = seq;
+         seq = right[0]; right[0] = right[i]; right[i] = seq;
+         break;
+      }
+   }
+   if(count == 0)
+      return 0;
+   options[0] = TCP_OPTION_NOP;
+   options[1] = TCP_OPTION_NOP;
+   options[2] = TCP_OPTION_SACK;
+   options[3] = (uint8)(2 + count * 8);
+   length = 4;
+   for(i = 0; i < count; ++i)
+   {
+      for(j = 24; j >= 0; j -= 8)
+         options[length++] = (uint8)(left[i] >> j);
+      for(j = 24; j >= 0; j -= 8)
+         options[length++] = (uint8)(right[i] >> j);
+   }
+   return length;
+}
+
+
+//ACK with SACK blocks while data is missing
+static void TCPSendAck(IPSocket *socket, uint32 seqLast)
+{
+   IPFrame *frameOut;
+   int options = 0;
+
+   frameOut = IPFrameGet(FRAME_COUNT_SEND);
+   if(frameOut == NULL)
+      return;
+   frameOut->packet[TCP_FLAGS] = TCP_FLAGS_ACK;
+   if(socket->sackOk && socket->frameFutureHead)
+      options = TCPSackOptions(socket, frameOut->packet+TCP_DATA, seqLast);
+   TCPSendOptions(socket, frameOut, TCP_DATA + options, options);
+}
+
+
+//Inside a batch the socket's ACK and callback wait for IPBatchEnd()
+static void IPBatchAdd(IPSocket *socket, int flags)
+{
+   if(socket->batchFlags == 0)
+   {
+      socket->batchNext = BatchHead;
+      BatchHead = socket;
+   }
+   socket->batchFlags |= (uint8)flags;
+}
+
+
+//Tell the application there is work on the socket
+static void IPNotify(IPSocket *socket)
+{
+   if(socket->funcPtr == NULL)
+      return;
+   if(BatchDepth)
+      IPBatchAdd(socket, BATCH_NOTIFY);
+   else
+      OS_Job((JobFunc_t)socket->funcPtr, socket, 0, 0);
+}
+
+
+//Mark the sent frames covered by the peer's SACK blocks
+static void TCPSackParse(IPSocket *socket, const uint8 *options, int length)
+{
+   IPFrame *frame;
+   uint32 left, right;
+   int i, j, size;
+
+   OS_MutexPend(IPMutex);
+   for(i = 0; i + 1 < length; i += size)
+   {
+      if(options[i] == TCP_OPTION_END)
+         break;
+      if(options[i] == TCP_OPTION_NOP)
+      {
+         size = 1;
+         continue;
+      }
+      size = options[i+1];
+      if(size < 2 || i + size > length)
+         break;
+      if(options[i] != TCP_OPTION_SACK)
+         continue;
+      for(j = i + 2; j + 8 <= i + size; j += 8)
+      {
+         left = TCPOptionWord(options + j);
+         right = TCPOptionWord(options + j + 4);
+         if((int)(right - socket->sackHigh) > 0)
+            socket->sackHigh = right;
+         for(frame = socket->frameResendHead; frame; frame = frame->next)
+         {
+            if((int)(frame->seqEnd - right) > 0)
+               break;
+            if((int)(TCPSeq(frame->packet) - left) >= 0)
+               frame->sack = FRAME_SACKED;
+         }
+      }
+   }
+   OS_MutexPost(IPMutex);
+}
+
+
+//Fast retransmit: resend the oldest unACK'ed frame and with SACK every
+//frame below the highest SACK'ed seq that the peer doesn't have.
+//A new recovery may resend frames already resent by an earlier one.
+static void TCPRecover(IPSocket *socket, int restart)
+{
+   IPFrame *frame, *frameNext, *oldest;
+
+   OS_MutexPend(IPMutex);
+   oldest = socket->frameResendHead;
+   if(restart)
+   {
+      for(frame = oldest; frame; frame = frame->next)
+      {
+         if(frame->sack == FRAME_RESENT)
+            frame->sack = 0;
+      }
+   }
+   for(frame = oldest; frame; frame = frameNext)
+   {
+      frameNext = frame->next;
+      if(frame != oldest &&
+         (socket->sackOk == 0 || (int)(frame->seqEnd - socket->sackHigh) > 0))
+         break;
+      if(frame->sack)
+         continue;
+      if(IPVerbose)
+         printf("R");
+      //Goes back to the same place in the list
+      FrameRemove(&socket->frameResendHead, &socket->frameResendTail, frame);
+      frame->sack = FRAME_RESENT;
+      IPSendFrame(frame);
+   }
+   OS_MutexPost(IPMutex);
+}
+
+
+//RFC 6298 retransmission timeout from an RTT sample in ticks
+static void TCPRttSample(IPSocket *socket, int rtt)
+{
+   int delta;
+
+   if(socket->srtt == 0)
+   {
+      socket->srtt = rtt << 3;
+      socket->rttvar = rtt << 1;
+   }
+   else
+   {
+      delta = rtt - (socket->srtt >> 3);
+      socket->srtt += delta;
+      if(delta < 0)
+         delta = -delta;
+      socket->rttvar += delta - (socket->rttvar >> 2);
+   }
+   socket->rto = (socket->srtt >> 3) + (socket->rttvar > 1 ? socket->rttvar : 1);
+   if(socket->rto < RETRANSMIT_MIN)
+      socket->rto = RETRANSMIT_MIN;
+   if(socket->rto > RETRANSMIT_MAX)
+      socket->rto = RETRANSMIT_MAX;
+}
+
+
 static void EthernetCreateResponse(unsigned char *packetOut,
                                    const unsigned char *packet,
                                    int length)
 {
-   //Swap destination and source fields
+   //Swap destination and source fields.  Swapping doesn't change the
+   //ones' complement sums so the copied checksums stay valid and the
+   //caller only needs to IPChecksumAdjust() the fields it changes.
    memcpy(packetOut, packet, length);
    memcpy(packetOut+ETHERNET_DEST, packet+ETHERNET_SOURCE, 6);
    memcpy(packetOut+ETHERNET_SOURCE, packet+ETHERNET_DEST, 6);
@@ -662,10 +1240,11 @@ uint32 IPAddressSelf(void)
 
 static int IPProcessTCPPacket(IPFrame *frameIn)
 {
-   uint32 seq, ack;
-   int length, ip_length, bytes, rc=0, notify=0, window, show;
+   uint32 seq, ack, windowOld;
+   int length, ip_length, bytes, rc=0, notify=0, window, options, flags;
+   int rtt=-1;
    IPSocket *socket, *socketNew;
-   IPFrame *frameOut, *frame2, *framePrev;
+   IPFrame *frameOut, *frame2;
    uint8 *packet, *packetOut;
 
 #if 0
@@ -691,21 +1270,17 @@ static int IPProcessTCPPacket(IPFrame *frameIn)
       if(IPVerbose)
          printf("S");
       //Check if duplicate SYN
-      for(socket = SocketHead; socket; socket = socket->next)
+      socket = SocketHashFind(packet, 4);
+      if(socket)
       {
-         if(socket->state != IP_LISTEN &&
-            packet[IP_PROTOCOL] == socket->headerRcv[IP_PROTOCOL] &&
-            memcmp(packet+IP_SOURCE, socket->headerRcv+IP_SOURCE, 8) == 0 &&
-            memcmp(packet+TCP_SOURCE_PORT, socket->headerRcv+TCP_SOURCE_PORT, 4) == 0)
-         {
-            if(IPVerbose)
-               printf("s");
-            return 0;
-         }
+         if(IPVerbose)
+            printf("s");
+         return 0;
       }
 
       //Find an open port
-      for(socket = SocketHead; socket; socket = socket->next)
+      socket = SocketHash[SOCKET_PORT][SocketHashIndex(packet, SOCKET_PORT)];
+      for(; socket; socket = socket->hashNext[SOCKET_PORT])
       {
          if(socket->state == IP_LISTEN &&
             packet[IP_PROTOCOL] == socket->headerRcv[IP_PROTOCOL] &&
@@ -720,13 +1295,18 @@ static int IPProcessTCPPacket(IPFrame *frameIn)
                return 0;
             memcpy(socketNew, socket, sizeof(IPSocket));
             socketNew->state = IP_TCP;
-            socketNew->timeout = SOCKET_TIMEOUT;
             socketNew->timeoutReset = SOCKET_TIMEOUT * 6;
+            IPSocketTimeout(socketNew, SOCKET_TIMEOUT);
             socketNew->ack = seq;
             socketNew->ackProcessed = seq + 1;
             socketNew->seq = socketNew->ack + 0x12345678;
             socketNew->seqReceived = socketNew->seq;
             socketNew->seqWindow = (packet[TCP_WINDOW_SIZE] << 8) | packet[TCP_WINDOW_SIZE+1];
+            socketNew->mss = Config.mss;
+            socketNew->shiftRcv = (uint8)WindowShift;
+            socketNew->srtt = 0;
+            socketNew->dupAcks = 0;
+            flags = TCPSynParse(socketNew, packet);
 
             //Send ACK
             packetOut = frameOut->packet;
@@ -735,11 +1315,8 @@ static int IPProcessTCPPacket(IPFrame *frameIn)
             memcpy(socketNew->headerSend, packetOut, TCP_SEQ);
             packetOut[TCP_FLAGS] = TCP_FLAGS_SYN | TCP_FLAGS_ACK;
             ++socketNew->ack;
-            packetOut[TCP_DATA] = 2;    //maximum segment size = 536
-            packetOut[TCP_DATA+1] = 4;
-            packetOut[TCP_DATA+2] = 2;
-            packetOut[TCP_DATA+3] = 24;
-            TCPSendPacket(socketNew, frameOut, TCP_DATA+4);
+            bytes = TCPSynOptions(socketNew, packetOut+TCP_DATA, flags);
+            TCPSendPacket(socketNew, frameOut, TCP_DATA+bytes);
             ++socketNew->seq;
 
             //Add socket to linked list
@@ -749,9 +1326,9 @@ static int IPProcessTCPPacket(IPFrame *frameIn)
             if(SocketHead)
                SocketHead->prev = socketNew;
             SocketHead = socketNew;
+            SocketHashInsert(socketNew, SOCKET_REMOTE);
             OS_MutexPost(IPMutex);
-            if(socketNew->funcPtr)
-               OS_Job((JobFunc_t)socketNew->funcPtr, socketNew, 0, 0);
+            IPNotify(socketNew);
             return 0;
          }
       }
@@ -775,71 +1352,85 @@ static int IPProcessTCPPacket(IPFrame *frameIn)
    }
 
    //Find an open socket
-   for(socket = SocketHead; socket; socket = socket->next)
-   {
-      if(packet[IP_PROTOCOL] == socket->headerRcv[IP_PROTOCOL] &&
-         memcmp(packet+IP_SOURCE, socket->headerRcv+IP_SOURCE, 8) == 0 &&
-         memcmp(packet+TCP_SOURCE_PORT, socket->headerRcv+TCP_SOURCE_PORT, 4) == 0)
-      {
-         break;
-      }
-   }
+   socket = SocketHashFind(packet, 4);
    if(socket == NULL)
    {
       return 0;
    }
 
+   //Read SACK blocks then move any data down over the TCP options
+   options = TCP_OPTION_BYTES(packet);
+   if(options > 0 && (packet[TCP_FLAGS] & TCP_FLAGS_SYN) == 0 &&
+      options <= ip_length - (TCP_DATA - IP_VERSION_LENGTH))
+   {
+      if(socket->sackOk)
+         TCPSackParse(socket, packet+TCP_DATA, options);
+      ip_length -= options;
+      memmove(packet+TCP_DATA, packet+TCP_DATA+options,
+         ip_length - (TCP_DATA - IP_VERSION_LENGTH));
+      packet[IP_LENGTH] = (uint8)(ip_length >> 8);
+      packet[IP_LENGTH+1] = (uint8)ip_length;
+      packet[TCP_HEADER_LENGTH] = 0x50;
+   }
+
    //Determine window
+   windowOld = socket->seqWindow;
    socket->seqWindow = (packet[TCP_WINDOW_SIZE] << 8) | packet[TCP_WINDOW_SIZE+1];
+   if((packet[TCP_FLAGS] & TCP_FLAGS_SYN) == 0)
+      socket->seqWindow <<= socket->shiftSend;
    bytes = ip_length - (TCP_DATA - IP_VERSION_LENGTH);
 
    //Check if packets can be removed from retransmition list
    if(packet[TCP_FLAGS] & TCP_FLAGS_ACK)
    {
-      if(ack != socket->seqReceived)
+      if((int)(ack - socket->seqReceived) > 0)
       {
          OS_MutexPend(IPMutex);
-         for(frame2 = FrameResendHead; frame2; )
+         for(;;)
          {
-            framePrev = frame2;
-            frame2 = frame2->next;
-            if(framePrev->socket == socket && (int)(ack - framePrev->seqEnd) >= 0)
-            {
-               //Remove packet from retransmition queue
-               if(socket->timeout)
-                  socket->timeout = socket->timeoutReset;
-               FrameRemove(&FrameResendHead, &FrameResendTail, framePrev);
-               FrameFree(framePrev);
-            }
+            frame2 = socket->frameResendHead;
+            if(frame2 == NULL || (int)(ack - frame2->seqEnd) < 0)
+               break;
+            //Only frames sent once give an RTT sample (Karn)
+            if(frame2->retryCnt == 1)
+               rtt = OS_ThreadTime() - frame2->timeSent;
+            //Remove packet from retransmition queue
+            if(socket->timeout)
+               IPSocketTimeout(socket, socket->timeoutReset);
+            FrameResendRemove(frame2);
+            FrameFree(frame2);
          }
+         if(rtt >= 0)
+            TCPRttSample(socket, rtt);
+         //Restart the timer for the frames still outstanding
+         if(socket->frameResendHead)
+            OS_WheelStart(&FrameWheel, &socket->resendNode, 
+               FrameWheel.time + socket->rto, socket);
          OS_MutexPost(IPMutex);
          socket->seqReceived = ack;
+         if((int)(ack - socket->sackHigh) > 0)
+            socket->sackHigh = ack;     //keep the SACK edge from wrapping
          socket->resentDone = 0;
+         if(socket->dupAcks >= 3 && (int)(ack - socket->recover) < 0)
+            TCPRecover(socket, 0);      //partial ACK, resend the next hole
+         else
+            socket->dupAcks = 0;
       }
-      else if(ack == socket->seqReceived && bytes == 0 &&
-         (packet[TCP_FLAGS] & (TCP_FLAGS_RST | TCP_FLAGS_FIN)) == 0)
+      else if(ack == socket->seqReceived && bytes == 0 && socket->seq != ack &&
+         socket->seqWindow == windowOld &&
+         (packet[TCP_FLAGS] & (TCP_FLAGS_SYN | TCP_FLAGS_RST | TCP_FLAGS_FIN)) == 0)
       {
-         //Detected that packet was lost, resend
-         show = 1;
-         OS_MutexPend(IPMutex);
-         for(frame2 = FrameResendTail; frame2; )
+         //Duplicate ACK: fast retransmit on the third (RFC 5681).
+         //A window update is not a duplicate and leaves dupAcks alone.
+         if(socket->dupAcks < 255)
+            ++socket->dupAcks;
+         if(socket->dupAcks == 3)
          {
-            framePrev = frame2->prev;
-            if(frame2->socket == socket)
-            {
-               if(frame2->retryCnt > 2)
-                  break;
-               if(IPVerbose && show)
-                  printf("R");
-               show = 0;
-               //Remove packet from retransmition queue
-               FrameRemove(&FrameResendHead, &FrameResendTail, frame2);
-               IPSendFrame(frame2);
-               //break;
-            }
-            frame2 = framePrev;
+            socket->recover = socket->seq;
+            TCPRecover(socket, 1);
          }
-         OS_MutexPost(IPMutex);
+         else if(socket->dupAcks > 3 && socket->sackOk)
+            TCPRecover(socket, 0);      //new SACK blocks may show more holes
       }
    }
 
@@ -848,6 +1439,7 @@ static int IPProcessTCPPacket(IPFrame *frameIn)
       (TCP_FLAGS_SYN | TCP_FLAGS_ACK))
    {
       //Ack SYN/ACK
+      TCPSynParse(socket, packet);
       socket->ack = seq + 1;
       socket->ackProcessed = seq + 1;
       frameOut = IPFrameGet(FRAME_COUNT_SEND);
@@ -856,8 +1448,7 @@ static int IPProcessTCPPacket(IPFrame *frameIn)
          frameOut->packet[TCP_FLAGS] = TCP_FLAGS_ACK;
          TCPSendPacket(socket, frameOut, TCP_DATA);
       }
-      if(socket->funcPtr)
-         OS_Job((JobFunc_t)socket->funcPtr, socket, 0, 0);
+      IPNotify(socket);
       return 0;
    }
    if(packet[TCP_HEADER_LENGTH] != 0x50)
@@ -882,7 +1473,7 @@ static int IPProcessTCPPacket(IPFrame *frameIn)
       //Insert packet into socket linked list
       notify = 1;
       if(socket->timeout)
-         socket->timeout = socket->timeoutReset;
+         IPSocketTimeout(socket, socket->timeoutReset);
       if(IPVerbose)
          printf("D");
       for(;;)
@@ -924,34 +1515,29 @@ static int IPProcessTCPPacket(IPFrame *frameIn)
             printf("d");
       }
 
-      //Ack data
-      window = RECEIVE_WINDOW - (socket->ack - socket->ackProcessed);
-      frameOut = IPFrameGet(FRAME_COUNT_SEND);
-      if(frameOut)
-      {
-         frameOut->packet[TCP_FLAGS] = TCP_FLAGS_ACK;
-         TCPSendPacket(socket, frameOut, TCP_DATA);
-      }
+      //Ack data.  In a batch only every second segment is ACK'ed at
+      //once; IPBatchEnd() sends the ACK for an odd one.
+      window = Config.receiveWindow - (socket->ack - socket->ackProcessed);
+      if(BatchDepth && ++socket->ackPending < 2 && socket->frameFutureHead == NULL)
+         IPBatchAdd(socket, BATCH_ACK);
+      else
+         TCPSendAck(socket, seq);
 
       //Using frame
       rc = 1;
    }
    else if(bytes)
    {
-      if(socket->ack < seq && seq <= socket->ack + 65536)
+      if(socket->ack < seq && seq <= socket->ack + Config.receiveWindow)
       {
          //Save frame to frameFuture
          FrameInsert(&socket->frameFutureHead, &socket->frameFutureTail, frameIn);
          rc = 1;  //using frame
       }
 
-      //Ack with current offset since data missing
-      frameOut = IPFrameGet(FRAME_COUNT_SEND);
-      if(frameOut)
-      {
-         frameOut->packet[TCP_FLAGS] = TCP_FLAGS_ACK;
-         TCPSendPacket(socket, frameOut, TCP_DATA);
-      }
+      //Ack with current offset since data missing.  The peer
+      //retransmits after three of these duplicate ACKs.
+      TCPSendAck(socket, seq);
    }
 
    //Check if FIN flag set
@@ -959,7 +1545,7 @@ static int IPProcessTCPPacket(IPFrame *frameIn)
       socket->state < IP_CLOSED)
    {
       notify = 1;
-      socket->timeout = SOCKET_TIMEOUT;
+      IPSocketTimeout(socket, SOCKET_TIMEOUT);
       if(IPVerbose)
          printf("F");
       frameOut = IPFrameGet(0);
@@ -976,8 +1562,8 @@ static int IPProcessTCPPacket(IPFrame *frameIn)
    }
 
    //Notify application
-   if(socket->funcPtr && notify)
-      OS_Job((JobFunc_t)socket->funcPtr, socket, 0, 0);
+   if(notify)
+      IPNotify(socket);
    return rc;
 }
 
@@ -992,7 +1578,7 @@ int IPProcessEthernetPacket(IPFrame *frameIn, int length)
    packet = frameIn->packet;
    frameIn->length = (uint16)length;
 
-   if(packet[ETHERNET_FRAME_TYPE] != 0x08 || frameIn->length > PACKET_SIZE)
+   if(packet[ETHERNET_FRAME_TYPE] != 0x08 || frameIn->length > Config.frameSize)
       return 0;  //wrong ethernet type, packet not used
 
    //ARP?
@@ -1075,7 +1661,7 @@ int IPProcessEthernetPacket(IPFrame *frameIn, int length)
             if(socket->state == IP_PING && 
                memcmp(packet+IP_SOURCE, socket->headerSend+IP_DEST, 4) == 0)
             {
-               OS_Job((JobFunc_t)socket->funcPtr, socket, 0, 0);
+               IPNotify(socket);
                return 0;
             }
          }
@@ -1087,8 +1673,12 @@ int IPProcessEthernetPacket(IPFrame *frameIn, int length)
          return 0;
       packetOut = frameOut->packet;
       EthernetCreateResponse(packetOut, packet, frameIn->length);
-      frameOut->packet[PING_TYPE] = 0;       //PING reply
-      IPSendPacket(NULL, frameOut, frameIn->length);
+      packetOut[PING_TYPE] = 0;              //PING reply
+      IPChecksumAdjust(packetOut+PING_CHECKSUM, 8 << 8, 0);
+      frameOut->length = (uint16)frameIn->length;
+      frameOut->socket = NULL;
+      frameOut->retryCnt = 0;
+      IPSendFrame(frameOut);
       return 0;
    }
 
@@ -1102,20 +1692,13 @@ int IPProcessEthernetPacket(IPFrame *frameIn, int length)
    if(packet[IP_PROTOCOL] == 0x11)
    {
       //Find open socket
-      for(socket = SocketHead; socket; socket = socket->next)
-      {
-         if(packet[IP_PROTOCOL] == socket->headerRcv[IP_PROTOCOL] &&
-            memcmp(packet+IP_SOURCE, socket->headerRcv+IP_SOURCE, 8) == 0 &&
-            memcmp(packet+UDP_SOURCE_PORT, socket->headerRcv+UDP_SOURCE_PORT, 2) == 0)
-         {
-            break;
-         }
-      }
+      socket = SocketHashFind(packet, 2);
 
       if(socket == NULL)
       {
          //Find listening socket
-         for(socket = SocketHead; socket; socket = socket->next)
+         socket = SocketHash[SOCKET_PORT][SocketHashIndex(packet, SOCKET_PORT)];
+         for(; socket; socket = socket->hashNext[SOCKET_PORT])
          {
             if(packet[IP_PROTOCOL] == socket->headerRcv[IP_PROTOCOL] &&
                memcmp(packet+UDP_DEST_PORT, socket->headerRcv+UDP_DEST_PORT, 2) == 0)
@@ -1131,7 +1714,7 @@ int IPProcessEthernetPacket(IPFrame *frameIn, int length)
          if(IPVerbose)
             printf("U");
          FrameInsert(&socket->frameReadHead, &socket->frameReadTail, frameIn);
-         OS_Job((JobFunc_t)socket->funcPtr, socket, 0, 0);
+         IPNotify(socket);
          return 1;
       }
    }
@@ -1139,11 +1722,40 @@ int IPProcessEthernetPacket(IPFrame *frameIn, int length)
 }
 
 
+//Call around a run of IPProcessEthernetPacket() calls so the ACKs and
+//socket callbacks are sent once for all of the frames
+void IPBatchBegin(void)
+{
+   ++BatchDepth;
+}
+
+
+void IPBatchEnd(void)
+{
+   IPSocket *socket;
+   int flags;
+
+   if(--BatchDepth > 0)
+      return;
+   while(BatchHead)
+   {
+      socket = BatchHead;
+      BatchHead = socket->batchNext;
+      flags = socket->batchFlags;
+      socket->batchFlags = 0;
+      if((flags & BATCH_ACK) && socket->ackPending && socket->state < IP_CLOSED)
+         TCPSendAck(socket, socket->ack);
+      if(flags & BATCH_NOTIFY)
+         IPNotify(socket);
+   }
+}
+
+
 #ifndef WIN32
 static void IPMainThread(void *arg)
 {
    uint32 message[4];
-   int rc;
+   int rc, count;
    IPFrame *frame, *frameOut=NULL;
    uint32 ticks, ticksLast;
    (void)arg;
@@ -1155,15 +1767,17 @@ static void IPMainThread(void *arg)
    {
       Led(7, 0);
       rc = OS_MQueueGet(IPMQueue, message, 10);
-      if(rc == 0)
+
+      //Handle everything already queued before sending the ACKs
+      IPBatchBegin();
+      for(count = 0; rc == 0; )
       {
          frame = (IPFrame*)message[1];
          if(message[0] == 0)       //frame received
          {
             Led(7, 1);
             frame->length = (uint16)message[2];
-            rc = IPProcessEthernetPacket(frame, frame->length);
-            if(rc == 0)
+            if(IPProcessEthernetPacket(frame, frame->length) == 0)
                FrameFree(frame);
          }
          else if(message[0] == 1)  //frame sent
@@ -1176,7 +1790,11 @@ static void IPMainThread(void *arg)
          else if(message[0] == 2)  //frame ready to send
          {
          }
+         if(++count >= IP_BATCH_SIZE)
+            break;
+         rc = OS_MQueueGet(IPMQueue, message, OS_NO_WAIT);
       }
+      IPBatchEnd();
 
       if(frameOut == NULL)
       {
@@ -1209,33 +1827,73 @@ uint8 *MyPacketGet(void)
 }
 
 
+//Change the frame size, TCP segment size and windows.  Zero fields keep
+//their value and config returns the values used.  The frame count only
+//takes effect before IPInit().
+void IPConfigure(IPConfig_t *config)
+{
+   if(config->frameSize)
+      Config.frameSize = config->frameSize;
+   if(config->frameCount && FrameCount == 0)
+      Config.frameCount = config->frameCount;
+   if(config->mss)
+      Config.mss = config->mss;
+   if(config->sendWindow)
+      Config.sendWindow = config->sendWindow;
+   if(config->receiveWindow)
+      Config.receiveWindow = config->receiveWindow;
+
+   if(Config.frameSize > PACKET_SIZE || Config.frameSize < TCP_DATA + 536)
+      Config.frameSize = PACKET_SIZE;
+   if(Config.frameCount > FRAME_POOL_SIZE / (int)sizeof(IPFrame))
+      Config.frameCount = FRAME_POOL_SIZE / sizeof(IPFrame);
+   if(Config.frameCount < FRAME_COUNT_SYNC * 2)
+      Config.frameCount = FRAME_COUNT_SYNC * 2;
+   if(Config.mss > Config.frameSize - TCP_DATA || Config.mss < 64)
+      Config.mss = Config.frameSize - TCP_DATA;
+   if(Config.sendWindow < Config.mss)
+      Config.sendWindow = Config.mss;
+   if(Config.receiveWindow > (0xffff << TCP_SCALE_MAX))
+      Config.receiveWindow = 0xffff << TCP_SCALE_MAX;
+   if(Config.receiveWindow < Config.mss)
+      Config.receiveWindow = Config.mss;
+   for(WindowShift = 0; (Config.receiveWindow >> WindowShift) > 0xffff; )
+      ++WindowShift;
+   memcpy(config, &Config, sizeof(IPConfig_t));
+}
+
+
 //Set FrameSendFunction only if single threaded
 void IPInit(IPSendFuncPtr frameSendFunction, uint8 macAddress[6], char name[6])
 {
    int i;
    IPFrame *frame;
+   IPConfig_t config;
 
+   memset(&config, 0, sizeof(config));
+   IPConfigure(&config);
    if(macAddress)
       memcpy(ethernetAddressPlasma, macAddress, 6);
    if(name)
       memcpy(dhcpOptions+18, name, 6);
    FrameSendFunc = frameSendFunction;
    IPMutex = OS_MutexCreate("IPSem");
-   IPMQueue = OS_MQueueCreate("IPMQ", FRAME_COUNT*2, 32);
-   frame = (IPFrame*)malloc(sizeof(IPFrame) * FRAME_COUNT);
+   IPMQueue = OS_MQueueCreate("IPMQ", config.frameCount*2, 32);
+   frame = (IPFrame*)malloc(sizeof(IPFrame) * config.frameCount);
    if(frame == NULL)
       return;
-   memset(frame, 0, sizeof(IPFrame) * FRAME_COUNT);
-   for(i = 0; i < FRAME_COUNT; ++i)
+   memset(frame, 0, sizeof(IPFrame) * config.frameCount);
+   for(i = 0; i < config.frameCount; ++i)
    {
       frame->next = FrameFreeHead;
       frame->prev = NULL;
       FrameFreeHead = frame;
       ++frame;
    }
-   FrameFreeCount = FRAME_COUNT;
+   FrameFreeCount = config.frameCount;
+   FrameCount = config.frameCount;
 #ifndef WIN32
-   UartPacketConfig(MyPacketGet, PACKET_SIZE, IPMQueue);
+   UartPacketConfig(MyPacketGet, config.frameSize, IPMQueue);
    if(frameSendFunction == NULL)
       IPThread = OS_ThreadCreate("TCP/IP", IPMainThread, NULL, 240, 6000);
 #endif
@@ -1243,6 +1901,14 @@ void IPInit(IPSendFuncPtr frameSendFunction, uint8 macAddress[6], char name[6])
 }
 
 
+//Transmit function for frames with an IPWriteConst() payload.  It is
+//passed the headers and the payload separately.
+void IPInitGather(IPGatherFuncPtr frameGatherFunction)
+{
+   FrameGatherFunc = frameGatherFunction;
+}
+
+
 //To open a socket for listen set ipAddress to 0
 IPSocket *IPOpen(IPMode_e mode, uint32 ipAddress, uint32 port, IPSockFuncPtr funcPtr)
 {
@@ -1265,10 +1931,14 @@ IPSocket *IPOpen(IPMode_e mode, uint32 ipAddress, uint32 port, IPSockFuncPtr fun
    socket->frameFutureTail = NULL;
    socket->readOffset = 0;
    socket->funcPtr = funcPtr;
+   socket->freeFunc = NULL;
    socket->userData = 0;
    socket->userFunc = NULL;
    socket->userPtr = NULL;
    socket->seqWindow = 2048;
+   socket->mss = Config.mss;
+   socket->shiftRcv = (uint8)WindowShift;
+   socket->rto = RETRANSMIT_TIME;
    ptrSend = socket->headerSend;
    ptrRcv = socket->headerRcv;
 
@@ -1350,6 +2020,13 @@ IPSocket *IPOpen(IPMode_e mode, uint32 ipAddress, uint32 port, IPSockFuncPtr fun
    if(SocketHead)
       SocketHead->prev = socket;
    SocketHead = socket;
+   if(mode != IP_MODE_PING)
+   {
+      if(ipAddress)
+         SocketHashInsert(socket, SOCKET_REMOTE);
+      if(ipAddress == 0 || mode == IP_MODE_UDP)
+         SocketHashInsert(socket, SOCKET_PORT);  //UDP replies may come from any port
+   }
    OS_MutexPost(IPMutex);
 
    if(mode == IP_MODE_TCP && ipAddress)
@@ -1360,11 +2037,8 @@ IPSocket *IPOpen(IPMode_e mode, uint32 ipAddress, uint32 port, IPSockFuncPtr fun
       if(frame)
       {
          frame->packet[TCP_FLAGS] = TCP_FLAGS_SYN;
-         frame->packet[TCP_DATA] = 2;    //maximum segment size = 536
-         frame->packet[TCP_DATA+1] = 4;
-         frame->packet[TCP_DATA+2] = 2;
-         frame->packet[TCP_DATA+3] = 24;
-         TCPSendPacket(socket, frame, TCP_DATA+4);
+         TCPSendPacket(socket, frame, TCP_DATA + TCPSynOptions(socket,
+            frame->packet+TCP_DATA, TCP_SYN_SCALE | TCP_SYN_SACK));
          ++socket->seq;
       }
    }
@@ -1391,13 +2065,66 @@ void IPWriteFlush(IPSocket *socket)
 }
 
 
+//Wait for room in the send window and a frame to write into
+static IPFrame *IPWriteFrame(IPSocket *socket)
+{
+   OS_Thread_t *self;
+   uint32 window;
+   int tries;
+
+   self = OS_ThreadSelf();
+   //Rate limit output
+   for(tries = 1; ; ++tries)
+   {
+      window = socket->seqWindow;
+      if(window > (uint32)Config.sendWindow)
+         window = Config.sendWindow;
+      if(socket->seq - socket->seqReceived < window || self == IPThread || tries >= 20)
+         break;
+      //printf("l(%d,%d,%d) ", socket->seq - socket->seqReceived, socket->seq, socket->seqReceived);
+      OS_ThreadSleep(10);
+   }
+   for(tries = 0; socket->frameSend == NULL; )
+   {
+      socket->frameSend = IPFrameGet(FRAME_COUNT_SEND);
+      socket->sendOffset = 0;
+      if(socket->frameSend == NULL)
+      {
+         //printf("L");
+         if(self == IPThread || ++tries > 40)
+            break;
+         else
+            OS_ThreadSleep(10);
+      }
+   }
+   if(socket->frameSend == NULL)
+      printf("X");
+   return socket->frameSend;
+}
+
+
+//A frame gathers one IPWriteConst() fragment at its end, so copy a
+//queued fragment into the packet before more bytes follow it
+static void IPWriteFlatten(IPSocket *socket)
+{
+   IPFrame *frame=socket->frameSend;
+
+   if(frame->dataLength)
+   {
+      memcpy(frame->packet + TCP_DATA + socket->sendOffset - frame->dataLength,
+         frame->data, frame->dataLength);
+      frame->data = NULL;
+      frame->dataLength = 0;
+   }
+}
+
+
 uint32 IPWrite(IPSocket *socket, const uint8 *buf, uint32 length)
 {
    IPFrame *frameOut;
    uint8 *packetOut;
-   uint32 bytes, count=0, tries=0;
+   uint32 bytes, count=0;
    int offset;
-   OS_Thread_t *self;
 
    if(socket == NULL)
       socket = (IPSocket*)OS_ThreadInfoGet(OS_ThreadSelf(), 0);
@@ -1406,7 +2133,7 @@ uint32 IPWrite(IPSocket *socket, const uint8 *buf, uint32 length)
       return 0;
 
    if(socket->timeout)
-      socket->timeout = socket->timeoutReset;
+      IPSocketTimeout(socket, socket->timeoutReset);
 
 #ifndef EXCLUDE_FILESYS
    if(socket->fileOut)   //override stdout
@@ -1414,40 +2141,12 @@ uint32 IPWrite(IPSocket *socket, const uint8 *buf, uint32 length)
 #endif
  
    //printf("IPWrite(0x%x, %d)", Socket, Length);
-   self = OS_ThreadSelf();
    while(length)
    {
-      //Rate limit output
-      if(socket->seq - socket->seqReceived >= SEND_WINDOW)
-      {
-         //printf("l(%d,%d,%d) ", socket->seq - socket->seqReceived, socket->seq, socket->seqReceived);
-         if(self != IPThread && ++tries < 20)
-         {
-            OS_ThreadSleep(10);
-            continue;
-         }
-      }
-      tries = 0;
-      while(socket->frameSend == NULL)
-      {
-         socket->frameSend = IPFrameGet(FRAME_COUNT_SEND);
-         socket->sendOffset = 0;
-         if(socket->frameSend == NULL)
-         {
-            //printf("L");
-            if(self == IPThread || ++tries > 40)
-               break;
-            else
-               OS_ThreadSleep(10);
-         }
-      }
-      frameOut = socket->frameSend;
-      offset = socket->sendOffset;
+      frameOut = IPWriteFrame(socket);
       if(frameOut == NULL)
-      {
-         printf("X");
          break;
-      }
+      offset = socket->sendOffset;
       packetOut = frameOut->packet;
 
       if(socket->state == IP_PING)
@@ -1460,12 +2159,13 @@ uint32 IPWrite(IPSocket *socket, const uint8 *buf, uint32 length)
       }
       else if(socket->state != IP_UDP)
       {
-         bytes = 512 - offset;
+         bytes = socket->mss - offset;
          if(bytes > length)
             bytes = length;
+         IPWriteFlatten(socket);
          socket->sendOffset += bytes;
          memcpy(packetOut+TCP_DATA+offset, buf, bytes);
-         if(socket->sendOffset >= 512)
+         if(socket->sendOffset >= socket->mss)
             IPWriteFlush(socket);
          //if(Socket->seq - Socket->seqReceived > Socket->seqWindow)
          //{
@@ -1489,6 +2189,53 @@ uint32 IPWrite(IPSocket *socket, const uint8 *buf, uint32 length)
 }
 
 
+//Like IPWrite() but the frames point at buf instead of copying it, so
+//buf must not change until the socket is closed.  Bytes already written
+//go in front of the first segment.  Full segments are sent at once; the
+//last one waits for more bytes or IPWriteFlush() like IPWrite() data.
+uint32 IPWriteConst(IPSocket *socket, const uint8 *buf, uint32 length)
+{
+   IPFrame *frameOut;
+   uint32 bytes, count=0;
+   int offset;
+
+   if(socket == NULL)
+      socket = (IPSocket*)OS_ThreadInfoGet(OS_ThreadSelf(), 0);
+   if(socket->state != IP_TCP || socket->fileOut || length < IP_WRITE_COPY)
+      return IPWrite(socket, buf, length);
+
+   if(socket->timeout)
+      IPSocketTimeout(socket, socket->timeoutReset);
+   while(length)
+   {
+      frameOut = IPWriteFrame(socket);
+      if(frameOut == NULL)
+         break;
+      IPWriteFlatten(socket);
+      offset = socket->sendOffset;
+      if(offset & 1)
+      {
+         //Keep buf on an even offset for the checksum
+         frameOut->packet[TCP_DATA + offset++] = *buf++;
+         ++count;
+         --length;
+      }
+      bytes = socket->mss - offset;
+      if(bytes > length)
+         bytes = length;
+      frameOut->data = buf;
+      frameOut->dataLength = bytes;
+      socket->sendOffset = offset + bytes;
+      if(socket->sendOffset >= socket->mss)
+         IPWriteFlush(socket);
+      count += bytes;
+      buf += bytes;
+      length -= bytes;
+   }
+   return count;
+}
+
+
 uint32 IPRead(IPSocket *socket, uint8 *buf, uint32 length)
 {
    IPFrame *frame, *frame2;
@@ -1539,7 +2286,7 @@ uint32 IPRead(IPSocket *socket, uint8 *buf, uint32 length)
          FrameRemove(&socket->frameReadHead, &socket->frameReadTail, frame2);
          socket->ackProcessed += frame2->length - offset;
          if(socket->state == IP_TCP &&
-            socket->ack - socket->ackProcessed > RECEIVE_WINDOW - 2048)
+            (int)(socket->ack - socket->ackProcessed) > Config.receiveWindow - 2 * socket->mss)
          {
             //Update receive window for flow control
             frame2->packet[TCP_FLAGS] = TCP_FLAGS_ACK;
@@ -1569,22 +2316,20 @@ static void IPClose2(IPSocket *socket)
       frame = frame->next;
       if(framePrev->socket == socket)
       {
-         FrameRemove(&FrameResendHead, &FrameResendTail, framePrev);
+         FrameRemove(&FrameSendHead, &FrameSendTail, framePrev);
          FrameFree(framePrev);
       }
    }
 
    //Remove packets from retransmision list
-   for(frame = FrameResendHead; frame; )
+   for(frame = socket->frameResendHead; frame; )
    {
       framePrev = frame;
       frame = frame->next;
-      if(framePrev->socket == socket)
-      {
-         FrameRemove(&FrameResendHead, &FrameResendTail, framePrev);
-         FrameFree(framePrev);
-      }
+      FrameResendRemove(framePrev);
+      FrameFree(framePrev);
    }
+   OS_WheelStop(&FrameWheel, &socket->resendNode);
 
    //Remove packets from socket read linked list
    for(frame = socket->frameReadHead; frame; )
@@ -1604,8 +2349,11 @@ static void IPClose2(IPSocket *socket)
       FrameFree(framePrev);
    }
 
+   //Stop accepting new connections and datagrams
+   SocketHashRemove(socket, SOCKET_PORT);
+
    //Give application time to stop using socket
-   socket->timeout = SOCKET_TIMEOUT;
+   IPSocketTimeout(socket, SOCKET_TIMEOUT);
    socket->state = IP_CLOSED;
 
    OS_MutexPost(IPMutex);
@@ -1630,8 +2378,8 @@ void IPClose(IPSocket *socket)
    frameOut->packet[TCP_FLAGS] = TCP_FLAGS_FIN | TCP_FLAGS_ACK;
    TCPSendPacket(socket, frameOut, TCP_DATA);
    ++socket->seq;
-   socket->timeout = SOCKET_TIMEOUT;
    socket->timeoutReset = SOCKET_TIMEOUT;
+   IPSocketTimeout(socket, SOCKET_TIMEOUT);
    socket->state = IP_FIN_SERVER;
 }
 
@@ -1661,10 +2409,10 @@ int IPPrintf(IPSocket *socket, char *format,
 
 void IPTick(void)
 {
-   IPFrame *frame, *frame2;
-   IPSocket *socket, *socket2;
+   IPFrame *frame, *frameNext;
+   IPSocket *socket;
    unsigned long ticks;
-   static unsigned long ticksPrev=0, ticksPrev2=0;
+   static unsigned long ticksPrev=0;
 
    ticks = OS_ThreadTime();
 #ifdef WIN32
@@ -1674,7 +2422,7 @@ void IPTick(void)
    {
       if(IPVerbose && (Seconds % 60) == 0)
       {
-         if(FrameFreeCount >= FRAME_COUNT-1)
+         if(FrameFreeCount >= FrameCount-1)
             printf("T");
          else
             printf("T(%d)", FrameFreeCount);
@@ -1686,61 +2434,82 @@ void IPTick(void)
 
    OS_MutexPend(IPMutex);
 
-   //Retransmit timeout packets
-   for(frame = FrameResendTail; frame; )
+   //Retransmit the frames of sockets whose timer expired.  They were
+   //sent close together so resend them all and let the peer's SACK
+   //blocks be rebuilt.
+   for(;;)
    {
-      frame2 = frame->prev;
-      frame->timeout = (short)(frame->timeout - (ticks - ticksPrev2));
-      if(--frame->timeout <= 0)
+      socket = (IPSocket*)OS_WheelExpired(&FrameWheel, ticks);
+      if(socket == NULL)
+         break;
+      frame = socket->frameResendHead;
+      socket->frameResendHead = NULL;
+      socket->frameResendTail = NULL;
+      for(; frame; frame = frameNext)
       {
+         frameNext = frame->next;
          if(IPVerbose)
-            printf("r" /*"(%x,%x,%d,%d,%d)"*/, (int)frame, (int)frame->socket, 
-               frame->retryCnt, frame->length - TCP_DATA,
-               frame->socket->state);
-         FrameRemove(&FrameResendHead, &FrameResendTail, frame);
-         if(frame->retryCnt < 5 && frame->socket->state < IP_CLOSED)
+            printf("r" /*"(%x,%x,%d,%d,%d)"*/, (int)frame, (int)socket, 
+               frame->retryCnt, frame->length - TCP_DATA, socket->state);
+         frame->state = FRAME_ACQUIRED;
+         frame->next = NULL;
+         frame->prev = NULL;
+         frame->sack = FRAME_RESENT;
+         if(frame->retryCnt < 5 && socket->state < IP_CLOSED)
             IPSendFrame(frame);
          else 
          {
-            if(frame->socket->state == IP_TCP)
-               IPClose(frame->socket);
+            if(socket->state == IP_TCP)
+               IPClose(socket);
             FrameFree(frame);
          }
       }
-      frame = frame2;
    }
 
    if(ticks - ticksPrev >= 95)
    {
       //Close timed out sockets
-      for(socket = SocketHead; socket; )
+      for(;;)
       {
-         socket2 = socket;
-         socket = socket->next;
-         if(socket2->timeout && --socket2->timeout == 0)
+         socket = (IPSocket*)OS_WheelExpired(&SocketWheel, Seconds);
+         if(socket == NULL)
+            break;
+         if(socket->state <= IP_TCP || socket->state == IP_FIN_CLIENT)
          {
-            socket2->timeout = SOCKET_TIMEOUT;
-            if(socket2->state <= IP_TCP || socket2->state == IP_FIN_CLIENT)
-               IPClose(socket2);
-            else if(socket2->state != IP_CLOSED)
-               IPClose2(socket2);
+            IPSocketTimeout(socket, SOCKET_TIMEOUT);
+            IPClose(socket);
+         }
+         else if(socket->state != IP_CLOSED)
+         {
+            IPSocketTimeout(socket, SOCKET_TIMEOUT);
+            IPClose2(socket);
+         }
+         else
+         {
+            if(socket->prev == NULL)
+               SocketHead = socket->next;
             else
+               socket->prev->next = socket->next;
+            if(socket->next)
+               socket->next->prev = socket->prev;
+            SocketHashRemove(socket, SOCKET_REMOTE);
+            SocketHashRemove(socket, SOCKET_PORT);
+            OS_WheelStop(&FrameWheel, &socket->resendNode);
+            while(socket->frameResendHead)
             {
-               if(socket2->prev == NULL)
-                  SocketHead = socket2->next;
-               else
-                  socket2->prev->next = socket2->next;
-               if(socket2->next)
-                  socket2->next->prev = socket2->prev;
-               //printf("freeSocket(%x) ", (int)socket2);
-               free(socket2);
+               frame = socket->frameResendHead;
+               FrameResendRemove(frame);
+               FrameFree(frame);
             }
+            if(socket->freeFunc)
+               socket->freeFunc(socket);
+            //printf("freeSocket(%x) ", (int)socket);
+            free(socket);
          }
       }
       ticksPrev = ticks;
    }
    OS_MutexPost(IPMutex);
-   ticksPrev2 = ticks;
 }
 
 
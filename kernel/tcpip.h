@@ -11,15 +11,22 @@
  *--------------------------------------------------------------------*/
 #ifndef __TCPIP_H__
 #define __TCPIP_H__
-#define PACKET_SIZE           600
-#define FRAME_COUNT           100
+#ifndef PACKET_SIZE
+#define PACKET_SIZE           1520     //largest frame, sets memory per frame
+#endif
+#define FRAME_COUNT           64
+#define FRAME_POOL_SIZE       (128*1024) //limits IPConfig_t frameCount
 #define FRAME_COUNT_SYNC      15
 #define FRAME_COUNT_SEND      10
 #define FRAME_COUNT_RCV       5
-#define RETRANSMIT_TIME       60
+#define RETRANSMIT_TIME       60       //ticks before the first RTT sample
+#define RETRANSMIT_MIN        20
+#define RETRANSMIT_MAX        1000
 #define SOCKET_TIMEOUT        10
-#define SEND_WINDOW           7000
-#define RECEIVE_WINDOW        (536*10)
+#define SOCKET_HASH_SIZE      32       //power of 2
+#define TCP_MSS               1460
+#define SEND_WINDOW           (TCP_MSS*10)
+#define RECEIVE_WINDOW        (TCP_MSS*10)
 
 typedef enum IPMode_e {
    IP_MODE_UDP,
@@ -38,8 +45,19 @@ typedef enum IPState_e {
    IP_CLOSED
 } IPState_e;
 
+//Defaults above, changed with IPConfigure()
+typedef struct {
+   int frameSize;                //largest Ethernet frame <= PACKET_SIZE
+   int frameCount;               //frames allocated by IPInit()
+   int mss;                      //TCP maximum segment size
+   int sendWindow;               //bytes in flight before IPWrite() waits
+   int receiveWindow;            //scaled above 64KB (RFC 7323)
+} IPConfig_t;
+
 typedef struct IPSocket IPSocket;
 typedef void (*IPSendFuncPtr)(uint8 *packet, int length);
+typedef void (*IPGatherFuncPtr)(uint8 *packet, int length, 
+                                const uint8 *data, int dataLength);
 typedef void (*IPSockFuncPtr)(IPSocket *sock);
 typedef void (*IPCallbackPtr)(IPSocket *sock, uint8 *buf, int bytes); 
 
@@ -49,22 +67,34 @@ typedef struct IPFrame {
    struct IPSocket *socket;
    uint32 seqEnd;
    uint16 length;
-   short  timeout;
    uint8 state, retryCnt;
-   uint8 pad1, pad2;
+   uint32 timeSent;              //RTT sample if ACK'ed before a resend
+   uint8 sack, pad2;             //FRAME_SACKED or FRAME_RESENT
+   const uint8 *data;            //IPWriteConst() payload after the packet
+   int dataLength;               //bytes of data included in length
 } IPFrame;
 
 struct IPSocket {
    struct IPSocket *next, *prev;
+   struct IPSocket *hashNext[2];  //SocketHash[] chains
    IPState_e state;
    uint32 seq;
    uint32 seqReceived;
-   uint32 seqWindow;
+   uint32 seqWindow;             //peer's receive window in bytes
    uint32 ack;
    uint32 ackProcessed;
-   uint32 timeout;
+   uint32 timeout;               //Seconds of inactivity before closing
    uint32 timeoutReset;
+   OS_WheelNode_t timeoutNode;
    int resentDone;
+   int mss;                      //largest TCP payload to send
+   uint8 shiftSend, shiftRcv;    //window scale of the peer and ours
+   uint8 sackOk, dupAcks;
+   uint8 ackPending, batchFlags; //segments not ACK'ed yet; work for IPBatchEnd()
+   struct IPSocket *batchNext;
+   uint32 recover;               //seq when fast recovery started
+   uint32 sackHigh;              //highest seq SACK'ed by the peer
+   int srtt, rttvar, rto;        //RFC 6298 ticks; srtt*8 and rttvar*4
    int dontFlush;
    uint8 headerSend[38];
    uint8 headerRcv[38];
@@ -72,12 +102,16 @@ struct IPSocket {
    struct IPFrame *frameReadTail;
    struct IPFrame *frameFutureHead;
    struct IPFrame *frameFutureTail;
+   struct IPFrame *frameResendHead;  //Sent but not ACK'ed in seq order
+   struct IPFrame *frameResendTail;
+   OS_WheelNode_t resendNode;    //Retransmit timeout of frameResendHead
    int readOffset;
    struct IPFrame *frameSend;
    int sendOffset;
    void *fileOut;
    void *fileIn;
    IPSockFuncPtr funcPtr;
+   IPSockFuncPtr freeFunc;       //Releases userPtr before the socket is freed
    IPCallbackPtr userFunc;
    void *userPtr;
    void *userPtr2;
@@ -91,16 +125,24 @@ void EthernetSendPacket(const unsigned char *packet, int length); //Windows
 void EthernetInit(unsigned char MacAddress[6]);
 int EthernetReceive(unsigned char *buffer, int length);
 void EthernetTransmit(unsigned char *buffer, int length);
+void EthernetTransmitGather(unsigned char *buffer, int length, 
+                            const unsigned char *data, int dataLength);
 
 //tcpip.c
+void IPConfigure(IPConfig_t *config);
 void IPInit(IPSendFuncPtr frameSendFunction, uint8 macAddress[6], char name[6]);
+void IPInitGather(IPGatherFuncPtr frameGatherFunction);
 IPFrame *IPFrameGet(int freeCount);
 int IPProcessEthernetPacket(IPFrame *frameIn, int length);
+void IPBatchBegin(void);
+void IPBatchEnd(void);
 void IPTick(void);
+int IPChecksum(int checksum, const unsigned char *data, int length);
 
 IPSocket *IPOpen(IPMode_e mode, uint32 ipAddress, uint32 port, IPSockFuncPtr funcPtr);
 void IPWriteFlush(IPSocket *socket);
 uint32 IPWrite(IPSocket *socket, const uint8 *buf, uint32 length);
+uint32 IPWriteConst(IPSocket *socket, const uint8 *buf, uint32 length);
 uint32 IPRead(IPSocket *socket, uint8 *buf, uint32 length);
 void IPClose(IPSocket *socket);
 #ifdef INSIDE_TCPIP
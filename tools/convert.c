@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "elf.h"
 
 #define BUF_SIZE (1024*1024*4) 
 /*Assumes running on PC little endian*/
@@ -16,69 +17,10 @@
 #define ntohs(A) A
 #endif
 
-#define EI_NIDENT 16
-#define SHT_PROGBITS 1
-#define SHT_STRTAB 3
-#define SHT_NOBITS 8
-
 typedef unsigned int   uint32;
 typedef unsigned short uint16;
 typedef unsigned char  uint8;
 
-typedef struct
-{
-   uint8 e_ident[EI_NIDENT];
-   uint16 e_e_type;
-   uint16 e_machine;
-   uint32 e_version;
-   uint32 e_entry;
-   uint32 e_phoff;
-   uint32 e_shoff;
-   uint32 e_flags;
-   uint16 e_ehsize;
-   uint16 e_phentsize;
-   uint16 e_phnum;
-   uint16 e_shentsize;
-   uint16 e_shnum;
-   uint16 e_shstrndx;
-} ElfHeader;
-
-typedef struct
-{
-   uint32 p_type;
-   uint32 p_offset;
-   uint32 p_vaddr;
-   uint32 p_paddr;
-   uint32 p_filesz;
-   uint32 p_memsz;
-   uint32 p_flags;
-   uint32 p_align;
-} Elf32_Phdr;
-
-typedef struct
-{
-   uint32 sh_name;
-   uint32 sh_type;
-   uint32 sh_flags;
-   uint32 sh_addr;
-   uint32 sh_offset;
-   uint32 sh_size;
-   uint32 sh_link;
-   uint32 sh_info;
-   uint32 sh_addralign;
-   uint32 sh_entsize;
-} Elf32_Shdr;
-
-typedef struct 
-{
-   uint32 ri_gprmask;
-   uint32 ri_cprmask[4];
-   uint32 ri_gp_value;
-} ELF_RegInfo;
-
-#define PT_MIPS_REGINFO  0x70000000
-#define SHT_MIPS_REGINFO 0x70000006
-
 void set_low(uint8 *ptr, uint32 address, uint32 value)
 {
    uint32 opcode;
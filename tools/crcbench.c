@@ -0,0 +1,220 @@
+/***********************************************************
+| crcbench
+| Compares the Ethernet CRC32 in kernel/ethernet.c with the
+| byte at a time CRC it replaced.  Both produce the nibble
+| swapped bytes the PHY sends, so the output of the new code
+| is checked against the old code before it is timed.
+|    crcbench [frames]
+| The new code is the CRC32 section of ethernet.c itself;
+| build with -DCRC_SLICE=8 to time slicing-by-8.
+************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef unsigned int uint32;
+
+#define FRAME_SIZE 1514
+#define FRAME_MAX  (FRAME_SIZE + 16)
+
+/********** Old: one byte per table lookup with reflect[] **********/
+#define OLD_POLYNOMIAL 0x04C11DB7
+#define TOPBIT         (1<<31)
+static unsigned int OldCrcTable[256];
+static unsigned char reflect[256];
+static unsigned char reflectNibble[256];
+
+static unsigned int Reflect(unsigned int value, int bits)
+{
+   unsigned int num=0;
+   int i;
+   for(i = 0; i < bits; ++i)
+   {
+      num = (num << 1) | (value & 1);
+      value >>= 1;
+   }
+   return num;
+}
+
+static void OldCrcInit(void)
+{
+   unsigned int remainder;
+   int dividend, bit, i;
+
+   for(dividend = 0; dividend < 256; ++dividend)
+   {
+      remainder = dividend << 24;
+      for(bit = 8; bit > 0; --bit)
+      {
+         if(remainder & TOPBIT)
+            remainder = (remainder << 1) ^ OLD_POLYNOMIAL;
+         else
+            remainder = remainder << 1;
+      }
+      OldCrcTable[dividend] = remainder;
+   }
+   for(i = 0; i < 256; ++i)
+   {
+      reflect[i] = (unsigned char)Reflect(i, 8);
+      reflectNibble[i] = (unsigned char)((Reflect((i >> 4) ^ 0xf, 4) << 4) |
+         Reflect(i ^ 0xf, 4));
+   }
+}
+
+//EthernetTransmit(): swap nibbles and append the CRC
+static void OldTransmit(const unsigned char *buffer, int length, unsigned char *buf)
+{
+   int i, byte, shift;
+   uint32 crc;
+
+   crc = 0xffffffff;
+   for(i = 0; i < length; ++i)
+   {
+      byte = buffer[i];
+      buf[i] = (unsigned char)((byte << 4) | (byte >> 4));
+      byte = reflect[byte] ^ (crc >> 24);
+      crc = OldCrcTable[byte] ^ (crc << 8);
+   }
+   for(i = 0; i < 4; ++i)
+   {
+      shift = 24 - (i << 3);
+      buf[length + i] = (unsigned char)reflectNibble[(crc >> shift) & 0xff];
+   }
+}
+
+//EthernetReceive(): copy and check for the CRC after every byte
+static int OldReceive(const unsigned char *buf, unsigned char *buffer, int length)
+{
+   int count, i, shift, byte;
+   uint32 crc = 0xffffffff;
+
+   for(count = 0; count < length; )
+   {
+      byte = buf[count];
+      byte = ((byte << 4) & 0xf0) | (byte >> 4);
+      buffer[count++] = (unsigned char)byte;
+      byte = reflect[byte] ^ (crc >> 24);
+      crc = OldCrcTable[byte] ^ (crc << 8);
+      if(count >= 40 && reflectNibble[crc >> 24] == buf[count])
+      {
+         for(i = 1; i < 4; ++i)
+         {
+            shift = 24 - (i << 3);
+            if(reflectNibble[(crc >> shift) & 0xff] != buf[count + i])
+               break;
+         }
+         if(i == 4)
+            return count;
+      }
+   }
+   return -1;
+}
+
+/********** New: the CRC32 section of kernel/ethernet.c **********/
+#define ETHERNET_CRC_ONLY
+#include "../kernel/ethernet.c"
+
+//EthernetTransmitGather() with length a multiple of 4
+static void NewTransmit(const unsigned char *buffer, int length, unsigned char *buf)
+{
+   int i;
+   uint32 crc;
+
+   crc = ~EthernetSwapCopy(buf, buffer, length, 0xffffffff);
+   for(i = 0; i < 4; ++i)
+      buf[length + i] = (unsigned char)(crc >> (i << 3));
+}
+
+//EthernetReceive() with the length known from the header
+static int NewReceive(const unsigned char *ptr, unsigned char *buffer, int length)
+{
+   uint32 crc, fcs;
+
+   crc = EthernetSwapRead(buffer, ptr, length, 0xffffffff);
+   fcs = ptr[length] | ptr[length+1] << 8 | ptr[length+2] << 16 |
+      (uint32)ptr[length+3] << 24;
+   return (crc ^ fcs) == 0xffffffff ? length : -1;
+}
+
+/******************************************************************/
+static double Seconds(clock_t start)
+{
+   return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char *argv[])
+{
+   int frames = argc > 1 ? atoi(argv[1]) : 100000;
+   int count = 64, i, j, length[64], rc = 0;
+   unsigned char *data, *wire, *wire2, buffer[FRAME_MAX];
+   double seconds[2][2];
+   clock_t start;
+   long bytes = 0;
+   volatile int sink = 0;
+
+   OldCrcInit();
+   CrcInit();
+   data = (unsigned char*)malloc(count * FRAME_MAX);
+   wire = (unsigned char*)malloc(count * FRAME_MAX);
+   wire2 = (unsigned char*)malloc(count * FRAME_MAX);
+   srand(1);
+   for(i = 0; i < count; ++i)
+   {
+      length[i] = (60 + rand() % (FRAME_SIZE - 60 + 1)) & ~3;
+      for(j = 0; j < FRAME_MAX; ++j)
+         data[i * FRAME_MAX + j] = (unsigned char)rand();
+   }
+
+   //The new code must put the same bytes on the wire and accept them
+   for(i = 0; i < count; ++i)
+   {
+      OldTransmit(data + i * FRAME_MAX, length[i], wire + i * FRAME_MAX);
+      NewTransmit(data + i * FRAME_MAX, length[i], wire2 + i * FRAME_MAX);
+      if(memcmp(wire + i * FRAME_MAX, wire2 + i * FRAME_MAX, length[i] + 4))
+      {
+         printf("Transmit differs for frame %d\n", i);
+         rc = 1;
+      }
+      if(NewReceive(wire + i * FRAME_MAX, buffer, length[i]) != length[i] ||
+         memcmp(buffer, data + i * FRAME_MAX, length[i]))
+      {
+         printf("Receive failed for frame %d\n", i);
+         rc = 1;
+      }
+      if(OldReceive(wire + i * FRAME_MAX, buffer, FRAME_MAX) != length[i])
+         printf("Old receive ended frame %d early\n", i);
+   }
+
+   for(i = 0; i < frames; ++i)
+      bytes += length[i % count];
+   start = clock();
+   for(i = 0; i < frames; ++i)
+      OldTransmit(data + i % count * FRAME_MAX, length[i % count], wire2);
+   seconds[0][0] = Seconds(start);
+   start = clock();
+   for(i = 0; i < frames; ++i)
+      NewTransmit(data + i % count * FRAME_MAX, length[i % count], wire2);
+   seconds[0][1] = Seconds(start);
+   start = clock();
+   for(i = 0; i < frames; ++i)
+      sink += OldReceive(wire + i % count * FRAME_MAX, buffer, FRAME_MAX);
+   seconds[1][0] = Seconds(start);
+   start = clock();
+   for(i = 0; i < frames; ++i)
+      sink += NewReceive(wire + i % count * FRAME_MAX, buffer, length[i % count]);
+   seconds[1][1] = Seconds(start);
+
+   printf("%d frames, %ld bytes\n", frames, bytes);
+   for(j = 0; j < 2; ++j)
+   {
+      printf("%-7s transmit %8.1f MB/s  receive %8.1f MB/s\n", 
+         j ? "slice" : "byte",
+         seconds[0][j] > 0 ? bytes / seconds[0][j] / 1e6 : 0.0,
+         seconds[1][j] > 0 ? bytes / seconds[1][j] / 1e6 : 0.0);
+   }
+   if(seconds[0][1] > 0 && seconds[1][1] > 0)
+      printf("CRC_SLICE=%d speedup: transmit %.1fx  receive %.1fx\n", CRC_SLICE,
+         seconds[0][0] / seconds[0][1], seconds[1][0] / seconds[1][1]);
+   return rc;
+}
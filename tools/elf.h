@@ -0,0 +1,85 @@
+/*--------------------------------------------------------------------
+ * TITLE: ELF file structures
+ * AUTHOR: Steve Rhoads (rhoadss@yahoo.com)
+ * DATE CREATED: 4/26/01
+ * FILENAME: elf.h
+ * PROJECT: Plasma CPU core
+ * COPYRIGHT: Software placed into the public domain by the author.
+ *    Software 'as is' without warranty.  Author liable for nothing.
+ * DESCRIPTION:
+ *    The 32-bit ELF structures read by convert.c and mlite.c.
+ *    Fields are stored big endian; the readers byte swap them.
+ *--------------------------------------------------------------------*/
+#ifndef __ELF_H__
+#define __ELF_H__
+
+#define EI_NIDENT 16
+#define SHT_PROGBITS 1
+#define SHT_SYMTAB 2
+#define SHT_STRTAB 3
+#define SHT_NOBITS 8
+#define PT_MIPS_REGINFO  0x70000000
+#define SHT_MIPS_REGINFO 0x70000006
+
+typedef struct
+{
+   unsigned char e_ident[EI_NIDENT];
+   unsigned short e_e_type;
+   unsigned short e_machine;
+   unsigned int e_version;
+   unsigned int e_entry;
+   unsigned int e_phoff;
+   unsigned int e_shoff;
+   unsigned int e_flags;
+   unsigned short e_ehsize;
+   unsigned short e_phentsize;
+   unsigned short e_phnum;
+   unsigned short e_shentsize;
+   unsigned short e_shnum;
+   unsigned short e_shstrndx;
+} ElfHeader;
+
+typedef struct
+{
+   unsigned int p_type;
+   unsigned int p_offset;
+   unsigned int p_vaddr;
+   unsigned int p_paddr;
+   unsigned int p_filesz;
+   unsigned int p_memsz;
+   unsigned int p_flags;
+   unsigned int p_align;
+} Elf32_Phdr;
+
+typedef struct
+{
+   unsigned int sh_name;
+   unsigned int sh_type;
+   unsigned int sh_flags;
+   unsigned int sh_addr;
+   unsigned int sh_offset;
+   unsigned int sh_size;
+   unsigned int sh_link;
+   unsigned int sh_info;
+   unsigned int sh_addralign;
+   unsigned int sh_entsize;
+} Elf32_Shdr;
+
+typedef struct
+{
+   unsigned int st_name;
+   unsigned int st_value;
+   unsigned int st_size;
+   unsigned char st_info;
+   unsigned char st_other;
+   unsigned short st_shndx;
+} Elf32_Sym;
+
+typedef struct
+{
+   unsigned int ri_gprmask;
+   unsigned int ri_cprmask[4];
+   unsigned int ri_gp_value;
+} ELF_RegInfo;
+
+#endif //__ELF_H__
@@ -58,7 +58,7 @@
 #define ETHERNET_FRAME_TYPE   12       //2      IP=0x0800; ARP=0x0806
 #define IP_PROTOCOL           23       //1      TCP=0x06;PING=0x01;UDP=0x11
 #define IP_SOURCE             26       //4
-#define PACKET_SIZE           600
+#define PACKET_SIZE           1520     //same as kernel/tcpip.h
 
 static const unsigned char ethernetAddressNull[] =    {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 static const unsigned char ethernetAddressPhantom[] = {0x00, 0x10, 0xdd, 0xce, 0x15, 0xd4};
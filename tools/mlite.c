@@ -16,6 +16,9 @@
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <stddef.h>
+#include <time.h>
+#include "elf.h"
 
 //#define ENABLE_CACHE
 #define SIMPLE_CACHE
@@ -31,6 +34,11 @@
 #define putch putchar
 #include <termios.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#if defined(__x86_64__)
+#define ENABLE_JIT
+#endif
 
 void Sleep(unsigned int value)
 { 
@@ -72,6 +80,7 @@ int getch(void)
 extern void __stdcall Sleep(unsigned long value);
 #endif
 
+#define MISC_BASE         0x20000000
 #define UART_WRITE        0x20000000
 #define UART_READ         0x20000000
 #define IRQ_MASK          0x20000010
@@ -80,16 +89,30 @@ extern void __stdcall Sleep(unsigned long value);
 #define MMU_PROCESS_ID    0x20000080
 #define MMU_FAULT_ADDR    0x20000090
 #define MMU_TLB           0x200000a0
+#define CPU_INDEX_REG     0x20000100
+#define CPU_STACK_REG     0x20000110
+#define CPU_START_REG     0x20000120
+#define ETHERNET_TRANSMIT 0x13fe0000
+#define ETHERNET_DESC_REG 0x20000130
+#define ETHERNET_DESC_COUNT   8
+#define ETHERNET_DESC_DONE    0x80000000
+#define ETHERNET_DESC_ERROR   0x40000000
+#define ETHERNET_DESC_LENGTH  0x0000ffff
 
 #define IRQ_UART_READ_AVAILABLE  0x001
 #define IRQ_UART_WRITE_AVAILABLE 0x002
 #define IRQ_COUNTER18_NOT        0x004
 #define IRQ_COUNTER18            0x008
+#define IRQ_ETHERNET_RECEIVE     0x010
+#define IRQ_ETHERNET_TRANSMIT    0x020
 #define IRQ_MMU                  0x200
 
 #define MMU_ENTRIES 4
 #define MMU_MASK (1024*4-1)
 
+#define PAGE_SHIFT 12
+#define PAGE_MASK  (1024*4-1)
+
 typedef struct
 {
    unsigned int virtualAddress;
@@ -112,8 +135,19 @@ typedef struct {
    int wakeup;
    int big_endian;
    MmuEntry mmuEntry[MMU_ENTRIES];
+   int cpuIndex;
+   int irqMask;
+   volatile int halted;        //SMP: waiting for CPU_START_REG
 } State;
 
+typedef struct {
+   unsigned int opcode;
+   unsigned int imm, target;
+   int imm_shift;
+   unsigned char op, rs, rt, rd, re, func;
+   unsigned char fast;          //FAST_ kind for block_fast() or FAST_NONE
+} Decoded;
+
 static char *opcode_string[]={
    "SPECIAL","REGIMM","J","JAL","BEQ","BNE","BLEZ","BGTZ",
    "ADDI","ADDIU","SLTI","SLTIU","ANDI","ORI","XORI","LUI",
@@ -145,39 +179,103 @@ static char *regimm_string[]={
 
 static unsigned int HWMemory[8];
 
+/************* Batch mode *************/
+//"-batch" runs without the debugger until BREAK, "SYSCALL n" with n != 0,
+//the -stop PC or the -max opcode budget.  BREAK and SYSCALL exit with $a0.
+#define EXIT_BUDGET 124              //-max opcodes executed
+#define EXIT_ERROR  125              //unknown opcode or SYNC
+static int batchMode;
+static int batchExit = -1;
+static unsigned int batchStop = 1;   //never a valid word aligned PC
+static unsigned long long batchBudget;
+static FILE *uartFile;
+
+/************* Symmetric multiprocessing *************/
+//With "-smp N" there are N cores sharing s->mem.  Core 0 boots the image;
+//the others are halted until the OS writes a stack pointer to CPU_STACK_REG
+//and an entry PC to CPU_START_REG.  Each core has its own CPU_INDEX_REG,
+//IRQ_MASK and interrupt delivery.
+#define CPU_COUNT_MAX 16
+static State *cpuState[CPU_COUNT_MAX];
+static int cpuCount = 1;
+static int cpuQuantum = 100;         //opcodes per core per turn
+static int cpuStackNext;
+#ifndef WIN32
+static int cpuThreads;               //run each core on a host thread
+static volatile int cpuStop;
+static pthread_mutex_t cpuMutex = PTHREAD_MUTEX_INITIALIZER;
+#define MMIO_LOCK()   if(cpuThreads) pthread_mutex_lock(&cpuMutex)
+#define MMIO_UNLOCK() if(cpuThreads) pthread_mutex_unlock(&cpuMutex)
+#else
+#define cpuThreads 0
+#define MMIO_LOCK()
+#define MMIO_UNLOCK()
+#endif
+
+/************* Predecoded basic block cache *************/
+//Straight-line code is decoded once into a block indexed by its first PC.
+//A block ends after a branch delay slot or at a 4KB page boundary so that
+//a store into a code page only needs to drop the blocks of that page.
+//block_fast() runs the plain opcodes of a block from a switch on the
+//predecoded kind; the rest go through execute().
+#define BLOCK_OPCODES     32
+#define BLOCK_TABLE_SIZE  4096
+#define BLOCK_EMPTY       1            //never a valid word aligned PC
+#define BLOCK_CHAIN       256          //opcodes block_run() chains per call
 
-static int mem_read(State *s, int size, unsigned int address)
+typedef struct {
+   unsigned int pc;
+   unsigned int page;                  //(offset into s->mem) >> PAGE_SHIFT
+   int count;
+   int hits;
+   int (*native)(State *s);            //translated host code or NULL;
+                                       //returns the opcodes executed
+   int fastCount;                      //leading opcodes block_fast() runs
+   Decoded opcode[BLOCK_OPCODES];
+} Block;
+
+static Block *blockTable;
+static unsigned char blockCodePage[MEM_SIZE >> PAGE_SHIFT];
+static int blockFlushed;
+static int blockEnable;
+
+//Drop every cached block decoded from this memory page
+static void block_invalidate(unsigned int page)
 {
-   unsigned int value=0;
-   unsigned char *ptr;
-
-   s->irqStatus |= IRQ_UART_WRITE_AVAILABLE;
-   switch(address)
+   int i;
+   for(i = 0; i < BLOCK_TABLE_SIZE; ++i)
    {
-      case UART_READ: 
-         if(kbhit())
-            HWMemory[0] = getch();
-         s->irqStatus &= ~IRQ_UART_READ_AVAILABLE; //clear bit
-         return HWMemory[0];
-      case IRQ_MASK: 
-         return HWMemory[1];
-      case IRQ_MASK + 4:
-         Sleep(10);
-         return 0;
-      case IRQ_STATUS: 
-         if(kbhit())
-            s->irqStatus |= IRQ_UART_READ_AVAILABLE;
-         return s->irqStatus;
-      case MMU_PROCESS_ID:
-         return s->processId;
-      case MMU_FAULT_ADDR:
-         return s->faultAddr;
+      if(blockTable[i].pc != BLOCK_EMPTY && blockTable[i].page == page)
+         blockTable[i].pc = BLOCK_EMPTY;
    }
+   blockCodePage[page] = 0;
+   blockFlushed = 1;
+}
+
+
+/************* Memory map *************/
+//Each 4KB page of the 32-bit address space has a host pointer into s->mem.
+//Pages with device registers have a NULL entry and go to mmio_read() or
+//mmio_write(), so a RAM access is one table lookup plus a native load.
+static unsigned char *pageTable[1 << (32 - PAGE_SHIFT)];
+
+static void page_init(State *s)
+{
+   unsigned int page, address;
 
-   ptr = s->mem + (address % MEM_SIZE);
+   for(page = 0; page < (1 << (32 - PAGE_SHIFT)); ++page)
+   {
+      address = page << PAGE_SHIFT;
+      pageTable[page] = s->mem + (address % MEM_SIZE);
+      if(0x10000000 <= address && address < 0x10000000 + 1024*1024)
+         pageTable[page] += 1024*1024;
+   }
+   pageTable[MISC_BASE >> PAGE_SHIFT] = NULL;  //UART, IRQ and MMU registers
+}
 
-   if(0x10000000 <= address && address < 0x10000000 + 1024*1024)
-      ptr += 1024*1024;
+static unsigned int ram_read(State *s, int size, unsigned char *ptr, unsigned int address)
+{
+   unsigned int value=0;
 
    switch(size) 
    {
@@ -204,28 +302,302 @@ static int mem_read(State *s, int size, unsigned int address)
    return(value);
 }
 
-static void mem_write(State *s, int size, int unsigned address, unsigned int value)
+static void ram_write(State *s, int size, unsigned char *ptr, unsigned int address, unsigned int value)
+{
+   if(blockCodePage[(ptr - s->mem) >> PAGE_SHIFT])
+      block_invalidate((ptr - s->mem) >> PAGE_SHIFT);  //self-modifying code
+
+   switch(size) 
+   {
+      case 4: 
+         assert((address & 3) == 0);
+         if(s->big_endian) 
+            value = htonl(value);
+         *(int*)ptr = value;
+         break;
+      case 2:
+         assert((address & 1) == 0);
+         if(s->big_endian) 
+            value = htons((unsigned short)value);
+         *(short*)ptr = (unsigned short)value; 
+         break;
+      case 1:
+         *(char*)ptr = (unsigned char)value; 
+         break;
+      default: 
+         printf("ERROR");
+   }
+#ifndef WIN32
+   if(cpuThreads)
+      __sync_synchronize();  //keep stores and later loads in program order
+#endif
+}
+
+//The idle thread reads IRQ_MASK+4 to sleep one tick.  A tickless kernel
+//first writes the number of ticks until its next timeout; the read then
+//sleeps up to that many ticks (none in batch mode), stopping early on a
+//key press, and returns the number of ticks slept.
+static unsigned int idleTicks;
+
+static unsigned int idle_sleep(void)
+{
+   unsigned int ticks = idleTicks, count;
+
+   idleTicks = 0;
+   if(ticks == 0)
+   {
+      if(batchMode == 0)
+         Sleep(10);
+      return 0;
+   }
+   if(batchMode)
+      return ticks;
+   for(count = 1; ; ++count)
+   {
+      Sleep(10);
+      if(count >= ticks || kbhit())
+         break;
+   }
+   return count;
+}
+
+/************* Ethernet DMA *************/
+//Models eth_dma with receive descriptors (see plasma.h).  "-ethrx file"
+//replays the frames of a pcap capture into the descriptor ring the
+//kernel wrote to ETHERNET_DESC_REG, filling free descriptors whenever
+//core 0 polls IRQ_STATUS.  "-ethtx file" saves transmitted frames as a
+//pcap capture.
+static FILE *ethRxFile, *ethTxFile;
+static void cache_snoop(unsigned int address);
+static int ethSwap;                   //capture has the other byte order
+static unsigned int ethDesc;          //descriptor ring or 0
+static int ethDescNext;
+static unsigned char ethFrame[0x10000];
+static int ethFrameLength;
+
+static unsigned int eth_swap(unsigned int value)
+{
+   if(ethSwap == 0)
+      return value;
+   return (value >> 24) | ((value >> 8) & 0xff00) | 
+      ((value << 8) & 0xff0000) | (value << 24);
+}
+
+static FILE *eth_open(const char *name, int write)
+{
+   unsigned int header[6] = {0xa1b2c3d4, 0x00040002, 0, 0, 0xffff, 1};
+   FILE *file = fopen(name, write ? "wb" : "rb");
+
+   if(file == NULL)
+      return NULL;
+   if(write)
+      fwrite(header, 4, 6, file);
+   else if(fread(header, 4, 6, file) != 6 ||
+           (header[0] != 0xa1b2c3d4 && header[0] != 0xd4c3b2a1))
+   {
+      printf("%s is not a pcap file\n", name);
+      fclose(file);
+      return NULL;
+   }
+   else
+      ethSwap = header[0] == 0xd4c3b2a1;
+   return file;
+}
+
+//Read the next frame of the capture into ethFrame
+static int eth_read(void)
+{
+   unsigned int record[4], length;
+
+   if(fread(record, 4, 4, ethRxFile) != 4)
+      return 0;
+   length = eth_swap(record[2]);
+   if(length > sizeof(ethFrame) || 
+      fread(ethFrame, 1, length, ethRxFile) != length)
+      return 0;
+   ethFrameLength = length;
+   return 1;
+}
+
+//Physical address to host pointer with the same mapping as the CPU
+static unsigned char *eth_ptr(State *s, unsigned int address)
+{
+   unsigned char *page = pageTable[address >> PAGE_SHIFT];
+
+   if(page == NULL)
+      return s->mem + (address % MEM_SIZE);
+   return page + (address & PAGE_MASK);
+}
+
+static void eth_receive(State *s)
+{
+   unsigned int address, buffer, status;
+   int i;
+
+   while(ethRxFile && ethDesc)
+   {
+      if(ethFrameLength == 0 && eth_read() == 0)
+      {
+         fclose(ethRxFile);
+         ethRxFile = NULL;
+         return;
+      }
+      address = ethDesc + ethDescNext * 8;
+      buffer = ram_read(s, 4, eth_ptr(s, address), address);
+      status = ram_read(s, 4, eth_ptr(s, address + 4), address + 4);
+      if(status & ETHERNET_DESC_DONE)
+         return;                        //ring full
+      if(ethFrameLength > (int)(status & ETHERNET_DESC_LENGTH))
+         status = ETHERNET_DESC_DONE | ETHERNET_DESC_ERROR;
+      else
+      {
+         for(i = 0; i < ethFrameLength; ++i)
+         {
+            ram_write(s, 1, eth_ptr(s, buffer + i), buffer + i, ethFrame[i]);
+            cache_snoop(buffer + i);
+         }
+         status = ETHERNET_DESC_DONE | ethFrameLength;
+      }
+      ram_write(s, 4, eth_ptr(s, address + 4), address + 4, status);
+      cache_snoop(address + 4);
+      ethDescNext = (ethDescNext + 1) % ETHERNET_DESC_COUNT;
+      ethFrameLength = 0;
+      s->irqStatus |= IRQ_ETHERNET_RECEIVE;
+   }
+}
+
+//EthernetTransmit() writes a preamble, the frame with swapped nibbles
+//and the CRC to ETHERNET_TRANSMIT, then length/4 to ETHERNET_REG
+static void eth_transmit(State *s, unsigned int words)
+{
+   unsigned int record[4];
+   int length = words * 4 - 16, i, byte;
+
+   if(length <= 0 || length > (int)sizeof(ethFrame))
+      return;
+   for(i = 0; i < length; ++i)
+   {
+      byte = *eth_ptr(s, ETHERNET_TRANSMIT + 8 + i);
+      ethFrame[i] = (unsigned char)((byte << 4) | (byte >> 4));
+   }
+   record[0] = (unsigned int)time(NULL);
+   record[1] = 0;
+   record[2] = record[3] = length;
+   fwrite(record, 4, 4, ethTxFile);
+   fwrite(ethFrame, 1, length, ethTxFile);
+   fflush(ethTxFile);
+}
+
+static unsigned int mmio_read_locked(State *s, int size, unsigned int address)
+{
+   s->irqStatus |= IRQ_UART_WRITE_AVAILABLE;
+   switch(address)
+   {
+      case UART_READ: 
+         if(batchMode == 0 && kbhit())
+            HWMemory[0] = getch();
+         s->irqStatus &= ~IRQ_UART_READ_AVAILABLE; //clear bit
+         return HWMemory[0];
+      case IRQ_MASK: 
+         return s->irqMask;
+      case IRQ_MASK + 4:
+         return idle_sleep();
+      case IRQ_STATUS: 
+         if(batchMode == 0 && kbhit())
+            s->irqStatus |= IRQ_UART_READ_AVAILABLE;
+         if(ethTxFile)
+            s->irqStatus |= IRQ_ETHERNET_TRANSMIT;   //transmit idle
+         if(s->cpuIndex == 0)
+            eth_receive(s);
+         return s->irqStatus;
+      case ETHERNET_DESC_REG:
+         s->irqStatus &= ~IRQ_ETHERNET_RECEIVE;
+         return ethDescNext;
+      case MMU_PROCESS_ID:
+         return s->processId;
+      case MMU_FAULT_ADDR:
+         return s->faultAddr;
+      case CPU_INDEX_REG:
+         return s->cpuIndex;
+   }
+   return ram_read(s, size, s->mem + (address % MEM_SIZE), address);
+}
+
+static unsigned int mmio_read(State *s, int size, unsigned int address)
+{
+   unsigned int value;
+   MMIO_LOCK();
+   value = mmio_read_locked(s, size, address);
+   MMIO_UNLOCK();
+   return value;
+}
+
+//Release the next halted core at entry with the stack from CPU_STACK_REG
+static void cpu_start(State *s, unsigned int entry)
+{
+   State *core;
+   int i;
+
+   for(i = 1; i < cpuCount; ++i)
+   {
+      core = cpuState[i];
+      if(core->halted == 0)
+         continue;
+      core->pc = entry;
+      core->pc_next = entry + 4;
+      core->r[28] = s->r[28];            //$gp
+      core->r[29] = cpuStackNext;        //$sp
+      core->r[4] = i;
+#ifndef WIN32
+      __sync_synchronize();
+#endif
+      core->halted = 0;
+      return;
+   }
+}
+
+static void mmio_write_locked(State *s, int size, unsigned int address, unsigned int value)
 {
    unsigned char *ptr;
 
    switch(address)
    {
       case UART_WRITE: 
+         if(uartFile)
+         {
+            fputc(value, uartFile);
+            return;
+         }
          putch(value); 
          fflush(stdout);
          return;
       case IRQ_MASK:   
-         HWMemory[1] = value; 
+         s->irqMask = value; 
+         return;
+      case IRQ_MASK + 4:
+         idleTicks = value;
          return;
       case IRQ_STATUS: 
          s->irqStatus = value; 
          return;
-      case CONFIG_REG:
+      case CONFIG_REG:                  //ETHERNET_REG in plasma.h
+         if(ethTxFile)
+            eth_transmit(s, value);
+         return;
+      case ETHERNET_DESC_REG:
+         ethDesc = value;
+         ethDescNext = 0;
          return;
       case MMU_PROCESS_ID:
          //printf("processId=%d\n", value);
          s->processId = value;
          return;
+      case CPU_STACK_REG:
+         cpuStackNext = value;
+         return;
+      case CPU_START_REG:
+         cpu_start(s, value);
+         return;
    }
 
    if(MMU_TLB <= address && address <= MMU_TLB+MMU_ENTRIES * 8)
@@ -236,32 +608,33 @@ static void mem_write(State *s, int size, int unsigned address, unsigned int val
       s->irqStatus &= ~IRQ_MMU;
       return;
    }
+   ram_write(s, size, s->mem + (address % MEM_SIZE), address, value);
+}
 
-   ptr = s->mem + (address % MEM_SIZE);
+static void mmio_write(State *s, int size, unsigned int address, unsigned int value)
+{
+   MMIO_LOCK();
+   mmio_write_locked(s, size, address, value);
+   MMIO_UNLOCK();
+}
 
-   if(0x10000000 <= address && address < 0x10000000 + 1024*1024)
-      ptr += 1024*1024;
+static int mem_read(State *s, int size, unsigned int address)
+{
+   unsigned char *page = pageTable[address >> PAGE_SHIFT];
 
-   switch(size) 
-   {
-      case 4: 
-         assert((address & 3) == 0);
-         if(s->big_endian) 
-            value = htonl(value);
-         *(int*)ptr = value;
-         break;
-      case 2:
-         assert((address & 1) == 0);
-         if(s->big_endian) 
-            value = htons((unsigned short)value);
-         *(short*)ptr = (unsigned short)value; 
-         break;
-      case 1:
-         *(char*)ptr = (unsigned char)value; 
-         break;
-      default: 
-         printf("ERROR");
-   }
+   if(page == NULL)
+      return mmio_read(s, size, address);
+   return ram_read(s, size, page + (address & PAGE_MASK), address);
+}
+
+static void mem_write(State *s, int size, int unsigned address, unsigned int value)
+{
+   unsigned char *page = pageTable[address >> PAGE_SHIFT];
+
+   if(page == NULL)
+      mmio_write(s, size, address, value);
+   else
+      ram_write(s, size, page + (address & PAGE_MASK), address, value);
 }
 
 #ifdef ENABLE_CACHE
@@ -483,8 +856,8 @@ static int cache_read(State *s, int size, unsigned int address)
    }
 
    offset = address >> 20;
-   if(offset != 0x100 && offset != 0x101)
-      return mem_read(s, size, address);
+   if((offset != 0x100 && offset != 0x101) || cpuCount > 1)
+      return mem_read(s, size, address);  //SMP: one cache model isn't coherent
 
    ++cacheTry;
    offset = (address >> 2) & 0x3ff;
@@ -522,7 +895,7 @@ static void cache_write(State *s, int size, int unsigned address, unsigned int v
    mem_write(s, size, address, value);
 
    offset = address >> 20;
-   if(offset != 0x100 && offset != 0x101)
+   if((offset != 0x100 && offset != 0x101) || cpuCount > 1)
       return;
 
    offset = (address >> 2) & 0x3ff;
@@ -535,8 +908,16 @@ static void cache_write(State *s, int size, int unsigned address, unsigned int v
    cacheData[offset] = value;
 }
 
+//The DMA invalidates the cache lines it writes
+static void cache_snoop(unsigned int address)
+{
+   cacheAddr[(address >> 2) & 0x3ff] = CACHE_MISS;
+}
+
 #define mem_read cache_read
 #define mem_write cache_write
+#else
+static void cache_snoop(unsigned int address) {(void)address;}
 #endif  //SIMPLE_CACHE
 /************* End optional cache implementation *************/
 
@@ -595,45 +976,110 @@ void mult_big_signed(int a,
    *lo = c0;
 }
 
-//execute one cycle of a Plasma CPU
-void cycle(State *s, int show_mode)
+//Opcodes that only change registers or memory, plus the branches.
+//block_fast() runs them back to back without execute()'s pc, delay slot
+//and exception handling.
+enum {FAST_NONE, FAST_NOP, FAST_SLL, FAST_SRL, FAST_SRA, FAST_SLLV, FAST_SRLV,
+   FAST_SRAV, FAST_MOVZ, FAST_MOVN, FAST_MFHI, FAST_MTHI, FAST_MFLO, 
+   FAST_MTLO, FAST_MULT, FAST_MULTU, FAST_DIV, FAST_DIVU, FAST_ADDU, 
+   FAST_SUBU, FAST_AND, FAST_OR, FAST_XOR, FAST_NOR, FAST_SLT, FAST_SLTU,
+   FAST_ADDIU, FAST_SLTI, FAST_SLTIU, FAST_ANDI, FAST_ORI, FAST_XORI, 
+   FAST_LUI, FAST_LB, FAST_LH, FAST_LW, FAST_LBU, FAST_LHU, FAST_SB, 
+   FAST_SH, FAST_SW, FAST_BRANCH};
+
+static int decode_fast(const Decoded *d)
 {
-   unsigned int opcode;
-   unsigned int op, rs, rt, rd, re, func, imm, target;
-   int imm_shift, branch=0, lbranch=2, skip2=0;
+   int kind = FAST_NONE, rd = d->rt;
+
+   if(d->op == 0x00)
+   {
+      rd = d->rd;
+      switch(d->func)
+      {
+         case 0x08: case 0x09: return FAST_BRANCH;   //JR JALR
+         case 0x00: kind = FAST_SLL;   break;
+         case 0x02: kind = FAST_SRL;   break;
+         case 0x03: kind = FAST_SRA;   break;
+         case 0x04: kind = FAST_SLLV;  break;
+         case 0x06: kind = FAST_SRLV;  break;
+         case 0x07: kind = FAST_SRAV;  break;
+         case 0x0a: kind = FAST_MOVZ;  break;
+         case 0x0b: kind = FAST_MOVN;  break;
+         case 0x10: kind = FAST_MFHI;  break;
+         case 0x12: kind = FAST_MFLO;  break;
+         case 0x11: return FAST_MTHI;
+         case 0x13: return FAST_MTLO;
+         case 0x18: return FAST_MULT;
+         case 0x19: return FAST_MULTU;
+         case 0x1a: return FAST_DIV;
+         case 0x1b: return FAST_DIVU;
+         case 0x20: case 0x21: kind = FAST_ADDU; break;
+         case 0x22: case 0x23: kind = FAST_SUBU; break;
+         case 0x24: kind = FAST_AND;   break;
+         case 0x25: kind = FAST_OR;    break;
+         case 0x26: kind = FAST_XOR;   break;
+         case 0x27: kind = FAST_NOR;   break;
+         case 0x2a: kind = FAST_SLT;   break;
+         case 0x2b: kind = FAST_SLTU;  break;
+      }
+   }
+   else
+   {
+      switch(d->op)
+      {
+         case 0x01: return (d->rt & 0xc) || d->rt > 0x13 ? FAST_NONE : FAST_BRANCH;
+         case 0x02: case 0x03: case 0x04: case 0x05: case 0x06: case 0x07:
+         case 0x14: case 0x15: case 0x16: case 0x17: return FAST_BRANCH;
+         case 0x08: case 0x09: kind = FAST_ADDIU; break;
+         case 0x0a: kind = FAST_SLTI;  break;
+         case 0x0b: kind = FAST_SLTIU; break;
+         case 0x0c: kind = FAST_ANDI;  break;
+         case 0x0d: kind = FAST_ORI;   break;
+         case 0x0e: kind = FAST_XORI;  break;
+         case 0x0f: kind = FAST_LUI;   break;
+         case 0x20: return d->rt ? FAST_LB : FAST_NONE;   //execute() keeps $0 zero
+         case 0x21: return d->rt ? FAST_LH : FAST_NONE;
+         case 0x23: return d->rt ? FAST_LW : FAST_NONE;
+         case 0x24: return d->rt ? FAST_LBU : FAST_NONE;
+         case 0x25: return d->rt ? FAST_LHU : FAST_NONE;
+         case 0x28: return FAST_SB;
+         case 0x29: return FAST_SH;
+         case 0x2b: return FAST_SW;
+      }
+   }
+   if(kind != FAST_NONE && rd == 0)
+      kind = FAST_NOP;                  //writes $0
+   return kind;
+}
+
+static void decode(unsigned int opcode, Decoded *d)
+{
+   d->opcode = opcode;
+   d->op = (opcode >> 26) & 0x3f;
+   d->rs = (opcode >> 21) & 0x1f;
+   d->rt = (opcode >> 16) & 0x1f;
+   d->rd = (opcode >> 11) & 0x1f;
+   d->re = (opcode >> 6) & 0x1f;
+   d->func = opcode & 0x3f;
+   d->imm = opcode & 0xffff;
+   d->imm_shift = (((int)(short)d->imm) << 2) - 4;
+   d->target = (opcode << 6) >> 4;
+   d->fast = (unsigned char)decode_fast(d);
+}
+
+//execute one decoded opcode at s->pc
+static void execute(State *s, const Decoded *d)
+{
+   unsigned int opcode=d->opcode;
+   unsigned int op=d->op, rs=d->rs, rt=d->rt, rd=d->rd, re=d->re;
+   unsigned int func=d->func, imm=d->imm, target=d->target;
+   int imm_shift=d->imm_shift, branch=0, lbranch=2, skip2=0;
    int *r=s->r;
    unsigned int *u=(unsigned int*)s->r;
    unsigned int ptr, epc, rSave;
 
-   opcode = mem_read(s, 4, s->pc);
-   op = (opcode >> 26) & 0x3f;
-   rs = (opcode >> 21) & 0x1f;
-   rt = (opcode >> 16) & 0x1f;
-   rd = (opcode >> 11) & 0x1f;
-   re = (opcode >> 6) & 0x1f;
-   func = opcode & 0x3f;
-   imm = opcode & 0xffff;
-   imm_shift = (((int)(short)imm) << 2) - 4;
-   target = (opcode << 6) >> 4;
    ptr = (short)imm + r[rs];
    r[0] = 0;
-   if(show_mode) 
-   {
-      printf("%8.8x %8.8x ", s->pc, opcode);
-      if(op == 0) 
-         printf("%8s ", special_string[func]);
-      else if(op == 1) 
-         printf("%8s ", regimm_string[rt]);
-      else 
-         printf("%8s ", opcode_string[op]);
-      printf("$%2.2d $%2.2d $%2.2d $%2.2d ", rs, rt, rd, re);
-      printf("%4.4x", imm);
-      if(show_mode == 1)
-         printf(" r[%2.2d]=%8.8x r[%2.2d]=%8.8x", rs, r[rs], rt, r[rt]);
-      printf("\n");
-   }
-   if(show_mode > 5) 
-      return;
    epc = s->pc + 4;
    if(s->pc_next != s->pc + 4)
       epc |= 2;  //branch delay slot
@@ -660,8 +1106,20 @@ void cycle(State *s, int show_mode)
             case 0x09:/*JALR*/ r[rd]=s->pc_next; s->pc_next=r[rs]; break;
             case 0x0a:/*MOVZ*/ if(!r[rt]) r[rd]=r[rs];   break;  /*IV*/
             case 0x0b:/*MOVN*/ if(r[rt]) r[rd]=r[rs];    break;  /*IV*/
-            case 0x0c:/*SYSCALL*/ epc|=1; s->exceptionId=1; break;
-            case 0x0d:/*BREAK*/   epc|=1; s->exceptionId=1; break;
+            case 0x0c:/*SYSCALL*/ epc|=1; s->exceptionId=1;
+               if(batchMode && (opcode >> 6))
+               {
+                  batchExit = r[4] & 0xff;
+                  s->wakeup = 1;
+               }
+               break;
+            case 0x0d:/*BREAK*/   epc|=1; s->exceptionId=1;
+               if(batchMode)
+               {
+                  batchExit = r[4] & 0xff;
+                  s->wakeup = 1;
+               }
+               break;
             case 0x0f:/*SYNC*/ s->wakeup=1;              break;
             case 0x10:/*MFHI*/ r[rd]=s->hi;              break;
             case 0x11:/*FTHI*/ s->hi=r[rs];              break;
@@ -805,36 +1263,1762 @@ void cycle(State *s, int show_mode)
    }
 }
 
-void show_state(State *s)
+/************* Timing model *************/
+//Estimates Plasma clock cycles from vhdl/mlite_cpu.vhd, pipeline.vhd,
+//mult.vhd, uart.vhd, cache.vhd and ddr_ctrl.vhd
+#define CLOCK_HZ        25000000
+#define MULT_CYCLES     32          //mult.vhd count_reg
+#define UART_CYCLES     (0x1b2*10)  //uart.vhd 25MHz/57600Hz per bit
+#define DDR_READ        3           //ddr_ctrl.vhd READ, READ2, READ3
+#define DDR_WRITE       1
+#define DDR_ACTIVATE    2           //ROW_ACTIVATE, ROW_ACTIVE
+#define DDR_PRECHARGE   2           //PRECHARGE, PRECHARGE2
+#define DDR_REFRESH     128         //refresh_cnt(7)
+#define TAG_INVALID     0x1ff       //cache.vhd ONES(8 downto 0)
+
+#define TIMING_SRAM 1               //external SRAM without wait states
+#define TIMING_DDR  2               //DDR behind the 4KB cache
+
+enum {STALL_MEMORY, STALL_PIPELINE, STALL_MULT, STALL_CACHE, STALL_DDR,
+   STALL_UART, STALL_COUNT};
+static const char *stallName[STALL_COUNT] = 
+   {"memory", "pipeline", "mult", "cache", "ddr", "uart"};
+
+static int timingEnable;
+static int timingStages = 2;
+static unsigned long long timingCycles, timingOpcodes, timingStall[STALL_COUNT];
+static unsigned long long timingCacheTry, timingCacheMiss;
+static unsigned long long timingMultDone, timingUartDone, timingRefresh;
+static unsigned short timingTag[1024];
+static int timingRow[4];            //open DDR row per bank
+
+static void timing_init(void)
 {
-   int i,j;
-   printf("pid=%d userMode=%d, epc=0x%x\n", s->processId, s->userMode, s->epc);
-   for(i = 0; i < 4; ++i) 
+   int i;
+   for(i = 0; i < 1024; ++i)
+      timingTag[i] = TAG_INVALID;
+   for(i = 0; i < 4; ++i)
+      timingRow[i] = -1;
+}
+
+//Cycles the CPU pauses while ddr_ctrl.vhd performs one access
+static int timing_ddr(unsigned int address, int write)
+{
+   int bank = (address >> 11) & 3, row = (address >> 13) & 0x1fff;
+   int cycles, i;
+
+   if(timingCycles / DDR_REFRESH != timingRefresh)
    {
-      printf("%2.2d ", i * 8);
-      for(j = 0; j < 8; ++j) 
+      timingRefresh = timingCycles / DDR_REFRESH;
+      for(i = 0; i < 4; ++i)
+         timingRow[i] = -1;          //auto refresh precharged all banks
+   }
+   cycles = write ? DDR_WRITE : DDR_READ;
+   if(timingRow[bank] != row)
+   {
+      if(timingRow[bank] != -1)
       {
-         printf("%8.8x ", s->r[i*8+j]);
+         cycles += DDR_PRECHARGE;
+         for(i = 0; i < 4; ++i)
+            timingRow[i] = -1;
       }
-      printf("\n");
+      cycles += DDR_ACTIVATE;
+      timingRow[bank] = row;
    }
-   //printf("%8.8lx %8.8lx %8.8lx %8.8lx\n", s->pc, s->pc_next, s->hi, s->lo);
-   j = s->pc;
-   for(i = -4; i <= 8; ++i) 
+   return cycles;
+}
+
+//Stall cycles for one fetch, load or store
+static int timing_memory(unsigned int address, int size, int write)
+{
+   int offset, tag, cycles;
+
+   if(timingEnable != TIMING_DDR || (address >> 28) != 1)
+      return 0;
+   if(((address >> 21) & 0x3ff) == 0x80)    //first 2MB of DDR is cached
    {
-      printf("%c", i==0 ? '*' : ' ');
-      s->pc = j + i * 4;
-      cycle(s, 10);
+      offset = (address >> 2) & 0x3ff;
+      tag = (address >> 12) & 0x1ff;
+      if(write)
+         timingTag[offset] = size == 4 ? tag : TAG_INVALID;  //write through
+      else
+      {
+         ++timingCacheTry;
+         if(timingTag[offset] == tag && tag != TAG_INVALID)
+            return 0;
+         ++timingCacheMiss;
+         timingTag[offset] = tag;
+         cycles = 1 + timing_ddr(address, 0); //STATE_MISSED then the read
+         timingStall[STALL_CACHE] += cycles;
+         return cycles;
+      }
    }
-   s->pc = j;
+   cycles = timing_ddr(address, write);
+   timingStall[STALL_DDR] += cycles;
+   return cycles;
 }
 
-void do_debug(State *s)
+static void timing_stall(int cause, int cycles)
 {
-   int ch;
+   timingCycles += cycles;
+   timingStall[cause] += cycles;
+}
+
+//Account for the opcode about to execute at s->pc
+static void timing_opcode(State *s, const Decoded *d)
+{
+   unsigned int address = (short)d->imm + s->r[d->rs];
+   int op = d->op, func = d->func, memory, write, pause = 0;
+
+   ++timingOpcodes;
+   timingCycles += 1 + timing_memory(s->pc, 4, 0);
+   memory = (op >= 0x20 && op <= 0x2e) || op == 0x30 || op == 0x38;
+   if(memory)
+   {
+      write = op >= 0x28;
+      timing_stall(STALL_MEMORY, 1);    //mem_ctrl.vhd STATE_ACCESS
+      timingCycles += timing_memory(address,             //LL/SC are words
+         (op & 3) == 3 || op >= 0x30 ? 4 : (op & 3) + 1, write);
+      if(write && address == UART_WRITE)
+      {
+         if(timingCycles < timingUartDone)
+            timing_stall(STALL_UART, (int)(timingUartDone - timingCycles));
+         timingUartDone = timingCycles + UART_CYCLES;
+      }
+      pause = 1;
+   }
+   else if(op == 0 && func >= 0x18 && func <= 0x1b)   //MULT, DIV
+      timingMultDone = timingCycles + MULT_CYCLES;
+   else if(op == 0 && (func == 0x10 || func == 0x12)) //MFHI, MFLO
+   {
+      if(timingCycles < timingMultDone)
+         timing_stall(STALL_MULT, (int)(timingMultDone - timingCycles));
+      pause = 1;
+   }
+   else if((op == 0 && (func == 8 || func == 9)) || op == 1 ||
+      (op >= 4 && op <= 7) || (op >= 0x14 && op <= 0x17))
+      pause = 1;                        //pc_source FROM_BRANCH
+   if(timingStages == 3 && pause)
+      timing_stall(STALL_PIPELINE, 1);  //pipeline.vhd pause_pipeline
+}
+
+static void timing_report(void)
+{
+   int i;
+   double cpi;
+
+   if(timingOpcodes == 0)
+      return;
+   cpi = (double)timingCycles / timingOpcodes;
+   printf("Cycles=%llu opcodes=%llu CPI=%.3f (%d-stage, %s)\n",
+      timingCycles, timingOpcodes, cpi, timingStages,
+      timingEnable == TIMING_DDR ? "DDR" : "SRAM");
+   printf("At %dMHz: %.3f msec, %.2f MIPS\n", CLOCK_HZ / 1000000,
+      timingCycles * 1000.0 / CLOCK_HZ, CLOCK_HZ / 1000000.0 / cpi);
+   printf("Stalls:");
+   for(i = 0; i < STALL_COUNT; ++i)
+      printf(" %s=%llu", stallName[i], timingStall[i]);
+   printf("\n");
+   if(timingCacheTry)
+      printf("Cache reads=%llu misses=%llu (%.2f%%)\n", timingCacheTry, 
+         timingCacheMiss, timingCacheMiss * 100.0 / timingCacheTry);
+}
+
+/************* Profiler *************/
+//Samples the PC every profileRate opcodes and follows JAL, JALR and
+//"JR $31" with a shadow call stack.  Symbols come from an ELF file's
+//symbol table (link without -s) or from the linker's test.map.
+#define PROFILE_DEPTH 64
+#define PROFILE_EDGES 4096
+#define PROFILE_NAME 80
+
+typedef struct
+{
+   unsigned int address;
+   char name[PROFILE_NAME];
+   unsigned int self, total, mark;
+} Symbol;
+
+typedef struct CallNode
+{
+   int symbol;                  //-1 for unknown
+   unsigned int count;          //samples taken with exactly this stack
+   struct CallNode *parent, *child, *next;
+} CallNode;
+
+typedef struct
+{
+   int caller, callee;
+   unsigned int count;
+} CallEdge;
+
+static Symbol *symbolList;
+static int symbolCount;
+static int profileRate, profileCountdown;
+static unsigned int profileSamples, profileUnknown;
+static char *profileFolded;
+static CallNode profileRoot = {-1, 0, NULL, NULL, NULL};
+static CallNode *profileNode = &profileRoot;
+static struct { unsigned int ret; CallNode *node; } profileStack[PROFILE_DEPTH];
+static int profileDepth;
+static CallEdge profileEdge[PROFILE_EDGES];
+
+static void symbol_add(unsigned int address, const char *name)
+{
+   if((symbolCount & 1023) == 0)
+      symbolList = (Symbol*)realloc(symbolList, (symbolCount + 1024) * sizeof(Symbol));
+   memset(&symbolList[symbolCount], 0, sizeof(Symbol));
+   symbolList[symbolCount].address = address;
+   strncpy(symbolList[symbolCount].name, name, PROFILE_NAME - 1);
+   ++symbolCount;
+}
+
+static int symbol_compare(const void *a, const void *b)
+{
+   unsigned int x = ((const Symbol*)a)->address, y = ((const Symbol*)b)->address;
+   return x < y ? -1 : x > y;
+}
+
+//Read the ELF symbol table or else a GNU ld map file
+static void symbol_load(const char *filename)
+{
+   FILE *in;
+   unsigned char *buf;
+   char line[256], name[256], extra;
+   ElfHeader *elfHeader;
+   Elf32_Shdr *section, *strings;
+   Elf32_Sym *sym;
+   unsigned int address, i, j, count;
+   unsigned long shoff, shentsize, shnum, offset, strOffset, strSize;
+   long size;
+
+   in = fopen(filename, "rb");
+   if(in == NULL)
+   {
+      printf("Can't open symbol file %s!\n", filename);
+      return;
+   }
+   fseek(in, 0, SEEK_END);
+   size = ftell(in);
+   fseek(in, 0, SEEK_SET);
+   buf = (unsigned char*)malloc(size + 1);
+   size = (long)fread(buf, 1, size, in);
+   buf[size] = 0;
+   elfHeader = (ElfHeader*)buf;
+   if(size > (long)sizeof(ElfHeader) && strncmp((char*)elfHeader->e_ident + 1, "ELF", 3) == 0)
+   {
+      //Every offset comes from the file so check it against the file size
+      shoff = ntohl(elfHeader->e_shoff);
+      shentsize = ntohs(elfHeader->e_shentsize);
+      shnum = ntohs(elfHeader->e_shnum);
+      if(shentsize < sizeof(Elf32_Shdr) || shoff > (unsigned long)size ||
+         shnum > ((unsigned long)size - shoff) / shentsize)
+      {
+         printf("Bad ELF section table in %s\n", filename);
+         shnum = 0;
+      }
+      for(i = 0; i < shnum; ++i)
+      {
+         section = (Elf32_Shdr*)(buf + shoff + shentsize * i);
+         if(ntohl(section->sh_type) != SHT_SYMTAB || ntohl(section->sh_link) >= shnum)
+            continue;
+         strings = (Elf32_Shdr*)(buf + shoff + shentsize * ntohl(section->sh_link));
+         offset = ntohl(section->sh_offset);
+         count = ntohl(section->sh_size) / sizeof(Elf32_Sym);
+         strOffset = ntohl(strings->sh_offset);
+         strSize = ntohl(strings->sh_size);
+         if(offset > (unsigned long)size || 
+            count > ((unsigned long)size - offset) / sizeof(Elf32_Sym) ||
+            strOffset > (unsigned long)size || strSize > (unsigned long)size - strOffset)
+            continue;
+         for(j = 0; j < count; ++j)
+         {
+            sym = (Elf32_Sym*)(buf + offset) + j;
+            address = ntohl(sym->st_value);
+            if(ntohl(sym->st_name) >= strSize)
+               continue;
+            strncpy(name, (char*)buf + strOffset + ntohl(sym->st_name), 
+                    sizeof(name) - 1);    //buf[size] ends a bad string
+            name[sizeof(name) - 1] = 0;
+            if((sym->st_info & 0xf) <= 2 && sym->st_shndx && address &&
+               (isalpha(name[0]) || name[0] == '_'))
+               symbol_add(address, name);    //NOTYPE, OBJECT or FUNC
+         }
+      }
+   }
+   else
+   {
+      fseek(in, 0, SEEK_SET);
+      while(fgets(line, sizeof(line), in))
+      {
+         if(sscanf(line, " 0x%x %255s %c", &address, name, &extra) == 2 &&
+            (isalpha(name[0]) || name[0] == '_'))
+            symbol_add(address, name);       //"   0x10000abc   OS_Init"
+      }
+   }
+   fclose(in);
+   free(buf);
+   qsort(symbolList, symbolCount, sizeof(Symbol), symbol_compare);
+   for(i = j = 0; (int)i < symbolCount; ++i)
+   {
+      if(j == 0 || symbolList[i].address != symbolList[j - 1].address)
+         symbolList[j++] = symbolList[i];
+   }
+   symbolCount = j;
+   printf("Read %d symbols from %s\n", symbolCount, filename);
+}
+
+static int symbol_find(unsigned int address)
+{
+   int low = 0, high = symbolCount - 1, mid;
+
+   if(symbolCount == 0 || address < symbolList[0].address)
+      return -1;
+   while(low < high)
+   {
+      mid = (low + high + 1) >> 1;
+      if(symbolList[mid].address <= address)
+         low = mid;
+      else
+         high = mid - 1;
+   }
+   return low;
+}
+
+static const char *symbol_name(int symbol)
+{
+   return symbol < 0 ? "[unknown]" : symbolList[symbol].name;
+}
+
+static CallNode *call_child(CallNode *node, int symbol)
+{
+   CallNode *child;
+
+   for(child = node->child; child; child = child->next)
+   {
+      if(child->symbol == symbol)
+         return child;
+   }
+   child = (CallNode*)malloc(sizeof(CallNode));
+   memset(child, 0, sizeof(CallNode));
+   child->symbol = symbol;
+   child->parent = node;
+   child->next = node->child;
+   node->child = child;
+   return child;
+}
+
+static void profile_sample(unsigned int pc)
+{
+   int symbol = symbol_find(pc);
+   CallNode *node = profileNode;
+
+   ++profileSamples;
+   if(node->symbol != symbol || node == &profileRoot)
+      node = call_child(node, symbol);   //reached without a JAL
+   ++node->count;
+   if(symbol < 0)
+      ++profileUnknown;
+   else
+      ++symbolList[symbol].self;
+   for(; node != &profileRoot; node = node->parent)
+   {
+      if(node->symbol >= 0 && symbolList[node->symbol].mark != profileSamples)
+      {
+         symbolList[node->symbol].mark = profileSamples;
+         ++symbolList[node->symbol].total;
+      }
+   }
+}
+
+static void profile_call(unsigned int pc, unsigned int target, unsigned int ret)
+{
+   int caller = symbol_find(pc), callee = symbol_find(target), i, n;
+   CallEdge *edge;
+
+   i = (caller * 31 + callee) & (PROFILE_EDGES - 1);
+   for(n = 0; n < PROFILE_EDGES; ++n)
+   {
+      edge = &profileEdge[(i + n) & (PROFILE_EDGES - 1)];
+      if(edge->count == 0)
+      {
+         edge->caller = caller;
+         edge->callee = callee;
+      }
+      if(edge->caller == caller && edge->callee == callee)
+      {
+         ++edge->count;
+         break;
+      }
+   }
+   if(profileDepth < PROFILE_DEPTH)
+   {
+      profileStack[profileDepth].ret = ret;
+      profileStack[profileDepth].node = profileNode;
+      ++profileDepth;
+      profileNode = call_child(profileNode, callee);
+   }
+}
+
+static void profile_return(unsigned int address)
+{
+   int i;
+
+   for(i = profileDepth - 1; i >= 0; --i)
+   {
+      if(profileStack[i].ret == address)
+      {
+         profileNode = profileStack[i].node;
+         profileDepth = i;
+         return;
+      }
+   }
+   profileNode = &profileRoot;   //longjmp() or thread switch
+   profileDepth = 0;
+}
+
+//Called before the opcode at s->pc executes.  Calls and returns take
+//effect after their delay slot so the slot is charged to the caller.
+static void profile_opcode(State *s, const Decoded *d)
+{
+   static int pending;
+   static unsigned int pendingPc, pendingTarget;
+
+   if(--profileCountdown <= 0)
+   {
+      profileCountdown = profileRate;
+      profile_sample(s->pc);
+   }
+   if(pending == 1)
+      profile_call(pendingPc, pendingTarget, pendingPc + 8);
+   else if(pending == 2)
+      profile_return(pendingTarget);
+   pending = 0;
+   if(s->skip)
+      return;
+   pendingPc = s->pc;
+   if(d->op == 3)                                          //JAL
+   {
+      pending = 1;
+      pendingTarget = (s->pc & 0xf0000000) | d->target;
+   }
+   else if(d->op == 0 && d->func == 9 && d->rd)            //JALR
+   {
+      pending = 1;
+      pendingTarget = s->r[d->rs];
+   }
+   else if(d->op == 0 && d->func == 8 && d->rs == 31)      //JR $31
+   {
+      pending = 2;
+      pendingTarget = s->r[31];
+   }
+}
+
+static void profile_folded(FILE *out, CallNode *node, char *path, int length)
+{
+   CallNode *child;
+   int length2;
+
+   for(child = node->child; child; child = child->next)
+   {
+      length2 = length + sprintf(path + length, "%s%s", length ? ";" : "",
+                                 symbol_name(child->symbol));
+      if(child->count)
+         fprintf(out, "%s %u\n", path, child->count);
+      profile_folded(out, child, path, length2);
+   }
+}
+
+static int self_compare(const void *a, const void *b)
+{
+   unsigned int x = symbolList[*(const int*)a].self;
+   unsigned int y = symbolList[*(const int*)b].self;
+   return x > y ? -1 : x < y;
+}
+
+static int edge_compare(const void *a, const void *b)
+{
+   unsigned int x = ((const CallEdge*)a)->count, y = ((const CallEdge*)b)->count;
+   return x > y ? -1 : x < y;
+}
+
+static void profile_report(void)
+{
+   int *order, i;
+   FILE *out;
+   char *path;
+
+   if(profileSamples == 0)
+      return;
+   printf("Profile: %u samples every %d opcodes\n", profileSamples, profileRate);
+   printf("  self%%  total%%  function\n");
+   order = (int*)malloc((symbolCount + 1) * sizeof(int));
+   for(i = 0; i < symbolCount; ++i)
+      order[i] = i;
+   qsort(order, symbolCount, sizeof(int), self_compare);
+   if(profileUnknown)
+      printf("%7.2f          [unknown]\n", profileUnknown * 100.0 / profileSamples);
+   for(i = 0; i < symbolCount && i < 30 && symbolList[order[i]].self; ++i)
+   {
+      printf("%7.2f %7.2f  %s\n", 
+         symbolList[order[i]].self * 100.0 / profileSamples,
+         symbolList[order[i]].total * 100.0 / profileSamples,
+         symbolList[order[i]].name);
+   }
+   free(order);
+
+   qsort(profileEdge, PROFILE_EDGES, sizeof(CallEdge), edge_compare);
+   printf("     calls  caller -> callee\n");
+   for(i = 0; i < 30 && profileEdge[i].count; ++i)
+   {
+      printf("%10u  %s -> %s\n", profileEdge[i].count, 
+         symbol_name(profileEdge[i].caller), symbol_name(profileEdge[i].callee));
+   }
+
+   if(profileFolded)
+   {
+      out = fopen(profileFolded, "w");
+      if(out == NULL)
+         return;
+      path = (char*)malloc((PROFILE_DEPTH + 2) * (PROFILE_NAME + 1));
+      profile_folded(out, &profileRoot, path, 0);
+      free(path);
+      fclose(out);
+      printf("Wrote folded stacks to %s\n", profileFolded);
+   }
+}
+
+/************* Binary trace *************/
+//"-trace file" writes TRACE_MAGIC then one record per executed opcode:
+//a flags byte followed by the flagged fields in this order
+//   TRACE_JUMP   zigzag varint of (pc - (previous pc + 4)) / 4
+//   TRACE_REG    register number byte and varint of the new value
+//   TRACE_HILO   varint hi and varint lo
+//   TRACE_LOAD or TRACE_STORE   zigzag varint of the address minus the
+//                previous data address and varint of the value
+//Bits 5-6 hold log2 of the access size.  SWL and SWR use size
+//TRACE_SIZE_PART: the value is the word driven on the bus and a byte
+//of byte enables (bit 3 = lowest address) follows it.  Registers are
+//recorded when they change.  tracediff.c dumps and compares these files.
+#define TRACE_MAGIC "PLTRACE1"
+#define TRACE_JUMP  0x01
+#define TRACE_REG   0x02
+#define TRACE_HILO  0x04
+#define TRACE_LOAD  0x08
+#define TRACE_STORE 0x10
+#define TRACE_SIZE_SHIFT 5
+#define TRACE_SIZE_PART  3
+
+static FILE *traceFile;
+static unsigned char traceBuf[1024*64];
+static int traceLength;
+static unsigned int tracePc, traceAddress;
+static int traceReg[32], traceSkip;
+static unsigned int traceHi, traceLo;
+
+static void trace_flush(void)
+{
+   fwrite(traceBuf, 1, traceLength, traceFile);
+   traceLength = 0;
+}
+
+static void trace_byte(int value)
+{
+   if(traceLength == (int)sizeof(traceBuf))
+      trace_flush();
+   traceBuf[traceLength++] = (unsigned char)value;
+}
+
+static void trace_varint(unsigned int value)
+{
+   while(value >= 0x80)
+   {
+      trace_byte(value | 0x80);
+      value >>= 7;
+   }
+   trace_byte(value);
+}
+
+#define ZIGZAG(A) (((unsigned int)(A) << 1) ^ (unsigned int)((int)(A) >> 31))
+
+static void trace_open(const char *filename)
+{
+   traceFile = fopen(filename, "wb");
+   if(traceFile == NULL)
+   {
+      printf("Can't open file %s!\n", filename);
+      return;
+   }
+   fwrite(TRACE_MAGIC, 1, 8, traceFile);
+}
+
+static void trace_close(void)
+{
+   if(traceFile == NULL)
+      return;
+   trace_flush();
+   fclose(traceFile);
+   traceFile = NULL;
+}
+
+//Called before execute(); remembers what the opcode may change
+static void trace_before(State *s)
+{
+   memcpy(traceReg, s->r, sizeof(traceReg));
+   traceSkip = s->skip;
+   traceHi = s->hi;
+   traceLo = s->lo;
+}
+
+static void trace_after(State *s, const Decoded *d, unsigned int pc)
+{
+   unsigned int address = (short)d->imm + traceReg[d->rs], value = 0;
+   int flags = 0, reg, op = d->op, size = 0, we = 0, shift;
+
+   if(pc != tracePc + 4)
+      flags |= TRACE_JUMP;
+   for(reg = 1; reg < 32; ++reg)
+   {
+      if(s->r[reg] != traceReg[reg])
+      {
+         flags |= TRACE_REG;
+         break;
+      }
+   }
+   if(s->hi != traceHi || s->lo != traceLo)
+      flags |= TRACE_HILO;
+   if(((op >= 0x20 && op <= 0x2e) || op == 0x30 || op == 0x38) && traceSkip == 0)
+   {
+      size = (op & 3) == 3 || op >= 0x30 ? 2 : op & 3;  //LL/SC are words
+      flags |= (op & 8) ? TRACE_STORE : TRACE_LOAD;
+      flags |= size << TRACE_SIZE_SHIFT;
+      value = (op & 8) ? traceReg[d->rt] : s->r[d->rt];
+      if(size < 2)
+         value &= (1 << (8 << size)) - 1;
+      if(op == 0x2a || op == 0x2e)
+      {
+         //SWL writes the bytes from address to the end of the word and
+         //SWR the bytes from the start of the word to address
+         shift = address & 3;
+         size = TRACE_SIZE_PART;
+         flags |= size << TRACE_SIZE_SHIFT;
+         if(op == 0x2a)
+         {
+            we = 0xf >> shift;
+            value >>= shift * 8;
+         }
+         else
+         {
+            we = (0xf << (3 - shift)) & 0xf;
+            value <<= (3 - shift) * 8;
+         }
+      }
+   }
+   trace_byte(flags);
+   if(flags & TRACE_JUMP)
+      trace_varint(ZIGZAG((int)(pc - tracePc - 4) >> 2));
+   if(flags & TRACE_REG)
+   {
+      trace_byte(reg);
+      trace_varint(s->r[reg]);
+   }
+   if(flags & TRACE_HILO)
+   {
+      trace_varint(s->hi);
+      trace_varint(s->lo);
+   }
+   if(flags & (TRACE_LOAD | TRACE_STORE))
+   {
+      trace_varint(ZIGZAG(address - traceAddress));
+      trace_varint(value);
+      if(size == TRACE_SIZE_PART)
+         trace_byte(we);
+      traceAddress = address;
+   }
+   tracePc = pc;
+}
+
+//execute one cycle of a Plasma CPU
+void cycle(State *s, int show_mode)
+{
+   Decoded d;
+   int *r=s->r;
+
+   decode(mem_read(s, 4, s->pc), &d);
+   if(show_mode) 
+   {
+      printf("%8.8x %8.8x ", s->pc, d.opcode);
+      if(d.op == 0) 
+         printf("%8s ", special_string[d.func]);
+      else if(d.op == 1) 
+         printf("%8s ", regimm_string[d.rt]);
+      else 
+         printf("%8s ", opcode_string[d.op]);
+      printf("$%2.2d $%2.2d $%2.2d $%2.2d ", d.rs, d.rt, d.rd, d.re);
+      printf("%4.4x", d.imm);
+      if(show_mode == 1)
+         printf(" r[%2.2d]=%8.8x r[%2.2d]=%8.8x", d.rs, r[d.rs], d.rt, r[d.rt]);
+      printf("\n");
+   }
+   if(show_mode > 5) 
+      return;
+   if(timingEnable)
+      timing_opcode(s, &d);
+   if(profileRate)
+      profile_opcode(s, &d);
+   if(traceFile)
+   {
+      unsigned int pc = s->pc;
+      trace_before(s);
+      execute(s, &d);
+      trace_after(s, &d, pc);
+      return;
+   }
+   execute(s, &d);
+}
+
+static void block_init(void)
+{
+   int i;
+   blockTable = (Block*)malloc(BLOCK_TABLE_SIZE * sizeof(Block));
+   for(i = 0; i < BLOCK_TABLE_SIZE; ++i)
+      blockTable[i].pc = BLOCK_EMPTY;
+}
+
+static int is_branch(const Decoded *d)
+{
+   if(d->op == 0)
+      return d->func == 0x08 || d->func == 0x09;   //JR JALR
+   return (0x01 <= d->op && d->op <= 0x07) || (0x14 <= d->op && d->op <= 0x17);
+}
+
+//Find or decode the block of straight-line code starting at pc
+static Block *block_lookup(State *s, unsigned int pc)
+{
+   Block *b = &blockTable[(pc >> 2) & (BLOCK_TABLE_SIZE-1)];
+   unsigned int offset, address;
+   int delaySlot = 0, i;
+
+   if(b->pc == pc)
+      return b;
+   if(pageTable[pc >> PAGE_SHIFT])
+      offset = pageTable[pc >> PAGE_SHIFT] - s->mem + (pc & PAGE_MASK);
+   else
+      offset = pc % MEM_SIZE;
+   b->pc = pc;
+   b->page = offset >> PAGE_SHIFT;
+   b->hits = 0;
+   b->native = NULL;
+   blockCodePage[b->page] = 1;
+   for(b->count = 0, address = pc; b->count < BLOCK_OPCODES; address += 4)
+   {
+      decode(mem_read(s, 4, address), &b->opcode[b->count]);
+      if(delaySlot)
+      {
+         ++b->count;
+         break;
+      }
+      delaySlot = is_branch(&b->opcode[b->count++]);
+      if(((address + 4) & PAGE_MASK) == 0)
+         break;
+   }
+
+   //A branch is only run fast together with a fast delay slot
+   for(i = 0; i < b->count && b->opcode[i].fast != FAST_NONE; ++i)
+   {
+      if(b->opcode[i].fast == FAST_BRANCH)
+      {
+         if(i + 1 < b->count && b->opcode[i + 1].fast != FAST_NONE &&
+            b->opcode[i + 1].fast != FAST_BRANCH)
+            i += 2;
+         break;
+      }
+   }
+   b->fastCount = i;
+   return b;
+}
+
+#ifdef ENABLE_JIT
+/************* Optional x86-64 translation of hot blocks *************/
+//Translated code keeps the State pointer in rbx and works out of s->r[];
+//loads and stores call back into mem_read()/mem_write() so MMIO, the
+//optional caches and code page invalidation behave as in cycle().
+//Only plain ALU, load/store and branch opcodes are translated; a block
+//is cut at the first other opcode and cycle() executes the remainder.
+#define JIT_THRESHOLD  16
+#define JIT_CODE_SIZE  (1024*1024*16)
+#define JIT_BLOCK_MAX  (BLOCK_OPCODES * 64 + 128)   //worst case bytes per block
+
+#define EAX 0
+#define ECX 1
+#define EDX 2
+#define SREG(i) (int)(offsetof(State, r) + (i) * sizeof(int))
+#define SFIELD(f) (int)offsetof(State, f)
+
+static unsigned char *jitCode, *jitPtr;
+static int jitEnable;
+static unsigned int jitBlockPc;         //first pc of the block being translated
+
+static void emit1(int value)
+{
+   *jitPtr++ = (unsigned char)value;
+}
+
+static void emit4(unsigned int value)
+{
+   memcpy(jitPtr, &value, 4);
+   jitPtr += 4;
+}
+
+static void emit_load(int reg, int offset)      //mov reg,[rbx+offset]
+{
+   emit1(0x8b); emit1(0x80 | (reg << 3) | 3); emit4(offset);
+}
+
+static void emit_store(int reg, int offset)     //mov [rbx+offset],reg
+{
+   emit1(0x89); emit1(0x80 | (reg << 3) | 3); emit4(offset);
+}
+
+static void emit_store_imm(int offset, unsigned int value)
+{
+   emit1(0xc7); emit1(0x83); emit4(offset); emit4(value);
+}
+
+static void emit_mov_imm(int reg, unsigned int value)
+{
+   emit1(0xb8 + reg); emit4(value);
+}
+
+static void emit_alu(int opcode, int dst, int src)  //add/or/and/sub/xor/cmp
+{
+   emit1(opcode); emit1(0xc0 | (src << 3) | dst);
+}
+
+static void emit_setcc(int cc)                      //eax = condition
+{
+   emit1(0x0f); emit1(cc); emit1(0xc0);
+   emit1(0x0f); emit1(0xb6); emit1(0xc0);
+}
+
+static void emit_rd(int rd)                         //r[rd] = eax
+{
+   if(rd)
+      emit_store(EAX, SREG(rd));
+}
+
+static void emit_call(void *function)
+{
+   unsigned long long address = (unsigned long long)function;
+   emit1(0x48); emit1(0x89); emit1(0xdf);           //mov rdi,rbx
+   emit1(0x48); emit1(0xb8);                        //mov rax,function
+   emit4((unsigned int)address); emit4((unsigned int)(address >> 32));
+   emit1(0xff); emit1(0xd0);                        //call rax
+}
+
+//Return the number of opcodes executed when leaving before pc
+static void emit_return(unsigned int pc)
+{
+   emit_mov_imm(EAX, (pc - jitBlockPc) >> 2);
+   emit1(0x41); emit1(0x5d);                        //pop r13
+   emit1(0x41); emit1(0x5c);                        //pop r12
+   emit1(0x5b);                                     //pop rbx
+   emit1(0xc3);
+}
+
+static void emit_exit(unsigned int pc, unsigned int pcDone)
+{
+   emit_store_imm(SFIELD(pc), pc);
+   emit_store_imm(SFIELD(pc_next), pc + 4);
+   emit_return(pcDone);
+}
+
+static unsigned int jit_read(State *s, int size, unsigned int address)
+{
+   return mem_read(s, size, address);
+}
+
+static int jit_write(State *s, int size, unsigned int address, unsigned int value)
+{
+   mem_write(s, size, address, value);
+   return blockFlushed;
+}
+
+//Emit one non-branch opcode; returns 0 if it must be left to cycle()
+static int jit_opcode(const Decoded *d, unsigned int pc, int lastOpcode)
+{
+   int rs=d->rs, rt=d->rt, rd=d->rd, size;
+   unsigned int simm=(unsigned int)(int)(short)d->imm;
+   unsigned char *patch;
+
+   switch(d->op)
+   {
+      case 0x00:/*SPECIAL*/
+         switch(d->func)
+         {
+            case 0x00:/*SLL*/
+            case 0x02:/*SRL*/
+            case 0x03:/*SRA*/
+               emit_load(EAX, SREG(rt));
+               emit1(0xc1); emit1(d->func == 0 ? 0xe0 : d->func == 2 ? 0xe8 : 0xf8);
+               emit1(d->re);
+               emit_rd(rd);
+               return 1;
+            case 0x04:/*SLLV*/
+            case 0x06:/*SRLV*/
+            case 0x07:/*SRAV*/
+               emit_load(EAX, SREG(rt));
+               emit_load(ECX, SREG(rs));
+               emit1(0xd3); emit1(d->func == 4 ? 0xe0 : d->func == 6 ? 0xe8 : 0xf8);
+               emit_rd(rd);
+               return 1;
+            case 0x0a:/*MOVZ*/
+            case 0x0b:/*MOVN*/
+               emit_load(EAX, SREG(rd));
+               emit_load(ECX, SREG(rs));
+               emit_load(EDX, SREG(rt));
+               emit1(0x85); emit1(0xd2);                 //test edx,edx
+               emit1(0x0f); emit1(d->func == 0x0a ? 0x44 : 0x45); emit1(0xc1);
+               emit_rd(rd);
+               return 1;
+            case 0x10:/*MFHI*/ emit_load(EAX, SFIELD(hi)); emit_rd(rd); return 1;
+            case 0x11:/*MTHI*/ emit_load(EAX, SREG(rs)); emit_store(EAX, SFIELD(hi)); return 1;
+            case 0x12:/*MFLO*/ emit_load(EAX, SFIELD(lo)); emit_rd(rd); return 1;
+            case 0x13:/*MTLO*/ emit_load(EAX, SREG(rs)); emit_store(EAX, SFIELD(lo)); return 1;
+            case 0x18:/*MULT*/
+            case 0x19:/*MULTU*/
+               emit_load(EAX, SREG(rs));
+               emit_load(ECX, SREG(rt));
+               if(d->func == 0x18)
+               {
+                  emit1(0x48); emit1(0x63); emit1(0xc0);  //movsxd rax,eax
+                  emit1(0x48); emit1(0x63); emit1(0xc9);  //movsxd rcx,ecx
+               }
+               emit1(0x48); emit1(0x0f); emit1(0xaf); emit1(0xc1);  //imul rax,rcx
+               emit_store(EAX, SFIELD(lo));
+               emit1(0x48); emit1(0xc1); emit1(0xe8); emit1(32);    //shr rax,32
+               emit_store(EAX, SFIELD(hi));
+               return 1;
+            case 0x20:/*ADD*/
+            case 0x21:/*ADDU*/ 
+            case 0x22:/*SUB*/
+            case 0x23:/*SUBU*/
+            case 0x24:/*AND*/
+            case 0x25:/*OR*/
+            case 0x26:/*XOR*/
+            case 0x27:/*NOR*/
+            case 0x2a:/*SLT*/
+            case 0x2b:/*SLTU*/
+               emit_load(EAX, SREG(rs));
+               emit_load(ECX, SREG(rt));
+               switch(d->func)
+               {
+                  case 0x20: case 0x21: emit_alu(0x01, EAX, ECX); break;
+                  case 0x22: case 0x23: emit_alu(0x29, EAX, ECX); break;
+                  case 0x24: emit_alu(0x21, EAX, ECX); break;
+                  case 0x25: emit_alu(0x09, EAX, ECX); break;
+                  case 0x26: emit_alu(0x31, EAX, ECX); break;
+                  case 0x27: emit_alu(0x09, EAX, ECX); emit1(0xf7); emit1(0xd0); break;
+                  case 0x2a: emit_alu(0x39, EAX, ECX); emit_setcc(0x9c); break;
+                  case 0x2b: emit_alu(0x39, EAX, ECX); emit_setcc(0x92); break;
+               }
+               emit_rd(rd);
+               return 1;
+         }
+         return 0;
+      case 0x08:/*ADDI*/
+      case 0x09:/*ADDIU*/
+      case 0x0a:/*SLTI*/
+      case 0x0b:/*SLTIU*/
+      case 0x0c:/*ANDI*/
+      case 0x0d:/*ORI*/
+      case 0x0e:/*XORI*/
+         emit_load(EAX, SREG(rs));
+         emit_mov_imm(ECX, d->op >= 0x0c ? d->imm : simm);
+         switch(d->op)
+         {
+            case 0x08: case 0x09: emit_alu(0x01, EAX, ECX); break;
+            case 0x0a: emit_alu(0x39, EAX, ECX); emit_setcc(0x9c); break;
+            case 0x0b: emit_alu(0x39, EAX, ECX); emit_setcc(0x92); break;
+            case 0x0c: emit_alu(0x21, EAX, ECX); break;
+            case 0x0d: emit_alu(0x09, EAX, ECX); break;
+            case 0x0e: emit_alu(0x31, EAX, ECX); break;
+         }
+         emit_rd(rt);
+         return 1;
+      case 0x0f:/*LUI*/
+         if(rt)
+            emit_store_imm(SREG(rt), d->imm << 16);
+         return 1;
+      case 0x20:/*LB*/
+      case 0x21:/*LH*/
+      case 0x23:/*LW*/
+      case 0x24:/*LBU*/
+      case 0x25:/*LHU*/
+         size = (d->op & 3) == 0 ? 1 : (d->op & 3) == 1 ? 2 : 4;
+         emit_load(EDX, SREG(rs));
+         emit1(0x81); emit1(0xc2); emit4(simm);         //add edx,imm
+         emit1(0xbe); emit4(size);                      //mov esi,size
+         emit_call((void*)jit_read);
+         if(d->op != 0x23)
+         {
+            emit1(0x0f);
+            emit1(d->op == 0x20 ? 0xbe : d->op == 0x21 ? 0xbf : d->op == 0x24 ? 0xb6 : 0xb7);
+            emit1(0xc0);
+         }
+         emit_rd(rt);
+         return 1;
+      case 0x28:/*SB*/
+      case 0x29:/*SH*/
+      case 0x2b:/*SW*/
+         size = d->op == 0x28 ? 1 : d->op == 0x29 ? 2 : 4;
+         emit_load(EDX, SREG(rs));
+         emit1(0x81); emit1(0xc2); emit4(simm);         //add edx,imm
+         emit_load(ECX, SREG(rt));
+         emit1(0xbe); emit4(size);                      //mov esi,size
+         emit_call((void*)jit_write);
+         if(lastOpcode == 0)
+         {
+            //Stored into decoded code: leave the rest to a fresh block
+            emit1(0x85); emit1(0xc0);                   //test eax,eax
+            emit1(0x74);                                //jz over the exit
+            patch = jitPtr++;
+            emit_exit(pc + 4, pc + 4);
+            *patch = (unsigned char)(jitPtr - patch - 1);
+         }
+         return 1;
+   }
+   return 0;
+}
+
+//Emit a branch and its delay slot, leaving the new pc in s->pc
+static int jit_branch(const Decoded *d, const Decoded *delay, unsigned int pc)
+{
+   static const unsigned char setcc[4]={0x94, 0x95, 0x9e, 0x9f}; //e ne le g
+   unsigned int target=pc + 8 + d->imm_shift, next=pc + 8;
+   int cc=0, likely=0, link=0;
+   unsigned char *patch=NULL;
+
+   switch(d->op)
+   {
+      case 0x00:/*JR JALR*/
+         if(d->func == 0x09 && d->rd)
+            emit_store_imm(SREG(d->rd), next);
+         emit1(0x44); emit1(0x8b); emit1(0xa3); emit4(SREG(d->rs)); //mov r12d,rs
+         emit1(0x41); emit1(0x83); emit1(0xe4); emit1(0xfc);        //and r12d,~3
+         if(jit_opcode(delay, pc + 4, 1) == 0)
+            return 0;
+         emit1(0x44); emit1(0x89); emit1(0xa3); emit4(SFIELD(pc));  //mov [pc],r12d
+         emit1(0x41); emit1(0x83); emit1(0xc4); emit1(4);           //add r12d,4
+         emit1(0x44); emit1(0x89); emit1(0xa3); emit4(SFIELD(pc_next));
+         emit_return(pc + 8);
+         return 1;
+      case 0x01:/*REGIMM*/
+         if((d->rt & 0xc) || d->rt > 0x13)
+            return 0;
+         link = d->rt & 0x10;
+         likely = d->rt & 2;
+         cc = d->rt & 1 ? 0x9d : 0x9c;           //setge setl
+         break;
+      case 0x02:/*J*/
+      case 0x03:/*JAL*/
+         if(d->op == 3)
+            emit_store_imm(SREG(31), next);
+         if(jit_opcode(delay, pc + 4, 1) == 0)
+            return 0;
+         emit_exit(((pc + 4) & 0xf0000000) | d->target, pc + 8);
+         return 1;
+      default:
+         likely = d->op >= 0x14;
+         cc = setcc[d->op & 3];
+         break;
+   }
+   if(link)
+      emit_store_imm(SREG(31), next);
+   emit_load(EAX, SREG(d->rs));
+   if(d->op == 0x01 || (d->op & 3) >= 2)         //compare with zero
+   {
+      emit1(0x83); emit1(0xf8); emit1(0);        //cmp eax,0
+   }
+   else
+   {
+      emit_load(ECX, SREG(d->rt));
+      emit_alu(0x39, EAX, ECX);
+   }
+   emit_setcc(cc);
+   emit1(0x41); emit1(0x89); emit1(0xc4);        //mov r12d,eax
+   if(likely)
+   {
+      emit1(0x45); emit1(0x85); emit1(0xe4);     //test r12d,r12d
+      emit1(0x0f); emit1(0x84);                  //jz past the delay slot
+      patch = jitPtr;
+      emit4(0);
+   }
+   if(jit_opcode(delay, pc + 4, 1) == 0)
+      return 0;
+   if(patch)
+   {
+      unsigned int offset = (unsigned int)(jitPtr - patch - 4);
+      memcpy(patch, &offset, 4);
+   }
+   emit_mov_imm(EAX, next);
+   emit_mov_imm(ECX, target);
+   emit1(0x45); emit1(0x85); emit1(0xe4);        //test r12d,r12d
+   emit1(0x0f); emit1(0x45); emit1(0xc1);        //cmovnz eax,ecx
+   emit_store(EAX, SFIELD(pc));
+   emit1(0x83); emit1(0xc0); emit1(4);           //add eax,4
+   emit_store(EAX, SFIELD(pc_next));
+   emit_return(pc + 8);
+   return 1;
+}
+
+static void jit_init(void)
+{
+   jitCode = (unsigned char*)mmap(NULL, JIT_CODE_SIZE, 
+      PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if(jitCode == MAP_FAILED)
+   {
+      printf("Can't map JIT code buffer\n");
+      jitEnable = 0;
+      return;
+   }
+   jitPtr = jitCode;
+}
+
+//Translate the longest supported prefix of a block into host code
+static void jit_translate(Block *b)
+{
+   unsigned char *start, *mark;
+   unsigned int pc=b->pc;
+   int i;
+
+   if(jitPtr + JIT_BLOCK_MAX > jitCode + JIT_CODE_SIZE)
+   {
+      //Out of code space: drop every translation and start over
+      for(i = 0; i < BLOCK_TABLE_SIZE; ++i)
+         blockTable[i].native = NULL;
+      jitPtr = jitCode;
+   }
+   start = jitPtr;
+   jitBlockPc = b->pc;
+   emit1(0x53);                                  //push rbx
+   emit1(0x41); emit1(0x54);                     //push r12
+   emit1(0x41); emit1(0x55);                     //push r13
+   emit1(0x48); emit1(0x89); emit1(0xfb);        //mov rbx,rdi
+   for(i = 0; i < b->count; ++i, pc += 4)
+   {
+      mark = jitPtr;
+      if(is_branch(&b->opcode[i]))
+      {
+         if(i + 1 < b->count && jit_branch(&b->opcode[i], &b->opcode[i + 1], pc))
+         {
+            pc += 8;                             //branch and delay slot
+            break;
+         }
+      }
+      else if(jit_opcode(&b->opcode[i], pc, 0))
+         continue;
+      jitPtr = mark;
+      emit_exit(pc, pc);
+      break;
+   }
+   if(i == b->count)
+      emit_exit(pc, pc);
+   if(pc == b->pc)
+   {
+      jitPtr = start;                            //nothing worth translating
+      return;
+   }
+   b->native = (int (*)(State*))start;
+}
+#endif  //ENABLE_JIT
+
+//Aligned RAM outside the SIMPLE_CACHE window skips cache_read()/mem_read()
+static unsigned int fast_read(State *s, int size, unsigned int address)
+{
+   unsigned char *page = pageTable[address >> PAGE_SHIFT];
+   unsigned int value;
+
+   if(page == NULL || (address & (size - 1)) || (address >> 21) == 0x80)
+      return mem_read(s, size, address);
+   page += address & PAGE_MASK;
+   if(size == 4)
+   {
+      value = *(unsigned int*)page;
+      return s->big_endian ? ntohl(value) : value;
+   }
+   if(size == 2)
+   {
+      value = *(unsigned short*)page;
+      return s->big_endian ? ntohs((unsigned short)value) : value;
+   }
+   return *page;
+}
+
+static void fast_write(State *s, int size, unsigned int address, unsigned int value)
+{
+   unsigned char *page = pageTable[address >> PAGE_SHIFT];
+
+   if(page == NULL || (address >> 21) == 0x80)
+      mem_write(s, size, address, value);
+   else
+      ram_write(s, size, page + (address & PAGE_MASK), address, value);
+}
+
+//Returns the pc after the delay slot of the branch at pc.  A branch likely
+//that isn't taken sets *skip since its delay slot is annulled.
+static unsigned int fast_branch(State *s, const Decoded *d, unsigned int pc, int *skip)
+{
+   int *r = s->r, taken;
+   unsigned int next;
+
+   switch(d->op)
+   {
+      case 0x00:/*JR JALR*/
+         next = r[d->rs] & ~3;
+         if(d->func == 0x09)
+         {
+            r[d->rd] = pc + 8;
+            r[0] = 0;
+         }
+         return next;
+      case 0x01:/*REGIMM*/
+         taken = (d->rt & 1) ? r[d->rs] >= 0 : r[d->rs] < 0;
+         if(d->rt & 0x10)
+            r[31] = pc + 8;
+         *skip = (d->rt & 2) && !taken;
+         break;
+      case 0x03:/*JAL*/
+         r[31] = pc + 8;
+      case 0x02:/*J*/
+         return (pc & 0xf0000000) | d->target;
+      default:
+         switch(d->op & 3)
+         {
+            case 0:  taken = r[d->rs] == r[d->rt]; break;  /*BEQ*/
+            case 1:  taken = r[d->rs] != r[d->rt]; break;  /*BNE*/
+            case 2:  taken = r[d->rs] <= 0;        break;  /*BLEZ*/
+            default: taken = r[d->rs] > 0;         break;  /*BGTZ*/
+         }
+         *skip = d->op >= 0x14 && !taken;
+         break;
+   }
+   return taken ? pc + 8 + d->imm_shift : pc + 8;
+}
+
+//Run the first b->fastCount opcodes of a block, which don't need
+//execute().  The caller checked that s->pc is the block's first pc and
+//isn't a delay slot.  Stops early after a load or store that set wakeup
+//or dropped blocks.  Returns the opcodes executed and updates s->pc.
+static int block_fast(State *s, const Block *b)
+{
+   int *r = s->r, skip = 0, count;
+   unsigned int *u = (unsigned int*)s->r;
+   unsigned int pc = b->pc, next = b->pc + b->fastCount * 4;
+   unsigned long long product;
+   const Decoded *d = b->opcode, *end = b->opcode + b->fastCount;
+
+   r[0] = 0;
+   for(; d < end; ++d)
+   {
+      switch(d->fast)
+      {
+         case FAST_NOP:                                         break;
+         case FAST_SLL:   r[d->rd] = r[d->rt] << d->re;         break;
+         case FAST_SRL:   r[d->rd] = u[d->rt] >> d->re;         break;
+         case FAST_SRA:   r[d->rd] = r[d->rt] >> d->re;         break;
+         case FAST_SLLV:  r[d->rd] = r[d->rt] << r[d->rs];      break;
+         case FAST_SRLV:  r[d->rd] = u[d->rt] >> r[d->rs];      break;
+         case FAST_SRAV:  r[d->rd] = r[d->rt] >> r[d->rs];      break;
+         case FAST_MOVZ:  if(!r[d->rt]) r[d->rd] = r[d->rs];    break;
+         case FAST_MOVN:  if(r[d->rt]) r[d->rd] = r[d->rs];     break;
+         case FAST_MFHI:  r[d->rd] = s->hi;                     break;
+         case FAST_MTHI:  s->hi = r[d->rs];                     break;
+         case FAST_MFLO:  r[d->rd] = s->lo;                     break;
+         case FAST_MTLO:  s->lo = r[d->rs];                     break;
+         case FAST_MULT:
+            product = (unsigned long long)((long long)r[d->rs] * r[d->rt]);
+            s->hi = (unsigned int)(product >> 32);
+            s->lo = (unsigned int)product;
+            break;
+         case FAST_MULTU:
+            product = (unsigned long long)u[d->rs] * u[d->rt];
+            s->hi = (unsigned int)(product >> 32);
+            s->lo = (unsigned int)product;
+            break;
+         case FAST_DIV:   s->lo = r[d->rs] / r[d->rt]; s->hi = r[d->rs] % r[d->rt]; break;
+         case FAST_DIVU:  s->lo = u[d->rs] / u[d->rt]; s->hi = u[d->rs] % u[d->rt]; break;
+         case FAST_ADDU:  r[d->rd] = r[d->rs] + r[d->rt];       break;
+         case FAST_SUBU:  r[d->rd] = r[d->rs] - r[d->rt];       break;
+         case FAST_AND:   r[d->rd] = r[d->rs] & r[d->rt];       break;
+         case FAST_OR:    r[d->rd] = r[d->rs] | r[d->rt];       break;
+         case FAST_XOR:   r[d->rd] = r[d->rs] ^ r[d->rt];       break;
+         case FAST_NOR:   r[d->rd] = ~(r[d->rs] | r[d->rt]);    break;
+         case FAST_SLT:   r[d->rd] = r[d->rs] < r[d->rt];       break;
+         case FAST_SLTU:  r[d->rd] = u[d->rs] < u[d->rt];       break;
+         case FAST_ADDIU: u[d->rt] = u[d->rs] + (short)d->imm;  break;
+         case FAST_SLTI:  r[d->rt] = r[d->rs] < (short)d->imm;  break;
+         case FAST_SLTIU: u[d->rt] = u[d->rs] < (unsigned int)(short)d->imm; break;
+         case FAST_ANDI:  r[d->rt] = r[d->rs] & d->imm;         break;
+         case FAST_ORI:   r[d->rt] = r[d->rs] | d->imm;         break;
+         case FAST_XORI:  r[d->rt] = r[d->rs] ^ d->imm;         break;
+         case FAST_LUI:   r[d->rt] = d->imm << 16;              break;
+         case FAST_LB:
+            r[d->rt] = (signed char)fast_read(s, 1, (short)d->imm + r[d->rs]);
+            if(s->wakeup)
+               goto stop;
+            break;
+         case FAST_LH:
+            r[d->rt] = (signed short)fast_read(s, 2, (short)d->imm + r[d->rs]);
+            if(s->wakeup)
+               goto stop;
+            break;
+         case FAST_LW:
+            r[d->rt] = fast_read(s, 4, (short)d->imm + r[d->rs]);
+            if(s->wakeup)
+               goto stop;
+            break;
+         case FAST_LBU:
+            r[d->rt] = (unsigned char)fast_read(s, 1, (short)d->imm + r[d->rs]);
+            if(s->wakeup)
+               goto stop;
+            break;
+         case FAST_LHU:
+            r[d->rt] = (unsigned short)fast_read(s, 2, (short)d->imm + r[d->rs]);
+            if(s->wakeup)
+               goto stop;
+            break;
+         case FAST_SB:
+            fast_write(s, 1, (short)d->imm + r[d->rs], r[d->rt]);
+            if(blockFlushed | s->wakeup)
+               goto stop;
+            break;
+         case FAST_SH:
+            fast_write(s, 2, (short)d->imm + r[d->rs], r[d->rt]);
+            if(blockFlushed | s->wakeup)
+               goto stop;
+            break;
+         case FAST_SW:
+            fast_write(s, 4, (short)d->imm + r[d->rs], r[d->rt]);
+            if(blockFlushed | s->wakeup)
+               goto stop;
+            break;
+         case FAST_BRANCH:
+            next = fast_branch(s, d, pc + (d - b->opcode) * 4, &skip);
+            if(skip)
+               ++d;                     //annulled delay slot still counts
+            break;
+      }
+   }
+   --d;
+stop:
+   count = (int)(d - b->opcode) + 1;
+   if(count < (int)(end - b->opcode))
+      next = pc + count * 4;
+   s->pc = next;
+   s->pc_next = next + 4;
+   return count;
+}
+
+//Execute one cached block; stops early when the PC leaves the block
+//(taken branch or exception), at pcStop, or when a store hits code.
+//Blocks that block_fast() completes chain into the next block until
+//limit opcodes have run.  Never runs more than limit opcodes: a block
+//longer than the remaining limit is single stepped up to it.
+//Returns the number of opcodes executed.
+static int block_run(State *s, unsigned int pcStop, int limit)
+{
+   Block *b = block_lookup(s, s->pc);
+   unsigned int pc = b->pc;
+   int i, count = 0;
+
+   blockFlushed = 0;
+#ifdef ENABLE_JIT
+   if(jitEnable && s->skip == 0 && (unsigned int)s->pc_next == pc + 4 &&
+      b->count <= limit && (pcStop < pc || pcStop >= pc + b->count * 4))
+   {
+      if(b->native == NULL && ++b->hits == JIT_THRESHOLD)
+         jit_translate(b);
+      if(b->native)
+      {
+         s->r[0] = 0;
+         return b->native(s);
+      }
+   }
+#endif
+   i = 0;
+   while(b->fastCount && s->skip == 0 && (unsigned int)s->pc_next == pc + 4 &&
+      s->wakeup == 0 && b->count <= limit - count &&
+      (pcStop < pc || pcStop >= pc + b->fastCount * 4))
+   {
+      i = block_fast(s, b);
+      if(i < b->count || blockFlushed)
+         break;
+      count += i;
+      i = 0;
+#ifdef ENABLE_JIT
+      if(jitEnable)
+         return count;                  //let the next block count its hits
+#endif
+      if(count >= limit)
+         return count;
+      b = block_lookup(s, s->pc);
+      pc = b->pc;
+   }
+   if(blockFlushed)
+      return count + i;
+   for(pc += i * 4; i < b->count && count + i < limit; ++i, pc += 4)
+   {
+      if((unsigned int)s->pc != pc || pc == pcStop || s->wakeup)
+         break;
+      execute(s, &b->opcode[i]);
+      if(blockFlushed)
+         return count + i + 1;
+   }
+   return count + i;
+}
+
+//Take a pending interrupt between opcodes but never inside a delay slot
+static void interrupt_check(State *s)
+{
+   s->irqStatus |= IRQ_UART_WRITE_AVAILABLE;
+   if((s->status & 1) && (s->irqStatus & s->irqMask) && s->skip == 0 &&
+      (unsigned int)s->pc_next == (unsigned int)s->pc + 4)
+   {
+      s->epc = s->pc + 4;               //the ISR backs up one opcode
+      s->pc = 0x3c;
+      s->pc_next = 0x40;
+      s->status = 0;
+      s->userMode = 0;
+   }
+}
+
+#ifndef WIN32
+#define CPU_COUNT_BATCH 1024          //opcodes a thread runs between budget checks
+static State *cpuStopped;
+static unsigned int cpuPcStop;
+static unsigned long long cpuBudget;
+static volatile unsigned long long cpuOpcodes;
+
+static void *cpu_thread(void *arg)
+{
+   State *s = (State*)arg;
+   unsigned long long total;
+   int n = 0;
+
+   while(cpuStop == 0)
+   {
+      if(s->halted)
+      {
+         Sleep(1);
+         continue;
+      }
+      interrupt_check(s);
+      cycle(s, 0);
+      if(s->wakeup || (unsigned int)s->pc == cpuPcStop)
+      {
+         __sync_bool_compare_and_swap(&cpuStopped, NULL, s);
+         cpuStop = 1;
+      }
+      if(++n == CPU_COUNT_BATCH)
+      {
+         total = __sync_add_and_fetch(&cpuOpcodes, n);
+         n = 0;
+         if(cpuBudget && total >= cpuBudget)
+         {
+            __sync_bool_compare_and_swap(&cpuStopped, NULL, s);
+            cpuStop = 1;
+         }
+      }
+   }
+   __sync_add_and_fetch(&cpuOpcodes, n);
+   return NULL;
+}
+#endif
+
+//Run all started cores until one reaches pcStop or sets wakeup, or until
+//the cores together have run budget opcodes (0 for no limit).
+//Cores take turns of cpuQuantum opcodes unless running on host threads,
+//which check the budget every CPU_COUNT_BATCH opcodes.
+//Adds the opcodes run to *count and returns the core that stopped.
+static State *smp_run(unsigned int pcStop, unsigned long long budget, 
+                      unsigned long long *count)
+{
+   State *s;
+   int i, n;
+
+   for(i = 0; i < cpuCount; ++i)
+      cpuState[i]->wakeup = 0;
+#ifndef WIN32
+   if(cpuThreads)
+   {
+      pthread_t thread[CPU_COUNT_MAX];
+      cpuStop = 0;
+      cpuStopped = NULL;
+      cpuPcStop = pcStop;
+      cpuBudget = budget ? budget + *count : 0;
+      cpuOpcodes = *count;
+      for(i = 0; i < cpuCount; ++i)
+         pthread_create(&thread[i], NULL, cpu_thread, cpuState[i]);
+      for(i = 0; i < cpuCount; ++i)
+         pthread_join(thread[i], NULL);
+      *count = cpuOpcodes;
+      return cpuStopped;
+   }
+#endif
+   for(;;)
+   {
+      for(i = 0; i < cpuCount; ++i)
+      {
+         s = cpuState[i];
+         if(s->halted)
+            continue;
+         for(n = 0; n < cpuQuantum; ++n)
+         {
+            interrupt_check(s);
+            cycle(s, 0);
+            ++*count;
+            if(s->wakeup || (unsigned int)s->pc == pcStop ||
+               (budget && *count >= budget))
+               return s;
+         }
+      }
+   }
+}
+
+/************* Snapshots *************/
+//"-save file" writes every core's State, the device registers, the cache
+//arrays and the memory image.  Running "mlite file" on a snapshot resumes
+//it.  The memory image is page aligned, zero pages are left as holes and
+//it is mapped copy-on-write, so many runs can share one booted snapshot.
+#define SNAPSHOT_MAGIC "MLSNAP01"
+#define SNAPSHOT_ALIGN 4096
+
+typedef struct {
+   char magic[8];
+   unsigned int stateSize;
+   unsigned int deviceSize;
+   unsigned int memSize;
+   unsigned int memOffset;
+   int cpuCount;
+   int cpuStackNext;
+} SnapshotHeader;
+
+static struct {
+   void *ptr;
+   int size;
+} snapshotDevice[] = {
+   {HWMemory, sizeof(HWMemory)},
+   {&ethDesc, sizeof(ethDesc)},
+   {&ethDescNext, sizeof(ethDescNext)},
+   {&idleTicks, sizeof(idleTicks)},
+#ifdef ENABLE_CACHE
+   {cacheData, sizeof(cacheData)},
+   {cacheAddr, sizeof(cacheAddr)},
+   {&cacheSetNext, sizeof(int)},
+   {&cacheMiss, sizeof(int)},
+   {&cacheWriteBack, sizeof(int)},
+   {&cacheCount, sizeof(int)},
+#endif
+#ifdef SIMPLE_CACHE
+   {cacheData, sizeof(cacheData)},
+   {cacheAddr, sizeof(cacheAddr)},
+   {&cacheTry, sizeof(int)},
+   {&cacheMiss, sizeof(int)},
+   {&cacheInit, sizeof(int)},
+#endif
+   {NULL, 0}
+};
+static char *snapshotSave;
+static int snapshotMapped;
+
+static void snapshot_header(SnapshotHeader *header)
+{
+   int i;
+
+   memset(header, 0, sizeof(SnapshotHeader));
+   memcpy(header->magic, SNAPSHOT_MAGIC, 8);
+   header->stateSize = sizeof(State);
+   for(i = 0; snapshotDevice[i].ptr; ++i)
+      header->deviceSize += snapshotDevice[i].size;
+   header->memSize = MEM_SIZE;
+   header->cpuCount = cpuCount;
+   header->cpuStackNext = cpuStackNext;
+   header->memOffset = (sizeof(SnapshotHeader) + cpuCount * sizeof(State) +
+      header->deviceSize + SNAPSHOT_ALIGN - 1) & ~(SNAPSHOT_ALIGN - 1);
+}
+
+static void snapshot_write(State *s, const char *filename)
+{
+   static const unsigned char zero[SNAPSHOT_ALIGN];
+   SnapshotHeader header;
+   State core;
+   FILE *out;
+   int i, hole = 0;
+
+   out = fopen(filename, "wb");
+   if(out == NULL)
+   {
+      printf("Can't open file %s!\n", filename);
+      return;
+   }
+   snapshot_header(&header);
+   fwrite(&header, sizeof(header), 1, out);
+   for(i = 0; i < cpuCount; ++i)
+   {
+      core = i ? *cpuState[i] : *s;
+      core.mem = NULL;                 //host pointer
+      fwrite(&core, sizeof(State), 1, out);
+   }
+   for(i = 0; snapshotDevice[i].ptr; ++i)
+      fwrite(snapshotDevice[i].ptr, snapshotDevice[i].size, 1, out);
+   fseek(out, header.memOffset, SEEK_SET);
+   for(i = 0; i < MEM_SIZE; i += SNAPSHOT_ALIGN)
+   {
+      hole = memcmp(s->mem + i, zero, SNAPSHOT_ALIGN) == 0;
+      if(hole)
+         fseek(out, SNAPSHOT_ALIGN, SEEK_CUR);
+      else
+         fwrite(s->mem + i, SNAPSHOT_ALIGN, 1, out);
+   }
+   if(hole)
+   {
+      fseek(out, -1, SEEK_CUR);
+      fputc(0, out);                   //set the file size
+   }
+   fclose(out);
+   printf("Saved snapshot %s\n", filename);
+}
+
+//Replace the freshly read image with a snapshot; returns 0 on failure
+static int snapshot_read(State *s, const char *filename)
+{
+   SnapshotHeader header, expect;
+   FILE *in;
+   unsigned char *mem = NULL;
+   int i, ok;
+
+   in = fopen(filename, "rb");
+   if(in == NULL)
+      return 0;
+   ok = fread(&header, sizeof(header), 1, in) == 1;
+   cpuCount = header.cpuCount;
+   snapshot_header(&expect);
+   if(ok == 0 || header.stateSize != expect.stateSize || 
+      header.deviceSize != expect.deviceSize || header.memSize != MEM_SIZE ||
+      header.cpuCount < 1 || header.cpuCount > CPU_COUNT_MAX)
+   {
+      printf("Snapshot %s was saved by a different mlite build\n", filename);
+      cpuCount = 1;
+      fclose(in);
+      return 0;
+   }
+   cpuStackNext = header.cpuStackNext;
+   ok = fread(s, sizeof(State), 1, in);
+   for(i = 1; i < cpuCount; ++i)
+   {
+      cpuState[i] = (State*)malloc(sizeof(State));
+      ok = fread(cpuState[i], sizeof(State), 1, in);
+   }
+   for(i = 0; snapshotDevice[i].ptr; ++i)
+      ok = fread(snapshotDevice[i].ptr, snapshotDevice[i].size, 1, in);
+#ifndef WIN32
+   mem = (unsigned char*)mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE, 
+      MAP_PRIVATE, fileno(in), header.memOffset);
+   if(mem == (unsigned char*)MAP_FAILED)
+      mem = NULL;
+   snapshotMapped = mem != NULL;
+#endif
+   if(mem == NULL)
+   {
+      mem = (unsigned char*)malloc(MEM_SIZE);
+      memset(mem, 0, MEM_SIZE);
+      fseek(in, header.memOffset, SEEK_SET);
+      ok = (int)fread(mem, 1, MEM_SIZE, in);
+   }
+   (void)ok;
+   fclose(in);
+   s->mem = mem;
+   s->halted = 0;
+   for(i = 1; i < cpuCount; ++i)
+      cpuState[i]->mem = mem;
+   printf("Restored snapshot pc=0x%x cpus=%d\n", s->pc, cpuCount);
+   return 1;
+}
+
+//Run without the debugger; returns the process exit code
+static int batch_run(State *s)
+{
+   unsigned long long count = 0;
+   clock_t start = clock();
+   double seconds;
+   int code;
+
+   s->wakeup = 0;
+   if(cpuCount > 1)
+      s = smp_run(batchStop, batchBudget, &count);
+   while(cpuCount == 1 && s->wakeup == 0 && (unsigned int)s->pc != batchStop &&
+         (batchBudget == 0 || count < batchBudget))
+   {
+      if(blockEnable)
+         count += block_run(s, batchStop, batchBudget && batchBudget - count <
+            BLOCK_CHAIN ? (int)(batchBudget - count) : BLOCK_CHAIN);
+      else
+      {
+         cycle(s, 0);
+         ++count;
+      }
+   }
+   seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+   if(batchExit >= 0)
+      code = batchExit;
+   else if(s->wakeup)
+      code = EXIT_ERROR;
+   else if((unsigned int)s->pc == batchStop)
+      code = 0;
+   else
+      code = EXIT_BUDGET;
+   if(uartFile)
+      fclose(uartFile);
+   fflush(stdout);
+   fprintf(stderr, "exit=%d pc=0x%x opcodes=%llu host=%.3fs %.2f MIPS\n",
+      code, s->pc, count, seconds, seconds > 0 ? count / seconds / 1e6 : 0.0);
+   timing_report();
+   profile_report();
+   if(snapshotSave)
+      snapshot_write(cpuState[0], snapshotSave);
+   trace_close();
+   return code;
+}
+
+void show_state(State *s)
+{
+   int i,j;
+   printf("pid=%d userMode=%d, epc=0x%x\n", s->processId, s->userMode, s->epc);
+   for(i = 0; i < 4; ++i) 
+   {
+      printf("%2.2d ", i * 8);
+      for(j = 0; j < 8; ++j) 
+      {
+         printf("%8.8x ", s->r[i*8+j]);
+      }
+      printf("\n");
+   }
+   //printf("%8.8lx %8.8lx %8.8lx %8.8lx\n", s->pc, s->pc_next, s->hi, s->lo);
+   j = s->pc;
+   for(i = -4; i <= 8; ++i) 
+   {
+      printf("%c", i==0 ? '*' : ' ');
+      s->pc = j + i * 4;
+      cycle(s, 10);
+   }
+   s->pc = j;
+}
+
+void do_debug(State *s)
+{
+   int ch;
    int i, j=0, watch=0, addr;
-   s->pc_next = s->pc + 4;
-   s->skip = 0;
    s->wakeup = 0;
    show_state(s);
    ch = ' ';
@@ -845,6 +3029,8 @@ void do_debug(State *s)
          if(watch) 
             printf("0x%8.8x=0x%8.8x\n", watch, mem_read(s, 4, watch));
          printf("1=Debug 2=Trace 3=Step 4=BreakPt 5=Go 6=Memory ");
+         if(timingEnable)
+            printf("c=Cycles ");
          printf("7=Watch 8=Jump 9=Quit> ");
       }
       ch = getch();
@@ -873,6 +3059,21 @@ void do_debug(State *s)
       case '5': case 'g':
          s->wakeup = 0;
          cycle(s, 0);
+         if(cpuCount > 1)
+         {
+            unsigned long long count = 0;
+            State *stopped = smp_run(j, 0, &count);
+            printf("cpu=%d\n", stopped->cpuIndex);
+            show_state(stopped);
+            break;
+         }
+         if(blockEnable)
+         {
+            while(s->wakeup == 0 && s->pc != j)
+               block_run(s, j, BLOCK_CHAIN);
+            show_state(s);
+            break;
+         }
          while(s->wakeup == 0) 
          {
             if(s->pc == j) 
@@ -912,7 +3113,15 @@ void do_debug(State *s)
          s->pc_next = addr + 4;
          show_state(s);
          break;
+      case 'c':
+         timing_report();
+         break;
       case '9': case 'q': 
+         timing_report();
+         profile_report();
+         if(snapshotSave)
+            snapshot_write(s, snapshotSave);
+         trace_close();
          return;
       }
    }
@@ -923,7 +3132,7 @@ int main(int argc,char *argv[])
 {
    State state, *s=&state;
    FILE *in;
-   int bytes, index;
+   int bytes, index, snapshot = 0;
    printf("Plasma emulator\n");
    memset(s, 0, sizeof(State));
    s->big_endian = 1;
@@ -936,6 +3145,26 @@ int main(int argc,char *argv[])
       printf("           mlite file.exe L   {for little_endian}\n");
       printf("           mlite file.exe BD  {disassemble big_endian}\n");
       printf("           mlite file.exe LD  {disassemble little_endian}\n");
+      printf("   Options:  -fast  {execute predecoded basic blocks}\n");
+      printf("             -jit   {also translate hot blocks to x86-64}\n");
+      printf("             -smp N {simulate N cores sharing memory}\n");
+      printf("             -quantum N  {SMP: opcodes per core per turn}\n");
+      printf("             -threads    {SMP: run each core on a host thread}\n");
+      printf("             -timing ddr|sram  {estimate clock cycles}\n");
+      printf("             -stages 2|3 {timing: pipeline stages}\n");
+      printf("             -profile N  {sample the PC every N opcodes}\n");
+      printf("             -sym file   {profile: ELF or test.map symbols}\n");
+      printf("             -folded file  {profile: write folded stacks}\n");
+      printf("             -batch {run without the debugger, exit with $a0 on\n");
+      printf("                     BREAK or SYSCALL n!=0, 124 at -max, 125 on error}\n");
+      printf("             -max N      {batch: opcode budget}\n");
+      printf("             -stop pc    {batch: exit 0 at this hex PC}\n");
+      printf("             -uart file  {write UART output to a file}\n");
+      printf("             -trace file {write a binary trace, see tracediff.c}\n");
+      printf("             -ethrx file {receive the frames of a pcap capture}\n");
+      printf("             -ethtx file {write transmitted frames to a pcap file}\n");
+      printf("             -save file  {save a snapshot on exit; run it with\n");
+      printf("                          \"mlite file\" to resume}\n");
 
       return 0;
    }
@@ -948,21 +3177,140 @@ int main(int argc,char *argv[])
    }
    bytes = fread(s->mem, 1, MEM_SIZE, in);
    fclose(in);
-   memcpy(s->mem + 1024*1024, s->mem, 1024*1024);  //internal 8KB SRAM
-   printf("Read %d bytes.\n", bytes);
+   if(bytes >= 8 && memcmp(s->mem, SNAPSHOT_MAGIC, 8) == 0)
+   {
+      free(s->mem);
+      snapshot = snapshot_read(s, argv[1]);
+      if(snapshot == 0)
+         return EXIT_ERROR;
+   }
+   else
+   {
+      memcpy(s->mem + 1024*1024, s->mem, 1024*1024);  //internal 8KB SRAM
+      printf("Read %d bytes.\n", bytes);
+   }
+   page_init(s);
    cache_init();
-   if(argc == 3 && argv[2][0] == 'B') 
+   for(index = 2; index < argc; ++index)
+   {
+      if(strcmp(argv[index], "-fast") == 0)
+         blockEnable = 1;
+      if(strcmp(argv[index], "-smp") == 0 && index + 1 < argc)
+         cpuCount = atoi(argv[++index]);
+      if(strcmp(argv[index], "-quantum") == 0 && index + 1 < argc)
+         cpuQuantum = atoi(argv[++index]);
+#ifndef WIN32
+      if(strcmp(argv[index], "-threads") == 0)
+         cpuThreads = 1;
+#endif
+      if(strcmp(argv[index], "-timing") == 0 && index + 1 < argc)
+      {
+         ++index;
+         timingEnable = strcmp(argv[index], "sram") == 0 ? TIMING_SRAM : TIMING_DDR;
+      }
+      if(strcmp(argv[index], "-stages") == 0 && index + 1 < argc)
+         timingStages = atoi(argv[++index]) == 3 ? 3 : 2;
+      if(strcmp(argv[index], "-profile") == 0 && index + 1 < argc)
+         profileRate = atoi(argv[++index]);
+      if(strcmp(argv[index], "-sym") == 0 && index + 1 < argc)
+         symbol_load(argv[++index]);
+      if(strcmp(argv[index], "-folded") == 0 && index + 1 < argc)
+         profileFolded = argv[++index];
+      if(strcmp(argv[index], "-batch") == 0)
+         batchMode = 1;
+      if(strcmp(argv[index], "-max") == 0 && index + 1 < argc)
+         batchBudget = strtoull(argv[++index], NULL, 0);
+      if(strcmp(argv[index], "-stop") == 0 && index + 1 < argc)
+         batchStop = strtoul(argv[++index], NULL, 16);
+      if(strcmp(argv[index], "-uart") == 0 && index + 1 < argc)
+      {
+         uartFile = fopen(argv[++index], "w");
+         if(uartFile == NULL)
+         {
+            printf("Can't open file %s!\n", argv[index]);
+            return EXIT_ERROR;
+         }
+         setvbuf(uartFile, NULL, _IOLBF, 1024);
+      }
+      if(strcmp(argv[index], "-trace") == 0 && index + 1 < argc)
+         trace_open(argv[++index]);
+      if(strcmp(argv[index], "-ethrx") == 0 && index + 1 < argc)
+      {
+         ethRxFile = eth_open(argv[++index], 0);
+         if(ethRxFile == NULL)
+            return EXIT_ERROR;
+      }
+      if(strcmp(argv[index], "-ethtx") == 0 && index + 1 < argc)
+      {
+         ethTxFile = eth_open(argv[++index], 1);
+         if(ethTxFile == NULL)
+            return EXIT_ERROR;
+      }
+      if(strcmp(argv[index], "-save") == 0 && index + 1 < argc)
+         snapshotSave = argv[++index];
+      if(strcmp(argv[index], "-jit") == 0)
+      {
+#ifdef ENABLE_JIT
+         blockEnable = jitEnable = 1;
+#else
+         printf("JIT not supported on this host, using -fast\n");
+         blockEnable = 1;
+#endif
+      }
+   }
+#ifdef ENABLE_CACHE
+   blockEnable = 0;  //blocks are tagged by virtual PC; stores may be write-back
+   cpuCount = 1;     //the MMU and write-back cache model one core
+#endif
+   if(cpuCount < 1 || cpuCount > CPU_COUNT_MAX || cpuQuantum < 1)
+   {
+      printf("Invalid -smp or -quantum value\n");
+      return 0;
+   }
+   if(cpuCount > 1 && blockEnable)
+   {
+      printf("-smp executes with cycle(); ignoring -fast and -jit\n");
+      blockEnable = 0;
+   }
+   if(timingEnable && cpuCount > 1)
+   {
+      printf("-timing models one core; ignoring -timing\n");
+      timingEnable = 0;
+   }
+   if((profileRate || traceFile) && cpuCount > 1)
+   {
+      printf("-profile and -trace follow one core; ignoring them\n");
+      profileRate = 0;
+      trace_close();
+   }
+   if((timingEnable || profileRate > 0 || traceFile) && blockEnable)
+   {
+      printf("-timing, -profile and -trace execute with cycle(); ignoring -fast and -jit\n");
+      blockEnable = 0;
+   }
+   if(profileRate < 0)
+      profileRate = 0;
+   if(timingEnable)
+      timing_init();
+   if(blockEnable)
+      block_init();
+#ifdef ENABLE_JIT
+   if(jitEnable && blockEnable)
+      jit_init();
+#endif
+   if(argc >= 3 && argv[2][0] == 'B') 
    {
       printf("Big Endian\n");
       s->big_endian = 1;
    }
-   if(argc == 3 && argv[2][0] == 'L') 
+   if(argc >= 3 && argv[2][0] == 'L') 
    {
       printf("Big Endian\n");
       s->big_endian = 0;
    }
-   s->processId = 0;
-   if(argc == 3 && argv[2][0] == 'S') 
+   if(snapshot == 0)
+      s->processId = 0;
+   if(argc >= 3 && argv[2][0] == 'S') 
    {  /*make big endian*/
       printf("Big Endian\n");
       for(index = 0; index < bytes+3; index += 4) 
@@ -974,7 +3322,7 @@ int main(int argc,char *argv[])
       fclose(in);
       return(0);
    }
-   if(argc == 3 && argv[2][1] == 'D') 
+   if(argc >= 3 && argv[2][1] == 'D') 
    {  /*dump image*/
       for(index = 0; index < bytes; index += 4) {
          s->pc = index;
@@ -983,12 +3331,32 @@ int main(int argc,char *argv[])
       free(s->mem);
       return(0);
    }
-   s->pc = 0x0;
-   index = mem_read(s, 4, 0);
-   if((index & 0xffffff00) == 0x3c1c1000)
-      s->pc = 0x10000000;
+   cpuState[0] = s;
+   for(index = 1; index < cpuCount; ++index)
+   {
+      if(cpuState[index])
+         continue;                     //restored from a snapshot
+      cpuState[index] = (State*)malloc(sizeof(State));
+      memset(cpuState[index], 0, sizeof(State));
+      cpuState[index]->mem = s->mem;
+      cpuState[index]->big_endian = s->big_endian;
+      cpuState[index]->cpuIndex = index;
+      cpuState[index]->halted = 1;
+   }
+   if(snapshot == 0)
+   {
+      s->pc = 0x0;
+      index = mem_read(s, 4, 0);
+      if((index & 0xffffff00) == 0x3c1c1000)
+         s->pc = 0x10000000;
+      s->pc_next = s->pc + 4;
+      s->skip = 0;
+   }
+   if(batchMode)
+      return batch_run(s);
    do_debug(s);
-   free(s->mem);
+   if(snapshotMapped == 0)
+      free(s->mem);
    return(0);
 }
 
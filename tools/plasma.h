@@ -28,6 +28,10 @@
 #define GPIOA_IN          0x20000050
 #define COUNTER_REG       0x20000060
 #define ETHERNET_REG      0x20000070
+#define CPU_INDEX_REG     0x20000100  //mlite -smp: read this CPU's index
+#define CPU_STACK_REG     0x20000110  //mlite -smp: next CPU's initial $sp
+#define CPU_START_REG     0x20000120  //mlite -smp: start next CPU at address
+#define ETHERNET_DESC_REG 0x20000130  //eth_dma receive descriptor ring
 #define FLASH_BASE        0x30000000
 
 /*********** GPIO out bits ***************/
@@ -36,6 +40,18 @@
 #define ETHERNET_MDC      0x00800000
 #define ETHERNET_ENABLE   0x01000000
 
+/*********** Ethernet receive descriptors ***********/
+//Write the address of ETHERNET_DESC_COUNT descriptors {buffer, status}
+//to ETHERNET_DESC_REG.  Software sets status to the buffer size.  The DMA
+//writes a frame without the preamble or FCS to the buffer, invalidating
+//the cache lines it writes, sets status to ETHERNET_DESC_DONE | length
+//and raises IRQ_ETHERNET_RECEIVE.  Reading ETHERNET_DESC_REG clears the
+//interrupt.  Frames are dropped while the next descriptor is still done.
+#define ETHERNET_DESC_COUNT   8
+#define ETHERNET_DESC_DONE    0x80000000
+#define ETHERNET_DESC_ERROR   0x40000000  //bad FCS or larger than the buffer
+#define ETHERNET_DESC_LENGTH  0x0000ffff
+
 /*********** Interrupt bits **************/
 #define IRQ_UART_READ_AVAILABLE  0x01
 #define IRQ_UART_WRITE_AVAILABLE 0x02
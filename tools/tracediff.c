@@ -0,0 +1,378 @@
+/***********************************************************
+| tracediff
+| Streams the binary traces written by "mlite -trace file".
+|    tracediff a.trc                 print the trace as text
+|    tracediff a.trc b.trc           compare two traces
+|    tracediff a.trc -vhdl trace.txt [addr we data]
+|        compare the stores with the binary tbench.vhd list
+|        written by "vhdle -list trace.txt".  The list columns
+|        default to cpu_address, cpu_byte_we and cpu_data_w
+|        found in the header; otherwise give their column numbers.
+| Files are read one record or line at a time so gigabyte
+| traces never have to fit in memory.
+************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define TRACE_MAGIC "PLTRACE1"
+#define TRACE_JUMP  0x01
+#define TRACE_REG   0x02
+#define TRACE_HILO  0x04
+#define TRACE_LOAD  0x08
+#define TRACE_STORE 0x10
+#define TRACE_SIZE_SHIFT 5
+#define TRACE_SIZE_PART  3     //SWL/SWR with a byte enable byte
+#define CONTEXT 8
+#define LINE_SIZE 1024
+
+typedef struct {
+   unsigned long long index;
+   unsigned int flags, pc, reg, value, hi, lo, address, data, we;
+} Record;
+
+typedef struct {
+   FILE *file;
+   const char *name;
+   unsigned long long index;
+   unsigned int pc, address;
+} Trace;
+
+static int trace_open(Trace *t, const char *name)
+{
+   char magic[8];
+
+   memset(t, 0, sizeof(Trace));
+   t->name = name;
+   t->file = fopen(name, "rb");
+   if(t->file == NULL)
+   {
+      printf("Can't open %s\n", name);
+      return 0;
+   }
+   if(fread(magic, 1, 8, t->file) != 8 || memcmp(magic, TRACE_MAGIC, 8))
+   {
+      printf("%s is not an mlite trace\n", name);
+      return 0;
+   }
+   return 1;
+}
+
+static unsigned int varint(Trace *t)
+{
+   unsigned int value = 0;
+   int shift = 0, ch;
+
+   do
+   {
+      ch = getc(t->file);
+      if(ch == EOF)
+         return 0;
+      value |= (unsigned int)(ch & 0x7f) << shift;
+      shift += 7;
+   } while(ch & 0x80);
+   return value;
+}
+
+static int unzigzag(unsigned int value)
+{
+   return (int)(value >> 1) ^ -(int)(value & 1);
+}
+
+//Returns 0 at the end of the trace
+static int trace_read(Trace *t, Record *r)
+{
+   int flags = getc(t->file);
+
+   if(flags == EOF)
+      return 0;
+   memset(r, 0, sizeof(Record));
+   r->index = t->index++;
+   r->flags = flags;
+   r->pc = t->pc + 4;
+   if(flags & TRACE_JUMP)
+      r->pc += unzigzag(varint(t)) << 2;
+   if(flags & TRACE_REG)
+   {
+      r->reg = getc(t->file);
+      r->value = varint(t);
+   }
+   if(flags & TRACE_HILO)
+   {
+      r->hi = varint(t);
+      r->lo = varint(t);
+   }
+   if(flags & (TRACE_LOAD | TRACE_STORE))
+   {
+      r->address = t->address + unzigzag(varint(t));
+      r->data = varint(t);
+      if(((flags >> TRACE_SIZE_SHIFT) & 3) == TRACE_SIZE_PART)
+         r->we = getc(t->file) & 0xf;
+      t->address = r->address;
+   }
+   t->pc = r->pc;
+   return 1;
+}
+
+static void record_print(const Record *r)
+{
+   printf("%10llu %8.8x", r->index, r->pc);
+   if(r->flags & TRACE_REG)
+      printf(" r%d=%8.8x", r->reg, r->value);
+   if(r->flags & TRACE_HILO)
+      printf(" hi=%8.8x lo=%8.8x", r->hi, r->lo);
+   if(r->flags & (TRACE_LOAD | TRACE_STORE))
+   {
+      if(((r->flags >> TRACE_SIZE_SHIFT) & 3) == TRACE_SIZE_PART)
+         printf(" stp [%8.8x]=%x we=%x", r->address, r->data, r->we);
+      else
+         printf(" %s%d [%8.8x]=%x", (r->flags & TRACE_STORE) ? "st" : "ld",
+            1 << ((r->flags >> TRACE_SIZE_SHIFT) & 3), r->address, r->data);
+   }
+   printf("\n");
+}
+
+static int dump(Trace *a)
+{
+   Record r;
+
+   while(trace_read(a, &r))
+      record_print(&r);
+   return 0;
+}
+
+static int compare(Trace *a, Trace *b)
+{
+   Record history[CONTEXT], ra, rb;
+   int more_a, more_b, i;
+
+   for(;;)
+   {
+      more_a = trace_read(a, &ra);
+      more_b = trace_read(b, &rb);
+      if(more_a == 0 || more_b == 0)
+         break;
+      if(memcmp(&ra, &rb, sizeof(Record)))
+      {
+         printf("Traces differ at record %llu\n", ra.index);
+         for(i = CONTEXT; i > 0; --i)
+         {
+            if(ra.index >= (unsigned)i)
+               record_print(&history[(ra.index - i) % CONTEXT]);
+         }
+         printf("%s:\n", a->name);
+         record_print(&ra);
+         printf("%s:\n", b->name);
+         record_print(&rb);
+         return 1;
+      }
+      history[ra.index % CONTEXT] = ra;
+   }
+   if(more_a != more_b)
+   {
+      printf("%s ends first after %llu records\n",
+         more_a ? b->name : a->name, more_a ? b->index : a->index);
+      return 1;
+   }
+   printf("Traces match (%llu records)\n", a->index);
+   return 0;
+}
+
+//Bus form of an mlite store as seen on cpu_byte_we and cpu_data_w
+static void store_bus(const Record *r, unsigned int *we, unsigned int *data)
+{
+   int size = (r->flags >> TRACE_SIZE_SHIFT) & 3, shift;
+
+   if(size == 0)
+   {
+      *we = 8 >> (r->address & 3);
+      *data = r->data * 0x01010101;
+   }
+   else if(size == 1)
+   {
+      *we = (r->address & 2) ? 0x3 : 0xc;
+      *data = r->data * 0x00010001;
+   }
+   else if(size == TRACE_SIZE_PART)
+   {
+      *we = r->we;                      //SWL/SWR
+      *data = r->data;
+   }
+   else
+   {
+      *we = 0xf;
+      *data = r->data;
+   }
+   for(shift = 0; shift < 4; ++shift)
+   {
+      if((*we & (1 << shift)) == 0)
+         *data &= ~(0xff << (shift * 8));
+   }
+}
+
+static int split(char *line, char **token)
+{
+   int count = 0;
+   char *ptr = strtok(line, " \t\r\n");
+
+   while(ptr && count < 256)
+   {
+      token[count++] = ptr;
+      ptr = strtok(NULL, " \t\r\n");
+   }
+   return count;
+}
+
+//Read a whole line growing the buffer as needed.  Returns 0 at the end.
+static int line_read(FILE *file, char **line, int *size)
+{
+   int length = 0;
+
+   for(;;)
+   {
+      if(fgets(*line + length, *size - length, file) == NULL)
+         return length != 0;
+      length += (int)strlen(*line + length);
+      if(length && (*line)[length - 1] == '\n')
+         return 1;
+      if(length == *size - 1)
+      {
+         *size *= 2;
+         *line = (char*)realloc(*line, *size);
+         if(*line == NULL)
+            return 0;
+      }
+   }
+}
+
+//The list shows vectors in binary; U, X or Z digits don't compare
+static int binary(const char *text, unsigned int *value)
+{
+   int i;
+
+   *value = 0;
+   for(i = 0; text[i]; ++i)
+   {
+      if((text[i] != '0' && text[i] != '1') || i >= 32)
+         return 0;
+      *value = (*value << 1) | (text[i] - '0');
+   }
+   return i > 0;
+}
+
+static int compare_vhdl(Trace *a, const char *name, int argc, char *argv[])
+{
+   FILE *file;
+   char *line, *token[256];
+   int col[3] = {-1, -1, -1}, header = 0, count, i, lineNum = 0;
+   int size = LINE_SIZE;
+   int found[3], j;
+   unsigned int value[3], last[3] = {0, 0, 0}, we, data, stores = 0;
+   const char *names[3] = {"cpu_address", "cpu_byte_we", "cpu_data_w"};
+   Record r;
+
+   file = fopen(name, "r");
+   if(file == NULL)
+   {
+      printf("Can't open %s\n", name);
+      return 2;
+   }
+   for(i = 0; i < 3 && i < argc; ++i)
+      col[i] = atoi(argv[i]);
+   line = (char*)malloc(size);
+   while(line && line_read(file, &line, &size))
+   {
+      ++lineNum;
+      if(line[0] == '=')
+         continue;                      //rule under the header
+      count = split(line, token);
+      if(header == 0 && argc < 3)
+      {
+         //Signal columns are aligned to the right of the time columns
+         memset(found, 0, sizeof(found));
+         for(i = 0; i < count; ++i)
+         {
+            for(j = 0; j < 3; ++j)
+            {
+               if(found[j] == 0 && strstr(token[i], names[j]))
+               {
+                  found[j] = i - count;
+                  break;
+               }
+            }
+         }
+         if(found[0] && found[1] && found[2])
+         {
+            memcpy(col, found, sizeof(col));
+            header = 1;
+         }
+         continue;
+      }
+      for(i = 0; i < 3; ++i)
+      {
+         int index = header ? count + col[i] : col[i];
+         if(index < 0 || index >= count || binary(token[index], &value[i]) == 0)
+            break;
+      }
+      if(i < 3 || value[1] == 0)
+      {
+         last[1] = 0;
+         continue;
+      }
+      if(value[0] == last[0] && value[1] == last[1] && value[2] == last[2])
+         continue;                      //same store over several samples
+      memcpy(last, value, sizeof(last));
+      do
+      {
+         if(trace_read(a, &r) == 0)
+         {
+            printf("%s ends before the store on line %d\n", a->name, lineNum);
+            return 1;
+         }
+      } while((r.flags & TRACE_STORE) == 0);
+      store_bus(&r, &we, &data);
+      for(i = 0; i < 4; ++i)
+      {
+         if((value[1] & (1 << i)) == 0)
+            value[2] &= ~(0xff << (i * 8));
+      }
+      if((r.address & ~3) != (value[0] & ~3) || we != value[1] || data != value[2])
+      {
+         printf("Store %u differs on line %d: address=%8.8x we=%x data=%8.8x\n",
+            stores, lineNum, value[0], value[1], value[2]);
+         record_print(&r);
+         return 1;
+      }
+      ++stores;
+   }
+   if(header == 0 && argc < 3)
+   {
+      printf("No %s, %s and %s columns in %s\n", names[0], names[1], names[2], name);
+      return 2;
+   }
+   printf("%u stores match\n", stores);
+   free(line);
+   fclose(file);
+   return 0;
+}
+
+int main(int argc, char *argv[])
+{
+   Trace a, b;
+
+   if(argc < 2)
+   {
+      printf("usage: tracediff a.trc [b.trc | -vhdl trace.txt [addr we data]]\n");
+      return 2;
+   }
+   if(trace_open(&a, argv[1]) == 0)
+      return 2;
+   if(argc == 2)
+      return dump(&a);
+   if(strcmp(argv[2], "-vhdl") == 0 && argc >= 4)
+      return compare_vhdl(&a, argv[3], argc - 4, argv + 4);
+   if(trace_open(&b, argv[2]) == 0)
+      return 2;
+   return compare(&a, &b);
+}